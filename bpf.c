@@ -122,6 +122,8 @@ static const char *bpf_dump_linux_k(uint32_t k)
 		return "#vlant";
 	case (SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT):
 		return "#vlanp";
+	case (SKF_AD_OFF + SKF_AD_RANDOM):
+		return "#rand";
 	}
 }
 
@@ -808,3 +810,301 @@ try_compile_str:
 }
 #endif
 }
+
+/*
+ * Snaplen by protocol on Ethernet: only the headers of TCP segments over
+ * IPv4 and IPv6, DNS over UDP or TCP in full, anything else up to the
+ * limit. The two returns at the end are filled in with the limit and the
+ * full length.
+ */
+static const struct sock_filter bpf_snap_hdr[] = {
+	BPF_STMT(BPF_LD_H | BPF_ABS, 12),		/* ethertype */
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, 0x0800, 1, 0),
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, 0x86dd, 18, 32),
+	BPF_STMT(BPF_LD_H | BPF_ABS, 20),		/* ipv4: fragments */
+	BPF_JUMP(BPF_JMP_JSET | BPF_K, 0x1fff, 30, 0),
+	BPF_STMT(BPF_LD_B | BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, IPPROTO_TCP, 1, 0),
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, IPPROTO_UDP, 0, 27),
+	BPF_STMT(BPF_LDX_B | BPF_MSH, 14),
+	BPF_STMT(BPF_LD_H | BPF_IND, 14),		/* ports */
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, 53, 25, 0),
+	BPF_STMT(BPF_LD_H | BPF_IND, 16),
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, 53, 23, 0),
+	BPF_STMT(BPF_LD_B | BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, IPPROTO_TCP, 0, 20),
+	BPF_STMT(BPF_LD_B | BPF_IND, 26),		/* tcp data offset */
+	BPF_STMT(BPF_ALU_AND | BPF_K, 0xf0),
+	BPF_STMT(BPF_ALU_RSH | BPF_K, 2),
+	BPF_STMT(BPF_ALU_ADD | BPF_X, 0),
+	BPF_STMT(BPF_ALU_ADD | BPF_K, 14),
+	BPF_STMT(BPF_RET | BPF_A, 0),
+	BPF_STMT(BPF_LD_B | BPF_ABS, 20),		/* ipv6: next header */
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, IPPROTO_TCP, 1, 0),
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, IPPROTO_UDP, 0, 11),
+	BPF_STMT(BPF_LD_H | BPF_ABS, 54),		/* ports */
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, 53, 10, 0),
+	BPF_STMT(BPF_LD_H | BPF_ABS, 56),
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, 53, 8, 0),
+	BPF_STMT(BPF_LD_B | BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, IPPROTO_TCP, 0, 5),
+	BPF_STMT(BPF_LD_B | BPF_ABS, 66),		/* tcp data offset */
+	BPF_STMT(BPF_ALU_AND | BPF_K, 0xf0),
+	BPF_STMT(BPF_ALU_RSH | BPF_K, 2),
+	BPF_STMT(BPF_ALU_ADD | BPF_K, 54),
+	BPF_STMT(BPF_RET | BPF_A, 0),
+	BPF_STMT(BPF_RET | BPF_K, 0),			/* limit */
+	BPF_STMT(BPF_RET | BPF_K, 0),			/* full */
+};
+
+#define BPF_SCRATCH	(BPF_MEMWORDS - 1)
+
+static int bpf_put(struct sock_filter *p, int n, uint16_t code, uint8_t jt,
+		   uint8_t jf, uint32_t k)
+{
+	if (p) {
+		p[n].code = code;
+		p[n].jt = jt;
+		p[n].jf = jf;
+		p[n].k = k;
+	}
+
+	return n + 1;
+}
+
+/*
+ * Tail that an accepting return of the rules jumps to instead. It drops
+ * other packet types and settles how much of the packet is accepted.
+ * Writes nothing if p is NULL, but still returns its length.
+ */
+static int bpf_tail(struct sock_filter *p, bool ret_a, uint32_t k,
+		    int pkttype, uint32_t snaplen, bool snaphdr)
+{
+	int n = 0;
+	uint32_t limit = snaplen ? min(snaplen, k) : k;
+
+	if (ret_a)
+		n = bpf_put(p, n, BPF_ST, 0, 0, BPF_SCRATCH);
+
+	if (pkttype >= 0) {
+		n = bpf_put(p, n, BPF_LD_W | BPF_ABS, 0, 0,
+			    SKF_AD_OFF + SKF_AD_PKTTYPE);
+		n = bpf_put(p, n, BPF_JMP_JEQ | BPF_K, 1, 0, pkttype);
+		n = bpf_put(p, n, BPF_RET | BPF_K, 0, 0, 0);
+	}
+
+	if (ret_a) {
+		n = bpf_put(p, n, BPF_LD | BPF_MEM, 0, 0, BPF_SCRATCH);
+		if (snaplen) {
+			n = bpf_put(p, n, BPF_JMP_JGT | BPF_K, 0, 1, snaplen);
+			n = bpf_put(p, n, BPF_RET | BPF_K, 0, 0, snaplen);
+		}
+		return bpf_put(p, n, BPF_RET | BPF_A, 0, 0, 0);
+	}
+
+	if (!snaphdr)
+		return bpf_put(p, n, BPF_RET | BPF_K, 0, 0, limit);
+
+	if (p) {
+		fmemcpy(&p[n], bpf_snap_hdr, sizeof(bpf_snap_hdr));
+		p[n + array_size(bpf_snap_hdr) - 2].k = limit;
+		p[n + array_size(bpf_snap_hdr) - 1].k = k;
+	}
+
+	return n + array_size(bpf_snap_hdr);
+}
+
+static bool bpf_accepts(const struct sock_filter *f)
+{
+	return f->code == (BPF_RET | BPF_A) ||
+	       (f->code == (BPF_RET | BPF_K) && f->k != 0);
+}
+
+/*
+ * Moves the packet type check and the snaplen into the kernel, so that
+ * neither unwanted packets nor unwanted bytes end up in the ring. Every
+ * accepting return of the rules becomes a jump to a tail, one per
+ * distinct return, appended to the program.
+ */
+void bpf_append_pkttype_snaplen(struct sock_fprog *bpf, int pkttype,
+				uint32_t snaplen, bool snaphdr)
+{
+	int i, j, len = bpf->len, nr = 0, size = 0;
+	int *target, *tails;
+	struct sock_filter *rets, *f;
+
+	if (pkttype < 0 && snaplen == 0 && !snaphdr)
+		return;
+
+	target = xmalloc(len * sizeof(*target));
+	tails = xmalloc(len * sizeof(*tails));
+	rets = xmalloc(len * sizeof(*rets));
+
+	for (i = 0; i < len; ++i) {
+		f = &bpf->filter[i];
+		if (!bpf_accepts(f))
+			continue;
+
+		for (j = 0; j < nr; ++j)
+			if (rets[j].code == f->code && rets[j].k == f->k)
+				break;
+		if (j == nr) {
+			rets[nr] = *f;
+			tails[nr] = len + size;
+			size += bpf_tail(NULL, f->code == (BPF_RET | BPF_A),
+					 f->k, pkttype, snaplen, snaphdr);
+			nr++;
+		}
+
+		target[i] = tails[j];
+	}
+
+	if (len + size > BPF_MAXINSNS)
+		panic("BPF program too large for pkttype and snaplen!\n");
+
+	bpf->filter = xrealloc(bpf->filter, 1,
+			       (len + size) * sizeof(struct sock_filter));
+	bpf->len = len + size;
+
+	for (j = 0; j < nr; ++j)
+		bpf_tail(&bpf->filter[tails[j]],
+			 rets[j].code == (BPF_RET | BPF_A), rets[j].k,
+			 pkttype, snaplen, snaphdr);
+
+	for (i = 0; i < len; ++i) {
+		f = &bpf->filter[i];
+		if (!bpf_accepts(f))
+			continue;
+
+		f->code = BPF_JMP_JA;
+		f->jt = f->jf = 0;
+		f->k = target[i] - (i + 1);
+	}
+
+	xfree(rets);
+	xfree(tails);
+	xfree(target);
+
+	if (__bpf_validate(bpf) == 0)
+		panic("This is not a valid BPF program!\n");
+}
+
+static const struct sock_filter bpf_sample_rand[] = {
+	BPF_STMT(BPF_LD_W | BPF_ABS, SKF_AD_OFF + SKF_AD_RANDOM),
+	BPF_STMT(BPF_ALU_MOD | BPF_K, 1),		/* rate */
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, 0, 1, 0),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+/*
+ * Hashes IPv4 and IPv6 addresses and TCP or UDP ports with xor, so that
+ * both directions of a flow end up in the same bucket. Other frames fall
+ * back to the flow hash of the kernel, if any.
+ */
+static const struct sock_filter bpf_sample_flow[] = {
+	BPF_STMT(BPF_LD_H | BPF_ABS, 12),		/* ethertype */
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, 0x0800, 0, 12),
+	BPF_STMT(BPF_LD_W | BPF_ABS, 26),		/* ipv4: addresses */
+	BPF_STMT(BPF_MISC_TAX, 0),
+	BPF_STMT(BPF_LD_W | BPF_ABS, 30),
+	BPF_STMT(BPF_ALU_XOR | BPF_X, 0),
+	BPF_STMT(BPF_ST, BPF_SCRATCH),
+	BPF_STMT(BPF_LD_H | BPF_ABS, 20),		/* fragments */
+	BPF_JUMP(BPF_JMP_JSET | BPF_K, 0x1fff, 42, 0),
+	BPF_STMT(BPF_LD_B | BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, IPPROTO_TCP, 1, 0),
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, IPPROTO_UDP, 0, 39),
+	BPF_STMT(BPF_LDX_B | BPF_MSH, 14),
+	BPF_STMT(BPF_JMP_JA, 28),
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, 0x86dd, 0, 38),
+	BPF_STMT(BPF_LD_W | BPF_ABS, 22),		/* ipv6: addresses */
+	BPF_STMT(BPF_MISC_TAX, 0),
+	BPF_STMT(BPF_LD_W | BPF_ABS, 26),
+	BPF_STMT(BPF_ALU_XOR | BPF_X, 0),
+	BPF_STMT(BPF_MISC_TAX, 0),
+	BPF_STMT(BPF_LD_W | BPF_ABS, 30),
+	BPF_STMT(BPF_ALU_XOR | BPF_X, 0),
+	BPF_STMT(BPF_MISC_TAX, 0),
+	BPF_STMT(BPF_LD_W | BPF_ABS, 34),
+	BPF_STMT(BPF_ALU_XOR | BPF_X, 0),
+	BPF_STMT(BPF_MISC_TAX, 0),
+	BPF_STMT(BPF_LD_W | BPF_ABS, 38),
+	BPF_STMT(BPF_ALU_XOR | BPF_X, 0),
+	BPF_STMT(BPF_MISC_TAX, 0),
+	BPF_STMT(BPF_LD_W | BPF_ABS, 42),
+	BPF_STMT(BPF_ALU_XOR | BPF_X, 0),
+	BPF_STMT(BPF_MISC_TAX, 0),
+	BPF_STMT(BPF_LD_W | BPF_ABS, 46),
+	BPF_STMT(BPF_ALU_XOR | BPF_X, 0),
+	BPF_STMT(BPF_MISC_TAX, 0),
+	BPF_STMT(BPF_LD_W | BPF_ABS, 50),
+	BPF_STMT(BPF_ALU_XOR | BPF_X, 0),
+	BPF_STMT(BPF_ST, BPF_SCRATCH),
+	BPF_STMT(BPF_LD_B | BPF_ABS, 20),		/* next header */
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, IPPROTO_TCP, 1, 0),
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, IPPROTO_UDP, 0, 10),
+	BPF_STMT(BPF_LDX | BPF_IMM, 40),
+	BPF_STMT(BPF_LD_W | BPF_IND, 14),		/* ports */
+	BPF_STMT(BPF_MISC_TAX, 0),
+	BPF_STMT(BPF_ALU_RSH | BPF_K, 16),
+	BPF_STMT(BPF_ALU_XOR | BPF_X, 0),
+	BPF_STMT(BPF_ALU_AND | BPF_K, 0xffff),
+	BPF_STMT(BPF_MISC_TAX, 0),
+	BPF_STMT(BPF_LD | BPF_MEM, BPF_SCRATCH),
+	BPF_STMT(BPF_ALU_XOR | BPF_X, 0),
+	BPF_STMT(BPF_JMP_JA, 3),
+	BPF_STMT(BPF_LD | BPF_MEM, BPF_SCRATCH),	/* addresses only */
+	BPF_STMT(BPF_JMP_JA, 1),
+	BPF_STMT(BPF_LD_W | BPF_ABS, SKF_AD_OFF + SKF_AD_RXHASH),
+	BPF_STMT(BPF_ALU_MUL | BPF_K, 0x9e3779b1),	/* mix */
+	BPF_STMT(BPF_MISC_TAX, 0),
+	BPF_STMT(BPF_ALU_RSH | BPF_K, 16),
+	BPF_STMT(BPF_ALU_XOR | BPF_X, 0),
+	BPF_STMT(BPF_ALU_MOD | BPF_K, 1),		/* rate */
+	BPF_JUMP(BPF_JMP_JEQ | BPF_K, 0, 1, 0),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+/* Without Ethernet headers, flows are told apart by the kernel's hash */
+#define BPF_SAMPLE_FLOW_RXHASH	53
+
+/*
+ * Only lets every rate-th packet, or every rate-th flow, through to the
+ * rules, so that an overloaded capture thins out evenly instead of losing
+ * whatever does not fit into the ring. The sampling code goes in front of
+ * the rules, which keep their jump offsets.
+ */
+void bpf_prepend_sample(struct sock_fprog *bpf, int mode, uint32_t rate,
+			bool ether)
+{
+	const struct sock_filter *pre = bpf_sample_rand;
+	size_t size = array_size(bpf_sample_rand);
+	struct sock_filter *filter;
+
+	if (rate <= 1)
+		return;
+
+	if (mode == BPF_SAMPLE_FLOW) {
+		pre = bpf_sample_flow;
+		size = array_size(bpf_sample_flow);
+		if (!ether) {
+			pre += BPF_SAMPLE_FLOW_RXHASH;
+			size -= BPF_SAMPLE_FLOW_RXHASH;
+		}
+	}
+
+	if (bpf->len + size > BPF_MAXINSNS)
+		panic("BPF program too large for sampling!\n");
+
+	filter = xmalloc((bpf->len + size) * sizeof(*filter));
+	fmemcpy(filter, pre, size * sizeof(*filter));
+	fmemcpy(&filter[size], bpf->filter, bpf->len * sizeof(*filter));
+	filter[size - 3].k = rate;
+
+	xfree(bpf->filter);
+	bpf->filter = filter;
+	bpf->len += size;
+
+	if (__bpf_validate(bpf) == 0)
+		panic("This is not a valid BPF program!\n");
+}
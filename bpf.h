@@ -11,6 +11,7 @@
 #include <linux/filter.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 #include "xmalloc.h"
 
@@ -23,6 +24,13 @@ extern void bpf_attach_to_sock(int sock, struct sock_fprog *bpf);
 extern void bpf_detach_from_sock(int sock);
 extern int enable_kernel_bpf_jit_compiler(void);
 extern void bpf_parse_rules(char *dev, char *rulefile, struct sock_fprog *bpf);
+extern void bpf_append_pkttype_snaplen(struct sock_fprog *bpf, int pkttype,
+				       uint32_t snaplen, bool snaphdr);
+extern void bpf_prepend_sample(struct sock_fprog *bpf, int mode, uint32_t rate,
+			       bool ether);
+
+#define BPF_SAMPLE_RANDOM	0	/* Every packet by chance */
+#define BPF_SAMPLE_FLOW		1	/* Whole flows, both directions */
 
 static inline void bpf_release(struct sock_fprog *bpf)
 {
@@ -137,5 +145,8 @@ static inline void bpf_release(struct sock_fprog *bpf)
 #ifndef SKF_AD_VLAN_TAG_PRESENT
 # define SKF_AD_VLAN_TAG_PRESENT 48
 #endif
+#ifndef SKF_AD_RANDOM
+# define SKF_AD_RANDOM 56
+#endif
 
 #endif /* BPF_H */
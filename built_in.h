@@ -161,6 +161,18 @@ typedef uint8_t		u8;
 # define bug()			assert(0)
 #endif
 
+#ifndef prefetch_rd
+# define prefetch_rd(addr)	__builtin_prefetch((addr), 0, 3)
+#endif
+
+#ifndef cpu_relax
+# if defined(__amd64__) || defined(__x86_64__) || defined(__i386__)
+#  define cpu_relax()		__asm__ __volatile__("rep; nop" ::: "memory")
+# else
+#  define cpu_relax()		__asm__ __volatile__("" ::: "memory")
+# endif
+#endif
+
 #define PAGE_SIZE		(getpagesize())
 #define PAGE_MASK		(~(PAGE_SIZE - 1))
 #define PAGE_ALIGN(addr)	(((addr) + PAGE_SIZE - 1) & PAGE_MASK)
@@ -33,10 +33,13 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/fsuid.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <linux/if_ether.h>
 
 #include "ring_rx.h"
 #include "ring_tx.h"
@@ -50,6 +53,13 @@
 #include "tprintf.h"
 #include "dissector.h"
 #include "xmalloc.h"
+#include "spsc_queue.h"
+#include "pcap_index.h"
+#include "pcap_pool.h"
+#include "pcap_trigger.h"
+#include "telemetry.h"
+#include "shm_ring.h"
+#include "pcap_stream.h"
 
 enum dump_mode {
 	DUMP_INTERVAL_TIME,
@@ -58,18 +68,41 @@ enum dump_mode {
 
 struct ctx {
 	char *device_in, *device_out, *device_trans, *filter, *prefix;
+	char *trigger_filter, *telemetry, *publish, *stream, *collect, **devices;
 	int cpu, rfraw, dump, print_mode, dump_dir, packet_type, verbose;
 	unsigned long kpull, dump_interval, reserve_size, tx_bytes, tx_packets;
-	bool randomize, promiscuous, enforce, jumbo, dump_bpf;
+	unsigned long trigger_mem, publish_size;
+	bool randomize, promiscuous, enforce, jumbo, dump_bpf, v3, writer, index;
+	bool snaphdr, numa, sample_auto, xdp, stream_zlib;
+	unsigned int block_tov, workers, fanout_id, fanout_type, keep, trigger;
+	unsigned int trigger_drops;
+	unsigned int spin, spin_usecs, busy_poll, merge, merge_window;
+	int numa_node, sample_mode;
+	struct sock_fprog trigger_ops;
+	struct shm_ring *shm;
 	enum pcap_ops_groups pcap; enum dump_mode dump_mode;
-	uid_t uid; gid_t gid; uint32_t link_type, magic;
+	uid_t uid; gid_t gid; uint32_t link_type, magic, time_from, time_to;
+	uint32_t snaplen, sample_rate;
 };
 
 volatile sig_atomic_t sigint = 0;
 
-static volatile bool next_dump = false;
+static volatile sig_atomic_t dump_gen = 0;
+static volatile sig_atomic_t trigger_gen = 0;
+
+/* Long options without a short one */
+enum {
+	OPT_TELEMETRY = 256,
+	OPT_MERGE_WINDOW,
+	OPT_XDP,
+	OPT_PUBLISH,
+	OPT_PUBLISH_SIZE,
+	OPT_VMSPLICE,
+	OPT_STREAM,
+	OPT_COLLECT,
+};
 
-static const char *short_options = "d:i:o:rf:MJt:S:k:n:b:HQmcsqXlvhF:RGAP:Vu:g:T:DB";
+static const char *short_options = "d:i:o:rf:MJt:S:k:n:b:HQmcsqXlvhF:RGAP:Vu:g:T:DB3W:w:xUOIa:z:ZK:e:E:Y:C:L:y:p:Nj:";
 static const struct option long_options[] = {
 	{"dev",			required_argument,	NULL, 'd'},
 	{"in",			required_argument,	NULL, 'i'},
@@ -85,15 +118,43 @@ static const struct option long_options[] = {
 	{"user",		required_argument,	NULL, 'u'},
 	{"group",		required_argument,	NULL, 'g'},
 	{"magic",		required_argument,	NULL, 'T'},
+	{"block-timeout",	required_argument,	NULL, 'W'},
+	{"workers",		required_argument,	NULL, 'w'},
+	{"time-from",		required_argument,	NULL, 'a'},
+	{"time-to",		required_argument,	NULL, 'z'},
+	{"keep",		required_argument,	NULL, 'K'},
+	{"trigger",		required_argument,	NULL, 'e'},
+	{"trigger-filter",	required_argument,	NULL, 'E'},
+	{"trigger-drops",	required_argument,	NULL, 'Y'},
+	{"trigger-mem",		required_argument,	NULL, 'C'},
+	{"snaplen",		required_argument,	NULL, 'L'},
+	{"spin",		required_argument,	NULL, 'y'},
+	{"busy-poll",		required_argument,	NULL, 'p'},
+	{"sample",		required_argument,	NULL, 'j'},
+	{"telemetry",		required_argument,	NULL, OPT_TELEMETRY},
+	{"merge-window",	required_argument,	NULL, OPT_MERGE_WINDOW},
+	{"publish",		required_argument,	NULL, OPT_PUBLISH},
+	{"publish-size",	required_argument,	NULL, OPT_PUBLISH_SIZE},
+	{"stream",		required_argument,	NULL, OPT_STREAM},
+	{"collect",		required_argument,	NULL, OPT_COLLECT},
 	{"rand",		no_argument,		NULL, 'r'},
 	{"rfraw",		no_argument,		NULL, 'R'},
 	{"mmap",		no_argument,		NULL, 'm'},
 	{"sg",			no_argument,		NULL, 'G'},
+	{"uring",		no_argument,		NULL, 'U'},
+	{"direct",		no_argument,		NULL, 'O'},
+	{"vmsplice",		no_argument,		NULL, OPT_VMSPLICE},
+	{"compress",		no_argument,		NULL, 'Z'},
 	{"clrw",		no_argument,		NULL, 'c'},
 	{"jumbo-support",	no_argument,		NULL, 'J'},
+	{"tpacket-v3",		no_argument,		NULL, '3'},
+	{"writer-thread",	no_argument,		NULL, 'x'},
+	{"xdp",			no_argument,		NULL, OPT_XDP},
+	{"index",		no_argument,		NULL, 'I'},
 	{"no-promisc",		no_argument,		NULL, 'M'},
 	{"prio-high",		no_argument,		NULL, 'H'},
 	{"notouch-irq",		no_argument,		NULL, 'Q'},
+	{"no-numa",		no_argument,		NULL, 'N'},
 	{"dump-pcap-types",	no_argument,		NULL, 'D'},
 	{"dump-bpf",		no_argument,		NULL, 'B'},
 	{"silent",		no_argument,		NULL, 's'},
@@ -112,12 +173,90 @@ static int tx_sock;
 static struct itimerval itimer;
 
 static unsigned long frame_count_max = 0, interval = TX_KERNEL_PULL_INT;
+static unsigned long frame_count_total = 0;
+
+/* Poll timeout in ms, so that workers notice a pending sigint */
+#define WORKER_POLL_TIMEOUT	100
+/* Writer yields this often on an empty queue, then backs off in us */
+#define WRITER_IDLE_SPINS	64
+#define WRITER_IDLE_US		50
+/* Memory for packets held back until a trigger, split among workers */
+#define TRIGGER_MEM_DEFAULT	(64UL << 20)
+/* Automatic sampling tightens at this share of drops in a second */
+#define SAMPLE_AUTO_DROPS	1
+/* ... and loosens again after as many seconds without drops */
+#define SAMPLE_AUTO_CALM	10
+#define SAMPLE_AUTO_MAX		(1U << 16)
+/* Telemetry is sampled this often, packet ages of one frame out of many */
+#define TELEMETRY_INTERVAL	1000000000ULL
+#define TELEMETRY_AGE_EVERY	64
+/* Packets of merged devices may arrive this many ms out of order */
+#define MERGE_WINDOW_DEFAULT	10
+/* Records of published packets, rounded up to a power of two */
+#define PUBLISH_SIZE_DEFAULT	(64UL << 20)
+#define PUBLISH_SIZE_MIN	(1UL << 20)
+
+struct writer_struct {
+	pthread_t trid;
+	struct spsc_queue queue;
+	bool ready, done;
+	unsigned int max_depth;
+	unsigned long written, stalls;
+	/* Time of the last slot written, for telemetry */
+	uint64_t last_ns;
+};
+
+struct worker_struct {
+	pthread_t trid;
+	unsigned int id;
+	int cpu, sock, fd;
+	char *dev;
+	struct ctx *ctx;
+	struct ring rx_ring;
+	struct pollfd rx_poll;
+	struct rx_spin spin;
+	struct tpacket_stats kstats;
+	unsigned long frame_count, skipped, dump_bytes, bytes, freezes;
+	/* Slot the worker looks at next */
+	unsigned int ring_next;
+	uint64_t age[TELEMETRY_AGE_BUCKETS];
+	sig_atomic_t dump_gen;
+	struct writer_struct wr;
+	struct pcap_index idx;
+	struct pcap_pool *pool;
+	struct pcap_trigger trig;
+	bool trig_pass;
+	sig_atomic_t trig_gen;
+	uint32_t trig_sec;
+	uint64_t trig_until;
+	unsigned int trig_packets, trig_drops;
+	unsigned long trig_events;
+	struct sock_fprog *bpf_ops;
+	int sample_fd;
+	uint32_t sample_rate, sample_sec;
+	unsigned int sample_packets, sample_drops, sample_calm, sample_changes;
+	/* Second since when << 32 | rate, shared with the writer thread */
+	uint64_t sample, sample_logged;
+};
+
+struct pcap_worker_struct {
+	pthread_t trid;
+	unsigned int id;
+	int cpu, fd, fdo;
+	struct ctx *ctx;
+	struct sock_fprog *bpf_ops;
+	off_t start, end;
+	unsigned long packets, bytes, trunced;
+};
 
 #define __pcap_io		pcap_ops[ctx->pcap]
 
 static void signal_handler(int number)
 {
 	switch (number) {
+	case SIGUSR1:
+		trigger_gen++;
+		break;
 	case SIGINT:
 		sigint = 1;
 	case SIGHUP:
@@ -136,7 +275,7 @@ static void timer_elapsed(int unused)
 static void timer_next_dump(int unused)
 {
 	set_itimer_interval_value(&itimer, interval, 0);
-	next_dump = true;
+	dump_gen++;
 	setitimer(ITIMER_REAL, &itimer, NULL);
 }
 
@@ -145,13 +284,159 @@ static inline bool dump_to_pcap(struct ctx *ctx)
 	return ctx->dump;
 }
 
+static inline bool dump_on_trigger(struct ctx *ctx)
+{
+	return ctx->trigger > 0;
+}
+
+/* Compressed pcaps are read through zlib, whatever I/O method was asked for */
+static void select_pcap_read_ops(struct ctx *ctx, int fd)
+{
+	uint8_t magic[2];
+
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+	    magic[0] != 0x1f || magic[1] != 0x8b)
+		return;
+
+	if (!pcap_ops[PCAP_OPS_ZLIB])
+		panic("No zlib pcap I/O support compiled in!\n");
+
+	ctx->pcap = PCAP_OPS_ZLIB;
+}
+
+/* < 0 before --time-from, > 0 from --time-to on, 0 in between */
+static inline int pcap_time_cmp(struct ctx *ctx, pcap_pkthdr_t *phdr)
+{
+	struct tpacket2_hdr thdr;
+	struct sockaddr_ll sll;
+
+	if (!ctx->time_from && !ctx->time_to)
+		return 0;
+
+	pcap_pkthdr_to_tpacket_hdr(phdr, ctx->magic, &thdr, &sll);
+
+	if (thdr.tp_sec < ctx->time_from)
+		return -1;
+	if (ctx->time_to && thdr.tp_sec >= ctx->time_to)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Without an index, narrow down the offset of --time-from by bisecting
+ * the file on resynchronized record boundaries, until the rest can be
+ * scanned. Records are assumed to be roughly in time order. Probes only
+ * cover a small window, so that mm neither maps nor locks the rest of
+ * the file on every step.
+ */
+#define PCAP_BISECT_MIN		(1 << 20)
+
+static off_t bisect_pcap_file(struct ctx *ctx, int fd, off_t lo, off_t hi)
+{
+	off_t mid, off, probe, end = hi;
+	uint8_t *packet, *bounce;
+	size_t bounce_len = PCAP_MAX_SNAPSHOT_LEN;
+	pcap_pkthdr_t phdr;
+	ssize_t ret;
+
+	bounce = xmalloc(bounce_len);
+
+	while (hi - lo > PCAP_BISECT_MIN) {
+		mid = lo + (hi - lo) / 2;
+		probe = min(mid + PCAP_SEEK_PROBE, end);
+
+		off = __pcap_io->seek_pcap(fd, ctx->magic, mid, probe);
+		if (off >= min(hi, probe)) {
+			hi = mid;
+			continue;
+		}
+
+		ret = pcap_read_zc(__pcap_io, fd, &phdr, ctx->magic, &packet,
+				   bounce, bounce_len);
+		if (ret < 0 || pcap_time_cmp(ctx, &phdr) >= 0)
+			hi = mid;
+		else
+			lo = off;
+	}
+
+	xfree(bounce);
+
+	return lo;
+}
+
+/*
+ * Gets the pcap ready for reading its records, starting close to
+ * --time-from if given: at the offset from the sidecar index if there
+ * is one, else at one found by bisection where the backend can seek.
+ */
+static void prepare_pcap_read(struct ctx *ctx, int fd)
+{
+	int ret;
+	struct stat sb;
+	off_t off;
+	const char *how = "scan";
+
+	if (!ctx->time_from || fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode))
+		goto sequential;
+
+	off = lseek(fd, 0, SEEK_CUR);
+	if (off < 0)
+		goto sequential;
+
+	if (pcap_index_lookup(ctx->device_in, fd, ctx->time_from, &off) == 0) {
+		how = "index";
+	} else if (__pcap_io->seek_pcap) {
+		off = bisect_pcap_file(ctx, fd, off, sb.st_size);
+		how = "bisection";
+	}
+
+	if (ctx->verbose)
+		printf("Seeking to offset %lld (%s)\n", (long long) off, how);
+
+	if (__pcap_io->seek_pcap) {
+		__pcap_io->seek_pcap(fd, ctx->magic, off, sb.st_size);
+		return;
+	}
+
+	if (lseek(fd, off, SEEK_SET) < 0)
+		panic("Cannot seek in pcap!\n");
+
+sequential:
+	if (__pcap_io->prepare_access_pcap) {
+		ret = __pcap_io->prepare_access_pcap(fd, PCAP_MODE_RD, ctx->jumbo);
+		if (ret)
+			panic("Error prepare reading pcap!\n");
+	}
+}
+
+/* Spreads the interrupt vectors of a device over the given CPUs */
+static int bind_irqs(struct ctx *ctx, const char *dev, const int *cpus,
+		     unsigned int ncpus, struct irq_affinity *aff)
+{
+	unsigned int i;
+	int bound;
+
+	bound = device_spread_irqs(dev, cpus, ncpus, aff);
+
+	for (i = 0; ctx->verbose && i < aff->nr; ++i) {
+		if (aff->vec[i].cpu >= 0)
+			printf("IRQ: %s:%d > CPU%d\n", dev, aff->vec[i].irq,
+			       aff->vec[i].cpu);
+	}
+
+	return bound;
+}
+
 static void pcap_to_xmit(struct ctx *ctx)
 {
 	__label__ out;
-	uint8_t *out = NULL;
-	int irq, ifindex, fd = 0, ret;
+	uint8_t *out = NULL, *packet, *bounce;
+	int ifindex, fd = 0, ret, when = 0;
 	unsigned int size, it = 0;
 	unsigned long trunced = 0;
+	size_t bounce_len, room;
+	struct irq_affinity irq_aff;
 	struct ring tx_ring;
 	struct frame_map *hdr;
 	struct sock_fprog bpf_ops;
@@ -174,15 +459,13 @@ static void pcap_to_xmit(struct ctx *ctx)
 		fd = open_or_die(ctx->device_in, O_RDONLY | O_LARGEFILE | O_NOATIME);
 	}
 
+	select_pcap_read_ops(ctx, fd);
+
 	ret = __pcap_io->pull_fhdr_pcap(fd, &ctx->magic, &ctx->link_type);
 	if (ret)
 		panic("Error reading pcap header!\n");
 
-	if (__pcap_io->prepare_access_pcap) {
-		ret = __pcap_io->prepare_access_pcap(fd, PCAP_MODE_RD, ctx->jumbo);
-		if (ret)
-			panic("Error prepare reading pcap!\n");
-	}
+	prepare_pcap_read(ctx, fd);
 
 	fmemset(&tx_ring, 0, sizeof(tx_ring));
 	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
@@ -215,14 +498,9 @@ static void pcap_to_xmit(struct ctx *ctx)
 
 	dissector_init_all(ctx->print_mode);
 
-	if (ctx->cpu >= 0 && ifindex > 0) {
-		irq = device_irq_number(ctx->device_out);
-		device_bind_irq_to_cpu(irq, ctx->cpu);
-
-		if (ctx->verbose)
-			printf("IRQ: %s:%d > CPU%d\n",
-			       ctx->device_out, irq, ctx->cpu);
-	}
+	fmemset(&irq_aff, 0, sizeof(irq_aff));
+	if (ctx->cpu >= 0 && ifindex > 0)
+		bind_irqs(ctx, ctx->device_out, &ctx->cpu, 1, &irq_aff);
 
 	if (ctx->kpull)
 		interval = ctx->kpull;
@@ -237,26 +515,35 @@ static void pcap_to_xmit(struct ctx *ctx)
 
 	bug_on(gettimeofday(&start, NULL));
 
+	/* Records are filtered in place and only copied once into the ring */
+	room = ring_frame_size(&tx_ring) - (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll));
+	bounce_len = round_up(PCAP_DEFAULT_SNAPSHOT_LEN, PAGE_SIZE);
+	bounce = xmalloc_aligned(bounce_len, CO_CACHE_LINE_SIZE);
+
 	while (likely(sigint == 0)) {
 		while (user_may_pull_from_tx(tx_ring.frames[it].iov_base)) {
 			hdr = tx_ring.frames[it].iov_base;
 			out = ((uint8_t *) hdr) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
 
 			do {
-				ret = __pcap_io->read_pcap(fd, &phdr, ctx->magic, out,
-							   ring_frame_size(&tx_ring));
+				ret = pcap_read_zc(__pcap_io, fd, &phdr, ctx->magic,
+						   &packet, bounce, bounce_len);
 				if (unlikely(ret <= 0))
 					goto out;
 
-				if (ring_frame_size(&tx_ring) <
-				    pcap_get_length(&phdr, ctx->magic)) {
-					pcap_set_length(&phdr, ctx->magic,
-							ring_frame_size(&tx_ring));
+				if (room < pcap_get_length(&phdr, ctx->magic)) {
+					pcap_set_length(&phdr, ctx->magic, room);
 					trunced++;
 				}
-			} while (ctx->filter &&
-				 !bpf_run_filter(&bpf_ops, out,
-						 pcap_get_length(&phdr, ctx->magic)));
+
+				when = pcap_time_cmp(ctx, &phdr);
+				if (unlikely(when > 0))
+					goto out;
+			} while (when < 0 || (ctx->filter &&
+				 !bpf_run_filter(&bpf_ops, packet,
+						 pcap_get_length(&phdr, ctx->magic))));
+
+			fmemcpy(out, packet, pcap_get_length(&phdr, ctx->magic));
 
 			pcap_pkthdr_to_tpacket_hdr(&phdr, ctx->magic, &hdr->tp_h, &hdr->s_ll);
 
@@ -296,6 +583,10 @@ static void pcap_to_xmit(struct ctx *ctx)
 	dissector_cleanup_all();
 	destroy_tx_ring(tx_sock, &tx_ring);
 
+	device_restore_irqs(&irq_aff);
+
+	xfree(bounce);
+
 	if (ctx->rfraw)
 		leave_rfmon_mac80211(ctx->device_trans, ctx->device_out);
 
@@ -317,16 +608,42 @@ static void pcap_to_xmit(struct ctx *ctx)
 	printf("\r%12lu sec, %lu usec in total\n", diff.tv_sec, diff.tv_usec);
 }
 
+/*
+ * Largest packet the ring has to hold, 0 to keep the default frames.
+ * GRO/LRO hand us packets way beyond the MTU, so frames only shrink
+ * when -L len truncates them anyway. With hdr, DNS and the rest can
+ * still come in full.
+ */
+static unsigned int rx_snaplen(struct ctx *ctx, bool truncate)
+{
+	int mtu;
+
+	if (!truncate || !ctx->snaplen || ctx->snaphdr)
+		return 0;
+
+	/* Link layer header and a VLAN tag on top of the MTU */
+	mtu = ctx->rfraw ? 0 : device_mtu(ctx->device_in);
+	if (mtu > 0)
+		return min((unsigned int) mtu + ETH_HLEN + 4, ctx->snaplen);
+
+	return ctx->snaplen;
+}
+
 static void receive_to_xmit(struct ctx *ctx)
 {
 	short ifflags = 0;
 	uint8_t *in, *out;
 	int rx_sock, ifindex_in, ifindex_out;
-	unsigned int size_in, size_out, it_in = 0, it_out = 0;
+	unsigned int size_in, size_out, it_out = 0;
 	unsigned long frame_count = 0;
 	struct frame_map *hdr_in, *hdr_out;
 	struct ring tx_ring, rx_ring;
+	struct rx_consumer rx_cons;
 	struct pollfd rx_poll;
+	struct rx_spin spin = {
+		.num = ctx->spin,
+		.usecs = ctx->spin_usecs,
+	};
 	struct sock_fprog bpf_ops;
 
 	if (!strncmp(ctx->device_in, ctx->device_out, IFNAMSIZ))
@@ -353,16 +670,21 @@ static void receive_to_xmit(struct ctx *ctx)
 	enable_kernel_bpf_jit_compiler();
 
 	bpf_parse_rules(ctx->device_in, ctx->filter, &bpf_ops);
+	/* Frames go out again as they are, so only the type is checked */
+	bpf_append_pkttype_snaplen(&bpf_ops, ctx->packet_type, 0, false);
 	if (ctx->dump_bpf)
 		bpf_dump_all(&bpf_ops);
 	bpf_attach_to_sock(rx_sock, &bpf_ops);
 
-	setup_rx_ring_layout(rx_sock, &rx_ring, size_in, ctx->jumbo);
+	setup_rx_ring_layout(rx_sock, &rx_ring, size_in, ctx->jumbo, false,
+			     rx_snaplen(ctx, false));
 	create_rx_ring(rx_sock, &rx_ring, ctx->verbose);
 	mmap_rx_ring(rx_sock, &rx_ring);
 	alloc_rx_ring_frames(&rx_ring);
 	bind_rx_ring(rx_sock, &rx_ring, ifindex_in);
 	prepare_polling(rx_sock, &rx_poll);
+	if (ctx->busy_poll)
+		set_sockopt_busy_poll(rx_sock, ctx->busy_poll);
 
 	set_packet_loss_discard(tx_sock);
 	setup_tx_ring_layout(tx_sock, &tx_ring, size_out, ctx->jumbo);
@@ -387,19 +709,14 @@ static void receive_to_xmit(struct ctx *ctx)
 	printf("Running! Hang up with ^C!\n\n");
 	fflush(stdout);
 
-	while (likely(sigint == 0)) {
-		while (user_may_pull_from_rx(rx_ring.frames[it_in].iov_base)) {
-			__label__ next;
+	rx_consumer_init(&rx_cons, &rx_ring);
 
-			hdr_in = rx_ring.frames[it_in].iov_base;
+	while (likely(sigint == 0)) {
+		rx_consumer_for_each(hdr_in, &rx_cons) {
 			in = ((uint8_t *) hdr_in) + hdr_in->tp_h.tp_mac;
 
 			frame_count++;
 
-			if (ctx->packet_type != -1)
-				if (ctx->packet_type != hdr_in->s_ll.sll_pkttype)
-					goto next;
-
 			hdr_out = tx_ring.frames[it_out].iov_base;
 			out = ((uint8_t *) hdr_out) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
 
@@ -434,6 +751,8 @@ static void receive_to_xmit(struct ctx *ctx)
 			dissector_entry_point(in, hdr_in->tp_h.tp_snaplen,
 					      ctx->link_type, ctx->print_mode);
 
+			rx_consumer_release(&rx_cons);
+
 			if (frame_count_max != 0) {
 				if (frame_count >= frame_count_max) {
 					sigint = 1;
@@ -441,25 +760,25 @@ static void receive_to_xmit(struct ctx *ctx)
 				}
 			}
 
-			next:
-
-			kernel_may_pull_from_rx(&hdr_in->tp_h);
-
-			it_in++;
-			if (it_in >= rx_ring.layout.tp_frame_nr)
-				it_in = 0;
-
 			if (unlikely(sigint == 1))
 				goto out;
 		}
 
+		rx_consumer_flush(&rx_cons);
+		if (rx_ring_spin(&spin, rx_consumer_status(&rx_cons)))
+			continue;
+
 		poll(&rx_poll, 1, -1);
 		poll_error_maybe_die(rx_sock, &rx_poll);
 	}
 
 	out:
 
+	rx_consumer_flush(&rx_cons);
 	sock_print_net_stats(rx_sock, 0);
+	if (ctx->verbose)
+		printf("\rSpin: %lu hits, %lu sleeps\n", spin.hits,
+		       spin.sleeps);
 
 	bpf_release(&bpf_ops);
 
@@ -508,13 +827,203 @@ static void translate_pcap_to_txf(int fdo, uint8_t *out, size_t len)
 	write_or_die(fdo, bout, strlen(bout));
 }
 
+/*
+ * Offline processing in parallel: the file is cut into equally sized
+ * byte ranges whose starts are moved forward onto record boundaries, so
+ * that each worker filters the records starting in its own range.
+ */
+static bool split_pcap_file(struct ctx *ctx, int fd, off_t *bounds,
+			    unsigned int num)
+{
+	unsigned int i;
+	struct stat sb;
+	off_t first, start, probe;
+
+	if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode))
+		return false;
+
+	first = lseek(fd, 0, SEEK_CUR);
+	if (first < 0)
+		return false;
+
+	/*
+	 * Bounds are only probed for, so that mm does not map and lock the
+	 * rest of the file once per worker. The first record has to pass
+	 * the checks a resync relies on.
+	 */
+	probe = min(first + PCAP_SEEK_PROBE, sb.st_size);
+	bounds[0] = __pcap_io->seek_pcap(fd, ctx->magic, first, probe);
+	if (bounds[0] != first)
+		return false;
+
+	for (i = 1; i < num; ++i) {
+		start = max(sb.st_size / num * i, bounds[i - 1]);
+		probe = min(start + PCAP_SEEK_PROBE, sb.st_size);
+
+		bounds[i] = __pcap_io->seek_pcap(fd, ctx->magic, start, probe);
+		/*
+		 * No record to resync on in there, so read it all in one,
+		 * from the first record on.
+		 */
+		if (bounds[i] >= probe && probe < sb.st_size) {
+			__pcap_io->seek_pcap(fd, ctx->magic, first, sb.st_size);
+			return false;
+		}
+	}
+	bounds[num] = sb.st_size;
+
+	/* Workers map their own ranges */
+	if (__pcap_io->prepare_close_pcap)
+		__pcap_io->prepare_close_pcap(fd, PCAP_MODE_RD);
+
+	return true;
+}
+
+static void *pcap_worker(void *self)
+{
+	struct pcap_worker_struct *pw = self;
+	struct ctx *ctx = pw->ctx;
+	uint8_t *bounce, *packet;
+	size_t bounce_len;
+	off_t start;
+	ssize_t ret;
+	pcap_pkthdr_t phdr;
+	struct tpacket2_hdr thdr;
+	struct sockaddr_ll sll;
+
+	if (pw->cpu >= 0)
+		cpu_affinity(pw->cpu);
+
+	start = __pcap_io->seek_pcap(pw->fd, ctx->magic, pw->start, pw->end);
+	if (start != pw->start)
+		panic("Worker %u lost record sync at offset %lld!\n",
+		      pw->id, (long long) pw->start);
+
+	bounce_len = round_up(1024 * 1024, PAGE_SIZE);
+	bounce = xmalloc_aligned(bounce_len, CO_CACHE_LINE_SIZE);
+
+	while (likely(sigint == 0)) {
+		ret = pcap_read_zc(__pcap_io, pw->fd, &phdr, ctx->magic,
+				   &packet, bounce, bounce_len);
+		if (unlikely(ret < 0))
+			break;
+
+		if (unlikely(pcap_get_length(&phdr, ctx->magic) == 0)) {
+			pw->trunced++;
+			continue;
+		}
+
+		if (unlikely(pcap_get_length(&phdr, ctx->magic) > bounce_len)) {
+			pcap_set_length(&phdr, ctx->magic, bounce_len);
+			pw->trunced++;
+		}
+
+		if (ctx->filter &&
+		    !bpf_run_filter(pw->bpf_ops, packet,
+				    pcap_get_length(&phdr, ctx->magic)))
+			continue;
+
+		pcap_pkthdr_to_tpacket_hdr(&phdr, ctx->magic, &thdr, &sll);
+
+		pw->bytes += thdr.tp_len;
+		pw->packets++;
+
+		if (pw->fdo >= 0)
+			translate_pcap_to_txf(pw->fdo, packet, thdr.tp_snaplen);
+	}
+
+	if (__pcap_io->prepare_close_pcap)
+		__pcap_io->prepare_close_pcap(pw->fd, PCAP_MODE_RD);
+
+	xfree(bounce);
+
+	return NULL;
+}
+
+static void append_pcap_worker_output(int fdo, int fd)
+{
+	off_t off = 0, len = lseek(fd, 0, SEEK_END);
+	ssize_t ret;
+
+	while (off < len) {
+		ret = sendfile(fdo, fd, &off, len - off);
+		if (ret <= 0)
+			panic("Cannot merge worker output: %s!\n",
+			      strerror(errno));
+	}
+}
+
+static void read_pcap_parallel(struct ctx *ctx, int fd, int fdo,
+			       struct sock_fprog *bpf_ops, off_t *bounds,
+			       unsigned long *trunced)
+{
+	int ret, cpus = get_number_cpus_online();
+	unsigned int i;
+	struct pcap_worker_struct *pool;
+	FILE *part;
+
+	pool = xzmalloc(ctx->workers * sizeof(*pool));
+
+	for (i = 0; i < ctx->workers; ++i) {
+		pool[i].id = i;
+		pool[i].ctx = ctx;
+		pool[i].fd = fd;
+		pool[i].bpf_ops = bpf_ops;
+		pool[i].cpu = (max(ctx->cpu, 0) + i) % cpus;
+		pool[i].start = bounds[i];
+		pool[i].end = bounds[i + 1];
+		pool[i].fdo = -1;
+
+		/* The first worker's output goes out right away, others are merged */
+		if (ctx->device_out) {
+			if (i == 0) {
+				pool[i].fdo = fdo;
+			} else {
+				part = tmpfile();
+				if (!part)
+					panic("Cannot create worker output file!\n");
+				pool[i].fdo = dup(fileno(part));
+				fclose(part);
+			}
+		}
+
+		ret = pthread_create(&pool[i].trid, NULL, pcap_worker, &pool[i]);
+		if (ret)
+			panic("Cannot create worker thread!\n");
+	}
+
+	for (i = 0; i < ctx->workers; ++i) {
+		pthread_join(pool[i].trid, NULL);
+
+		if (i > 0 && pool[i].fdo >= 0) {
+			append_pcap_worker_output(fdo, pool[i].fdo);
+			close(pool[i].fdo);
+		}
+
+		ctx->tx_packets += pool[i].packets;
+		ctx->tx_bytes += pool[i].bytes;
+		*trunced += pool[i].trunced;
+
+		if (ctx->verbose)
+			printf("Worker %u: bytes %lld-%lld, %lu packets > CPU%d\n",
+			       i, (long long) pool[i].start,
+			       (long long) pool[i].end, pool[i].packets,
+			       pool[i].cpu);
+	}
+
+	xfree(pool);
+}
+
 static void read_pcap(struct ctx *ctx)
 {
 	__label__ out;
-	uint8_t *out;
-	int ret, fd, fdo = 0;
+	uint8_t *out, *packet;
+	int ret, fd, fdo = 0, when = 0;
 	unsigned long trunced = 0;
 	size_t out_len;
+	off_t *bounds = NULL;
+	bool parallel = false;
+	struct pcap_index idx;
 	pcap_pkthdr_t phdr;
 	struct sock_fprog bpf_ops;
 	struct frame_map fm;
@@ -532,16 +1041,30 @@ static void read_pcap(struct ctx *ctx)
 		fd = open_or_die(ctx->device_in, O_RDONLY | O_LARGEFILE | O_NOATIME);
 	}
 
+	select_pcap_read_ops(ctx, fd);
+
 	ret = __pcap_io->pull_fhdr_pcap(fd, &ctx->magic, &ctx->link_type);
 	if (ret)
 		panic("Error reading pcap header!\n");
 
-	if (__pcap_io->prepare_access_pcap) {
-		ret = __pcap_io->prepare_access_pcap(fd, PCAP_MODE_RD, ctx->jumbo);
-		if (ret)
-			panic("Error prepare reading pcap!\n");
+	fmemset(&idx, 0, sizeof(idx));
+
+	/* An index has to see all records, from the start of the file on */
+	if (ctx->index && !ctx->time_from && !ctx->time_to &&
+	    ctx->pcap != PCAP_OPS_ZLIB &&
+	    strncmp("-", ctx->device_in, strlen("-")))
+		pcap_index_open(&idx, ctx->device_in, lseek(fd, 0, SEEK_CUR));
+
+	/* Frame limits, time ranges and indexing need one in-order reader */
+	if (ctx->workers > 1 && __pcap_io->seek_pcap && frame_count_max == 0 &&
+	    !ctx->index && !ctx->time_from && !ctx->time_to) {
+		bounds = xmalloc((ctx->workers + 1) * sizeof(*bounds));
+		parallel = split_pcap_file(ctx, fd, bounds, ctx->workers);
 	}
 
+	if (!parallel)
+		prepare_pcap_read(ctx, fd);
+
 	fmemset(&fm, 0, sizeof(fm));
 	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
 
@@ -571,13 +1094,25 @@ static void read_pcap(struct ctx *ctx)
 
 	bug_on(gettimeofday(&start, NULL));
 
+	if (parallel) {
+		read_pcap_parallel(ctx, fd, fdo, &bpf_ops, bounds, &trunced);
+		goto out;
+	}
+
 	while (likely(sigint == 0)) {
 		do {
-			ret = __pcap_io->read_pcap(fd, &phdr, ctx->magic,
-						   out, out_len);
+			ret = pcap_read_zc(__pcap_io, fd, &phdr, ctx->magic,
+					   &packet, out, out_len);
 			if (unlikely(ret < 0))
 				goto out;
 
+			if (pcap_index_active(&idx)) {
+				pcap_pkthdr_to_tpacket_hdr(&phdr, ctx->magic,
+							   &fm.tp_h, &sll);
+				pcap_index_add(&idx, fm.tp_h.tp_sec,
+					       fm.tp_h.tp_nsec, ret);
+			}
+
 			if (unlikely(pcap_get_length(&phdr, ctx->magic) == 0)) {
 				trunced++;
 				continue;
@@ -587,9 +1122,13 @@ static void read_pcap(struct ctx *ctx)
 				pcap_set_length(&phdr, ctx->magic, out_len);
 				trunced++;
 			}
-		} while (ctx->filter &&
-			 !bpf_run_filter(&bpf_ops, out,
-					 pcap_get_length(&phdr, ctx->magic)));
+
+			when = pcap_time_cmp(ctx, &phdr);
+			if (unlikely(when > 0))
+				goto out;
+		} while (when < 0 || (ctx->filter &&
+			 !bpf_run_filter(&bpf_ops, packet,
+					 pcap_get_length(&phdr, ctx->magic))));
 
 		pcap_pkthdr_to_tpacket_hdr(&phdr, ctx->magic, &fm.tp_h, &sll);
 
@@ -598,11 +1137,11 @@ static void read_pcap(struct ctx *ctx)
 
 		show_frame_hdr(&fm, ctx->print_mode);
 
-		dissector_entry_point(out, fm.tp_h.tp_snaplen,
+		dissector_entry_point(packet, fm.tp_h.tp_snaplen,
 				      ctx->link_type, ctx->print_mode);
 
 		if (ctx->device_out)
-			translate_pcap_to_txf(fdo, out, fm.tp_h.tp_snaplen);
+			translate_pcap_to_txf(fdo, packet, fm.tp_h.tp_snaplen);
 
 		if (frame_count_max != 0) {
 			if (ctx->tx_packets >= frame_count_max) {
@@ -621,10 +1160,14 @@ static void read_pcap(struct ctx *ctx)
 
 	dissector_cleanup_all();
 
+	pcap_index_close(&idx);
+
 	if (__pcap_io->prepare_close_pcap)
 		__pcap_io->prepare_close_pcap(fd, PCAP_MODE_RD);
 
 	xfree(out);
+	if (bounds)
+		xfree(bounds);
 
 	fflush(stdout);
 	printf("\n");
@@ -646,65 +1189,109 @@ static void read_pcap(struct ctx *ctx)
 	}
 }
 
-static void finish_multi_pcap_file(struct ctx *ctx, int fd)
+/* Workers write a pcap each, unless their devices are merged into one */
+static inline bool pcap_sharded(struct ctx *ctx)
 {
-	__pcap_io->fsync_pcap(fd);
+	return ctx->workers > 1 && !ctx->merge;
+}
 
-	if (__pcap_io->prepare_close_pcap)
-		__pcap_io->prepare_close_pcap(fd, PCAP_MODE_WR);
+static void pcap_file_name(struct ctx *ctx, unsigned int shard, char *fname,
+			   size_t len)
+{
+	char *ext;
+	const char *suffix = ctx->pcap == PCAP_OPS_ZLIB ? ".pcap.gz" : ".pcap";
+
+	if (ctx->dump_dir) {
+		if (pcap_sharded(ctx))
+			slprintf(fname, len, "%s/%s%u-%lu%s", ctx->device_out,
+				 ctx->prefix ? : "dump-", shard, time(0), suffix);
+		else
+			slprintf(fname, len, "%s/%s%lu%s", ctx->device_out,
+				 ctx->prefix ? : "dump-", time(0), suffix);
+		return;
+	}
 
-	close(fd);
+	if (!pcap_sharded(ctx)) {
+		strlcpy(fname, ctx->device_out, len);
+		return;
+	}
 
-	fmemset(&itimer, 0, sizeof(itimer));
-	setitimer(ITIMER_REAL, &itimer, NULL);
+	/* Shard single pcap files as in dump.pcap -> dump-<shard>.pcap */
+	ext = strrchr(ctx->device_out, '.');
+	if (ext && !strchr(ext, '/'))
+		slprintf(fname, len, "%.*s-%u%s", (int) (ext - ctx->device_out),
+			 ctx->device_out, shard, ext);
+	else
+		slprintf(fname, len, "%s-%u", ctx->device_out, shard);
 }
 
-static int next_multi_pcap_file(struct ctx *ctx, int fd)
+static struct pcap_pool *new_pcap_pool(struct ctx *ctx, unsigned int shard)
 {
-	int ret;
-	char fname[512];
+	char spare[512];
+	off_t prealloc = 0;
+
+	slprintf(spare, sizeof(spare), "%s/.%spool-%u-%d", ctx->device_out,
+		 ctx->prefix ? : "dump-", shard, getpid());
 
+	/* Otherwise files are sized after the one before */
+	if (ctx->dump_mode == DUMP_INTERVAL_SIZE && ctx->pcap != PCAP_OPS_ZLIB)
+		prealloc = ctx->dump_interval;
+
+	return pcap_pool_create(spare, ctx->keep, prealloc);
+}
+
+static void finish_multi_pcap_file(struct ctx *ctx, struct pcap_pool *pool,
+				   int fd, unsigned int shard)
+{
 	__pcap_io->fsync_pcap(fd);
 
 	if (__pcap_io->prepare_close_pcap)
 		__pcap_io->prepare_close_pcap(fd, PCAP_MODE_WR);
 
-	close(fd);
+	pcap_pool_put(pool, fd);
+	pcap_pool_destroy(pool);
 
-	slprintf(fname, sizeof(fname), "%s/%s%lu.pcap", ctx->device_out,
-		 ctx->prefix ? : "dump-", time(0));
+	/* The timer belongs to shard 0, which armed it */
+	if (shard == 0) {
+		fmemset(&itimer, 0, sizeof(itimer));
+		setitimer(ITIMER_REAL, &itimer, NULL);
+	}
+}
+
+/* Sync and close of the old file are left to the pool */
+static int next_multi_pcap_file(struct ctx *ctx, struct pcap_pool *pool,
+				int fd, unsigned int shard, char *fname,
+				size_t len)
+{
+	int fd_next, ret;
 
-	fd = open_or_die_m(fname, O_RDWR | O_CREAT | O_TRUNC |
-			   O_LARGEFILE, DEFFILEMODE);
+	pcap_file_name(ctx, shard, fname, len);
 
-	ret = __pcap_io->push_fhdr_pcap(fd, ctx->magic, ctx->link_type);
+	fd_next = pcap_pool_get(pool, fname);
+
+	ret = __pcap_io->push_fhdr_pcap(fd_next, ctx->magic, ctx->link_type);
 	if (ret)
 		panic("Error writing pcap header!\n");
 
-	if (__pcap_io->prepare_access_pcap) {
-		ret = __pcap_io->prepare_access_pcap(fd, PCAP_MODE_WR, ctx->jumbo);
-		if (ret)
-			panic("Error prepare writing pcap!\n");
-	}
+	ret = pcap_rotate(__pcap_io, fd, fd_next, ctx->jumbo);
+	if (ret)
+		panic("Error prepare writing pcap!\n");
 
-	return fd;
+	pcap_pool_put(pool, fd);
+
+	return fd_next;
 }
 
-static int begin_multi_pcap_file(struct ctx *ctx)
+static int begin_multi_pcap_file(struct ctx *ctx, struct pcap_pool *pool,
+				 unsigned int shard, char *fname, size_t len)
 {
 	int fd, ret;
-	char fname[256];
 
 	bug_on(!__pcap_io);
 
-	if (ctx->device_out[strlen(ctx->device_out) - 1] == '/')
-		ctx->device_out[strlen(ctx->device_out) - 1] = 0;
-
-	slprintf(fname, sizeof(fname), "%s/%s%lu.pcap", ctx->device_out,
-		 ctx->prefix ? : "dump-", time(0));
+	pcap_file_name(ctx, shard, fname, len);
 
-	fd = open_or_die_m(fname, O_RDWR | O_CREAT | O_TRUNC |
-			   O_LARGEFILE, DEFFILEMODE);
+	fd = pcap_pool_get(pool, fname);
 
 	ret = __pcap_io->push_fhdr_pcap(fd, ctx->magic, ctx->link_type);
 	if (ret)
@@ -716,13 +1303,12 @@ static int begin_multi_pcap_file(struct ctx *ctx)
 			panic("Error prepare writing pcap!\n");
 	}
 
-	if (ctx->dump_mode == DUMP_INTERVAL_TIME) {
+	/* All shards rotate on the same timer */
+	if (ctx->dump_mode == DUMP_INTERVAL_TIME && shard == 0) {
 		interval = ctx->dump_interval;
 
 		set_itimer_interval_value(&itimer, interval, 0);
 		setitimer(ITIMER_REAL, &itimer, NULL);
-	} else {
-		interval = 0;
 	}
 
 	return fd;
@@ -741,20 +1327,35 @@ static void finish_single_pcap_file(struct ctx *ctx, int fd)
 		dup2(fd, fileno(stdout));
 }
 
-static int begin_single_pcap_file(struct ctx *ctx)
+static inline bool fd_is_pipe(int fd)
+{
+	struct stat stats;
+
+	return fstat(fd, &stats) == 0 && S_ISFIFO(stats.st_mode);
+}
+
+static int begin_single_pcap_file(struct ctx *ctx, unsigned int shard,
+				  char *fname, size_t len)
 {
 	int fd, ret;
 
 	bug_on(!__pcap_io);
 
-	if (!strncmp("-", ctx->device_out, strlen("-"))) {
+	if (ctx->stream) {
+		fd = pcap_stream_connect(ctx->device_out, ctx->stream_zlib);
+		fname[0] = 0;
+	} else if (!strncmp("-", ctx->device_out, strlen("-"))) {
 		fd = dup(fileno(stdout));
 		close(fileno(stdout));
-		if (ctx->pcap == PCAP_OPS_MM)
+		if (ctx->pcap == PCAP_OPS_MM || ctx->pcap == PCAP_OPS_URING ||
+		    ctx->pcap == PCAP_OPS_DIRECT ||
+		    (ctx->pcap == PCAP_OPS_PIPE && !fd_is_pipe(fd)))
 			ctx->pcap = PCAP_OPS_SG;
+		fname[0] = 0;
 	} else {
-		fd = open_or_die_m(ctx->device_out,
-				   O_RDWR | O_CREAT | O_TRUNC |
+		pcap_file_name(ctx, shard, fname, len);
+
+		fd = open_or_die_m(fname, O_RDWR | O_CREAT | O_TRUNC |
 				   O_LARGEFILE, DEFFILEMODE);
 	}
 
@@ -771,194 +1372,1450 @@ static int begin_single_pcap_file(struct ctx *ctx)
 	return fd;
 }
 
-static void print_pcap_file_stats(int sock, struct ctx *ctx, unsigned long skipped)
+/* Each dump file gets its own index, records start after the file header */
+static void begin_worker_pcap_index(struct worker_struct *ws, const char *fname)
 {
-	unsigned long good, bad;
-	struct tpacket_stats kstats;
-	socklen_t slen = sizeof(kstats);
+	if (!fname[0])
+		return;
 
-	fmemset(&kstats, 0, sizeof(kstats));
-	getsockopt(sock, SOL_PACKET, PACKET_STATISTICS, &kstats, &slen);
-	
-	if (ctx->print_mode == PRINT_NONE) {
-		good = kstats.tp_packets - kstats.tp_drops - skipped;
-		bad = kstats.tp_drops + skipped;
+	if (ws->ctx->index && ws->ctx->pcap != PCAP_OPS_ZLIB)
+		pcap_index_open(&ws->idx, fname, sizeof(struct pcap_filehdr));
+	else
+		pcap_index_remove(fname);
+}
 
-		printf(".(+%lu/-%lu)", good, bad);
-		fflush(stdout);
-	}
+static inline bool sample_enabled(struct ctx *ctx)
+{
+	return ctx->sample_rate > 1 || ctx->sample_auto;
 }
 
-static void recv_only_or_dump(struct ctx *ctx)
+/* The rates a dump file was sampled at go into <pcap>.smp next to it */
+static void begin_worker_sample_log(struct worker_struct *ws, const char *fname)
 {
-	uint8_t *packet;
-	short ifflags = 0;
-	int sock, irq, ifindex, fd = 0, ret;
-	unsigned int size, it = 0;
-	unsigned long frame_count = 0, skipped = 0;
-	struct ring rx_ring;
-	struct pollfd rx_poll;
-	struct frame_map *hdr;
-	struct sock_fprog bpf_ops;
-	struct timeval start, end, diff;
-	pcap_pkthdr_t phdr;
+	struct ctx *ctx = ws->ctx;
+	char path[512 + sizeof(PCAP_SAMPLE_SUFFIX)];
 
-	if (!device_up_and_running(ctx->device_in) && !ctx->rfraw)
-		panic("Device not up and running!\n");
+	if (!sample_enabled(ctx) || !fname[0])
+		return;
 
-	sock = pf_socket();
+	slprintf(path, sizeof(path), "%s%s", fname, PCAP_SAMPLE_SUFFIX);
+	ws->sample_fd = open_or_die_m(path, O_WRONLY | O_CREAT | O_TRUNC |
+				      O_LARGEFILE, DEFFILEMODE);
+	dprintf(ws->sample_fd, "# 1 in <rate> %s from <time> on\n",
+		ctx->sample_mode == BPF_SAMPLE_FLOW ? "flows" : "packets");
 
-	if (ctx->rfraw) {
-		ctx->device_trans = xstrdup(ctx->device_in);
-		xfree(ctx->device_in);
+	ws->sample_logged = 0;
+}
 
-		enter_rfmon_mac80211(ctx->device_trans, &ctx->device_in);
-		ctx->link_type = LINKTYPE_IEEE802_11;
-	}
+static void finish_worker_sample_log(struct worker_struct *ws)
+{
+	if (ws->sample_fd < 0)
+		return;
 
-	fmemset(&rx_ring, 0, sizeof(rx_ring));
-	fmemset(&rx_poll, 0, sizeof(rx_poll));
-	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
+	close(ws->sample_fd);
+	ws->sample_fd = -1;
+}
 
-	ifindex = device_ifindex(ctx->device_in);
+/* Logs a rate from the first record on that was captured at it */
+static inline void log_sample_rate(struct worker_struct *ws, uint32_t sec,
+				   uint32_t nsec)
+{
+	uint64_t sample = __atomic_load_n(&ws->sample, __ATOMIC_ACQUIRE);
 
-	size = ring_size(ctx->device_in, ctx->reserve_size);
+	if (likely(ws->sample_fd < 0 || sample == ws->sample_logged))
+		return;
+	if (sec < sample >> 32)
+		return;
 
-	enable_kernel_bpf_jit_compiler();
+	dprintf(ws->sample_fd, "%u.%09u %u\n", sec, nsec,
+		(uint32_t) sample);
+	ws->sample_logged = sample;
+}
 
-	bpf_parse_rules(ctx->device_in, ctx->filter, &bpf_ops);
-	if (ctx->dump_bpf)
-		bpf_dump_all(&bpf_ops);
-	bpf_attach_to_sock(sock, &bpf_ops);
+static void begin_worker_pcap_file(struct worker_struct *ws)
+{
+	char fname[512];
 
-	set_sockopt_hwtimestamp(sock, ctx->device_in);
+	if (!dump_to_pcap(ws->ctx))
+		return;
 
-	setup_rx_ring_layout(sock, &rx_ring, size, ctx->jumbo);
-	create_rx_ring(sock, &rx_ring, ctx->verbose);
-	mmap_rx_ring(sock, &rx_ring);
-	alloc_rx_ring_frames(&rx_ring);
-	bind_rx_ring(sock, &rx_ring, ifindex);
+	if (ws->ctx->dump_dir) {
+		ws->pool = new_pcap_pool(ws->ctx, ws->id);
+		ws->fd = begin_multi_pcap_file(ws->ctx, ws->pool, ws->id,
+					       fname, sizeof(fname));
+	} else
+		ws->fd = begin_single_pcap_file(ws->ctx, ws->id, fname,
+						sizeof(fname));
+
+	begin_worker_pcap_index(ws, fname);
+	begin_worker_sample_log(ws, fname);
+}
+
+static void finish_worker_pcap_file(struct worker_struct *ws)
+{
+	if (!dump_to_pcap(ws->ctx))
+		return;
+
+	pcap_index_close(&ws->idx);
+	finish_worker_sample_log(ws);
+
+	if (ws->ctx->dump_dir)
+		finish_multi_pcap_file(ws->ctx, ws->pool, ws->fd, ws->id);
+	else
+		finish_single_pcap_file(ws->ctx, ws->fd);
+}
+
+static void update_worker_stats(struct worker_struct *ws)
+{
+	struct tpacket_stats_v3 kstats;
+	socklen_t len = sizeof(kstats);
+
+	fmemset(&kstats, 0, sizeof(kstats));
+
+	/*
+	 * PACKET_STATISTICS resets the kernel counters on each read, and
+	 * the telemetry thread reads them, too. Only TPACKET_V3 freezes.
+	 */
+	if (ws->rx_ring.xsk)
+		xsk_stats(ws->rx_ring.xsk, (struct tpacket_stats *) &kstats);
+	else if (getsockopt(ws->sock, SOL_PACKET, PACKET_STATISTICS, &kstats,
+			    &len) < 0)
+		return;
+
+	__sync_add_and_fetch(&ws->kstats.tp_packets, kstats.tp_packets);
+	__sync_add_and_fetch(&ws->kstats.tp_drops, kstats.tp_drops);
+	__sync_add_and_fetch(&ws->freezes, kstats.tp_freeze_q_cnt);
+}
+
+static void print_pcap_file_stats(struct worker_struct *ws)
+{
+	unsigned long good, bad;
+	struct tpacket_stats kstats = ws->kstats;
+
+	update_worker_stats(ws);
+
+	kstats.tp_packets = ws->kstats.tp_packets - kstats.tp_packets;
+	kstats.tp_drops = ws->kstats.tp_drops - kstats.tp_drops;
+
+	if (ws->ctx->print_mode == PRINT_NONE) {
+		good = kstats.tp_packets - kstats.tp_drops;
+		bad = kstats.tp_drops;
+
+		if (ws->ctx->workers > 1)
+			printf(".%u(+%lu/-%lu)", ws->id, good, bad);
+		else
+			printf(".(+%lu/-%lu)", good, bad);
+		fflush(stdout);
+	}
+}
+
+static inline uint64_t telemetry_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return pcap_trigger_ns(ts.tv_sec, ts.tv_nsec);
+}
+
+/* Bytes of every frame, and how old every few of them are by now */
+static inline void telemetry_frame(struct worker_struct *ws,
+				   struct tpacket2_hdr *hdr)
+{
+	int64_t age;
+
+	if (!ws->ctx->telemetry)
+		return;
+
+	ws->bytes += hdr->tp_len;
+
+	if (likely(ws->frame_count % TELEMETRY_AGE_EVERY))
+		return;
+
+	age = telemetry_now() - pcap_trigger_ns(hdr->tp_sec, hdr->tp_nsec);
+	ws->age[telemetry_age_bucket(max(age, (int64_t) 0))]++;
+}
+
+/* Hands the frame to local consumers of the shared memory ring */
+static inline void publish_frame(struct worker_struct *ws,
+				 struct frame_map *fm, uint8_t *packet)
+{
+	if (!ws->ctx->shm)
+		return;
+
+	shm_ring_publish(ws->ctx->shm, &fm->tp_h, &fm->s_ll, packet);
+}
+
+static inline bool count_frame_and_maybe_stop(struct worker_struct *ws)
+{
+	ws->frame_count++;
+
+	if (frame_count_max == 0)
+		return false;
+
+	if (__sync_add_and_fetch(&frame_count_total, 1) >= frame_count_max) {
+		sigint = 1;
+		return true;
+	}
+
+	return false;
+}
+
+static void next_worker_pcap_file(struct worker_struct *ws)
+{
+	struct ctx *ctx = ws->ctx;
+	char fname[512];
+
+	pcap_index_close(&ws->idx);
+	finish_worker_sample_log(ws);
+
+	ws->fd = next_multi_pcap_file(ctx, ws->pool, ws->fd, ws->id, fname,
+				      sizeof(fname));
+	ws->dump_bytes = 0;
+
+	begin_worker_pcap_index(ws, fname);
+	begin_worker_sample_log(ws, fname);
+
+	if (ctx->verbose)
+		print_pcap_file_stats(ws);
+}
+
+static void next_dump_maybe(struct worker_struct *ws)
+{
+	struct ctx *ctx = ws->ctx;
+
+	/* Triggers alone decide when a new file begins */
+	if (!dump_to_pcap(ctx) || !ctx->dump_dir || dump_on_trigger(ctx))
+		return;
+
+	if (ctx->dump_mode == DUMP_INTERVAL_SIZE &&
+	    ws->dump_bytes > ctx->dump_interval)
+		ws->dump_gen = dump_gen + 1;
+	else if (ws->dump_gen == dump_gen)
+		return;
+
+	next_worker_pcap_file(ws);
+	ws->dump_gen = dump_gen;
+}
+
+static void dump_record(struct worker_struct *ws, pcap_pkthdr_t *phdr,
+			const uint8_t *packet, uint32_t sec, uint32_t nsec)
+{
+	int ret;
+	struct ctx *ctx = ws->ctx;
+	size_t len = pcap_get_length(phdr, ctx->magic);
+
+	ret = __pcap_io->write_pcap(ws->fd, phdr, ctx->magic, packet, len);
+	if (unlikely(ret != pcap_get_total_length(phdr, ctx->magic)))
+		panic("Write error to pcap!\n");
+
+	if (pcap_index_active(&ws->idx))
+		pcap_index_add(&ws->idx, sec, nsec, ret);
+
+	log_sample_rate(ws, sec, nsec);
+
+	ws->dump_bytes += len;
+}
+
+/* The rules with sampling in front, a rate of 1 runs the rules alone */
+static void attach_sample_filter(struct worker_struct *ws, uint32_t rate,
+				 uint32_t sec)
+{
+	struct ctx *ctx = ws->ctx;
+	struct sock_fprog bpf;
+
+	bpf.len = ws->bpf_ops->len;
+	bpf.filter = xmemdupz(ws->bpf_ops->filter,
+			      bpf.len * sizeof(*bpf.filter));
+
+	bpf_prepend_sample(&bpf, ctx->sample_mode, rate,
+			   ctx->link_type == LINKTYPE_EN10MB);
+
+	/* Rules that take everything are not attached, so detach instead */
+	if (bpf.filter[0].code == BPF_RET && bpf.filter[0].k == 0xFFFFFFFF &&
+	    ws->sample_rate > 1)
+		bpf_detach_from_sock(ws->sock);
+	else
+		bpf_attach_to_sock(ws->sock, &bpf);
+
+	bpf_release(&bpf);
+
+	ws->sample_rate = rate;
+	__atomic_store_n(&ws->sample, (uint64_t) sec << 32 | rate,
+			 __ATOMIC_RELEASE);
+}
+
+/*
+ * Once a second, the rate goes up by what got dropped when the ring
+ * overflows, so that what is left fits, and halves again after a calm
+ * spell. Drops are counted after sampling, so they tell whether the
+ * capture keeps up with the current rate.
+ */
+static void sample_adjust(struct worker_struct *ws, uint32_t sec)
+{
+	unsigned int packets, drops, kept, factor = 2;
+	uint32_t rate = ws->sample_rate;
+
+	update_worker_stats(ws);
+
+	packets = ws->kstats.tp_packets - ws->sample_packets;
+	drops = ws->kstats.tp_drops - ws->sample_drops;
+
+	ws->sample_packets = ws->kstats.tp_packets;
+	ws->sample_drops = ws->kstats.tp_drops;
+
+	if (packets > 0 &&
+	    drops * 100ULL >= (uint64_t) packets * SAMPLE_AUTO_DROPS) {
+		kept = max(packets - drops, 1U);
+		while (factor * kept < packets)
+			factor <<= 1;
+
+		rate = min((uint64_t) rate * factor, (uint64_t) SAMPLE_AUTO_MAX);
+		ws->sample_calm = 0;
+	} else if (drops == 0 && rate > 1 &&
+		   ++ws->sample_calm >= SAMPLE_AUTO_CALM) {
+		rate >>= 1;
+		ws->sample_calm = 0;
+	}
+
+	if (rate != ws->sample_rate) {
+		attach_sample_filter(ws, rate, sec);
+		ws->sample_changes++;
+	}
+}
+
+static inline void sample_check(struct worker_struct *ws, uint32_t sec)
+{
+	if (ws->ctx->sample_auto && unlikely(sec != ws->sample_sec)) {
+		ws->sample_sec = sec;
+		sample_adjust(ws, sec);
+	}
+}
+
+static void trigger_check_drops(struct worker_struct *ws)
+{
+	unsigned int packets, drops;
+
+	update_worker_stats(ws);
+
+	packets = ws->kstats.tp_packets - ws->trig_packets;
+	drops = ws->kstats.tp_drops - ws->trig_drops;
+
+	ws->trig_packets = ws->kstats.tp_packets;
+	ws->trig_drops = ws->kstats.tp_drops;
+
+	if (packets > 0 &&
+	    drops * 100ULL >= (uint64_t) packets * ws->ctx->trigger_drops)
+		__sync_add_and_fetch(&trigger_gen, 1);
+}
+
+static void trigger_begin_event(struct worker_struct *ws)
+{
+	struct pcap_trigger_rec *rec;
+
+	/* Every event in a directory gets a file of its own */
+	if (ws->ctx->dump_dir && ws->dump_bytes > 0)
+		next_worker_pcap_file(ws);
+
+	while ((rec = pcap_trigger_pop(&ws->trig)))
+		dump_record(ws, &rec->phdr, rec->packet, rec->tv_sec,
+			    rec->tv_nsec);
+
+	ws->trig_pass = true;
+	ws->trig_events++;
+}
+
+/*
+ * Packets are held back in memory while nothing happens. A trigger
+ * dumps what is held, i.e. up to the last window seconds, and passes
+ * on packets until window seconds after the last trigger.
+ */
+static bool trigger_pass_frame(struct worker_struct *ws, pcap_pkthdr_t *phdr,
+			       uint8_t *packet, uint32_t sec, uint32_t nsec)
+{
+	struct ctx *ctx = ws->ctx;
+	uint64_t now = pcap_trigger_ns(sec, nsec);
+
+	if (ctx->trigger_ops.len &&
+	    bpf_run_filter(&ctx->trigger_ops, packet,
+			   pcap_get_length(phdr, ctx->magic)))
+		__sync_add_and_fetch(&trigger_gen, 1);
+
+	if (ctx->trigger_drops && sec != ws->trig_sec) {
+		ws->trig_sec = sec;
+		trigger_check_drops(ws);
+	}
+
+	if (unlikely(ws->trig_gen != trigger_gen)) {
+		ws->trig_gen = trigger_gen;
+		ws->trig_until = now + pcap_trigger_ns(ctx->trigger, 0);
+
+		if (!ws->trig_pass)
+			trigger_begin_event(ws);
+	}
+
+	if (ws->trig_pass && now < ws->trig_until)
+		return true;
+
+	ws->trig_pass = false;
+	pcap_trigger_hold(&ws->trig, phdr, ctx->magic, packet, sec, nsec);
+
+	return false;
+}
+
+static void dump_frame(struct worker_struct *ws, struct frame_map *fm,
+		       uint8_t *packet)
+{
+	struct ctx *ctx = ws->ctx;
+	pcap_pkthdr_t phdr;
+
+	tpacket_hdr_to_pcap_pkthdr(&fm->tp_h, &fm->s_ll, &phdr, ctx->magic);
+
+	if (dump_on_trigger(ctx) &&
+	    !trigger_pass_frame(ws, &phdr, packet, fm->tp_h.tp_sec,
+				fm->tp_h.tp_nsec))
+		return;
+
+	dump_record(ws, &phdr, packet, fm->tp_h.tp_sec, fm->tp_h.tp_nsec);
+}
+
+static void dump_t3_block(struct worker_struct *ws, struct block_desc *pbd,
+			  unsigned int num)
+{
+	unsigned int i;
+	struct tpacket3_hdr *hdr;
+	struct frame_map fm;
+
+	hdr = (void *) ((uint8_t *) pbd + pbd->h1.offset_to_first_pkt);
+
+	for (i = 0; i < num; ++i) {
+		tpacket3_hdr_to_frame_map(hdr, &fm);
+
+		dump_frame(ws, &fm, ((uint8_t *) hdr) + hdr->tp_mac);
+
+		hdr = (void *) ((uint8_t *) hdr + hdr->tp_next_offset);
+	}
+}
+
+static unsigned int walk_t3_block(struct block_desc *pbd, struct worker_struct *ws)
+{
+	unsigned int num_pkts = pbd->h1.num_pkts, i;
+	uint8_t *packet;
+	struct ctx *ctx = ws->ctx;
+	struct tpacket3_hdr *hdr;
+	struct frame_map fm;
+
+	hdr = (void *) ((uint8_t *) pbd + pbd->h1.offset_to_first_pkt);
+
+	for (i = 0; i < num_pkts && likely(sigint == 0); ++i) {
+		prefetch_rd((uint8_t *) hdr + hdr->tp_next_offset);
+
+		tpacket3_hdr_to_frame_map(hdr, &fm);
+		packet = ((uint8_t *) hdr) + hdr->tp_mac;
+
+		if (dump_to_pcap(ctx) && !ctx->writer)
+			dump_frame(ws, &fm, packet);
+
+		show_frame_hdr(&fm, ctx->print_mode);
+
+		dissector_entry_point(packet, fm.tp_h.tp_snaplen,
+				      ctx->link_type, ctx->print_mode);
+
+		telemetry_frame(ws, &fm.tp_h);
+		publish_frame(ws, &fm, packet);
+		if (count_frame_and_maybe_stop(ws))
+			return i + 1;
+
+		hdr = (void *) ((uint8_t *) hdr + hdr->tp_next_offset);
+	}
+
+	/* Number of leading packets the writer has to look at */
+	return i;
+}
+
+/* With a writer, a full queue means that it holds every ring slot */
+static inline bool writer_full(struct worker_struct *ws)
+{
+	return ws->ctx->writer && spsc_queue_full(&ws->wr.queue);
+}
+
+static bool writer_wait(struct worker_struct *ws)
+{
+	if (!writer_full(ws))
+		return false;
+
+	ws->wr.stalls++;
+
+	while (spsc_queue_full(&ws->wr.queue) && likely(sigint == 0))
+		sched_yield();
+
+	return true;
+}
+
+static void release_rx_block(struct worker_struct *ws,
+			     struct block_desc *pbd, unsigned long num)
+{
+	bool ret;
+
+	if (ws->ctx->writer) {
+		/* The writer hands the slot back once it is on disk */
+		ret = spsc_queue_push(&ws->wr.queue, pbd, num);
+		bug_on(!ret);
+		return;
+	}
+
+	kernel_may_pull_from_rx_block(pbd);
+}
+
+static void release_rx_frame(struct worker_struct *ws, struct rx_consumer *c,
+			     struct frame_map *hdr, unsigned long num)
+{
+	bool ret;
+
+	if (ws->ctx->writer) {
+		ret = spsc_queue_push(&ws->wr.queue, hdr, num);
+		bug_on(!ret);
+		rx_consumer_pass(c);
+		return;
+	}
+
+	rx_consumer_release(c);
+}
+
+static void *rx_writer(void *self)
+{
+	unsigned int depth, idle = 0;
+	struct worker_struct *ws = self;
+	struct writer_struct *wr = &ws->wr;
+	struct spsc_elem *elem;
+
+	begin_worker_pcap_file(ws);
+	__atomic_store_n(&wr->ready, true, __ATOMIC_RELEASE);
+
+	while (1) {
+		elem = spsc_queue_peek(&wr->queue);
+		if (!elem) {
+			if (__atomic_load_n(&wr->done, __ATOMIC_ACQUIRE) &&
+			    !spsc_queue_peek(&wr->queue))
+				break;
+
+			if (idle++ < WRITER_IDLE_SPINS)
+				sched_yield();
+			else
+				usleep(WRITER_IDLE_US);
+			continue;
+		}
+
+		idle = 0;
+
+		depth = spsc_queue_used(&wr->queue);
+		if (depth > wr->max_depth)
+			wr->max_depth = depth;
+
+		if (ws->rx_ring.v3) {
+			struct block_desc *pbd = elem->ptr;
+
+			dump_t3_block(ws, pbd, elem->val);
+			__atomic_store_n(&wr->last_ns,
+					 pcap_trigger_ns(pbd->h1.ts_last_pkt.ts_sec,
+							 pbd->h1.ts_last_pkt.ts_nsec),
+					 __ATOMIC_RELAXED);
+			kernel_may_pull_from_rx_block(pbd);
+		} else {
+			struct frame_map *hdr = elem->ptr;
+
+			if (elem->val)
+				dump_frame(ws, hdr, ((uint8_t *) hdr) + hdr->tp_h.tp_mac);
+			__atomic_store_n(&wr->last_ns,
+					 pcap_trigger_ns(hdr->tp_h.tp_sec,
+							 hdr->tp_h.tp_nsec),
+					 __ATOMIC_RELAXED);
+			kernel_may_pull_from_rx(&hdr->tp_h);
+		}
+
+		spsc_queue_pop(&wr->queue);
+		wr->written++;
+
+		next_dump_maybe(ws);
+	}
+
+	finish_worker_pcap_file(ws);
+
+	return NULL;
+}
+
+/* Without a socket filter in the path, AF_XDP frames are filtered here */
+static inline bool xdp_filter_frame(struct worker_struct *ws,
+				    struct frame_map *hdr, uint8_t *packet)
+{
+	uint32_t len;
+
+	if (!ws->bpf_ops->len)
+		return true;
+
+	len = bpf_run_filter(ws->bpf_ops, packet, hdr->tp_h.tp_snaplen);
+	if (len == 0)
+		return false;
+
+	hdr->tp_h.tp_snaplen = min(hdr->tp_h.tp_snaplen, len);
+	return true;
+}
+
+static void *rx_worker(void *self)
+{
+	uint8_t *packet;
+	unsigned int it = 0;
+	struct worker_struct *ws = self;
+	struct ctx *ctx = ws->ctx;
+	struct ring *rx_ring = &ws->rx_ring;
+	struct rx_consumer cons;
+	struct frame_map *hdr;
+	/* Workers must notice sigint, which only one of them receives */
+	int timeout = ctx->workers > 1 ? WORKER_POLL_TIMEOUT : -1;
+
+	if (ws->cpu >= 0)
+		cpu_affinity(ws->cpu);
+
+	/* pcap I/O state is per thread, so threads own their files */
+	if (ctx->workers > 1 && !ctx->writer)
+		begin_worker_pcap_file(ws);
+
+	while (likely(sigint == 0) && rx_ring->v3) {
+		struct block_desc *pbd;
+
+		while (!writer_full(ws) &&
+		       user_may_pull_from_rx_block((pbd = rx_ring->frames[it].iov_base))) {
+			sample_check(ws, pbd->h1.ts_last_pkt.ts_sec);
+			release_rx_block(ws, pbd, walk_t3_block(pbd, ws));
+
+			it++;
+			if (it >= rx_ring->layout3.tp_block_nr)
+				it = 0;
+			ws->ring_next = it;
+
+			if (unlikely(sigint == 1))
+				break;
+
+			if (!ctx->writer)
+				next_dump_maybe(ws);
+		}
+
+		if (unlikely(sigint == 1))
+			break;
+		if (writer_wait(ws))
+			continue;
+
+		pbd = rx_ring->frames[it].iov_base;
+		if (rx_ring_spin(&ws->spin, &pbd->h1.block_status))
+			continue;
+
+		poll(&ws->rx_poll, 1, timeout);
+		poll_error_maybe_die(ws->sock, &ws->rx_poll);
+	}
+
+	if (!rx_ring->v3)
+		rx_consumer_init(&cons, rx_ring);
+
+	while (likely(sigint == 0) && !rx_ring->v3) {
+		while (!writer_full(ws) && (hdr = rx_consumer_next(&cons))) {
+			__label__ next;
+			unsigned long num = 0;
+
+			packet = ((uint8_t *) hdr) + hdr->tp_h.tp_mac;
+			ws->ring_next = cons.head;
+
+			sample_check(ws, hdr->tp_h.tp_sec);
+
+			if (unlikely(ring_frame_size(rx_ring) < hdr->tp_h.tp_snaplen)) {
+				ws->skipped++;
+				goto next;
+			}
+
+			if (ctx->xdp && !xdp_filter_frame(ws, hdr, packet))
+				goto next;
+
+			if (dump_to_pcap(ctx)) {
+				if (ctx->writer)
+					num = 1;
+				else
+					dump_frame(ws, hdr, packet);
+			}
+
+			show_frame_hdr(hdr, ctx->print_mode);
+
+			dissector_entry_point(packet, hdr->tp_h.tp_snaplen,
+					      ctx->link_type, ctx->print_mode);
+
+			telemetry_frame(ws, &hdr->tp_h);
+			publish_frame(ws, hdr, packet);
+			if (count_frame_and_maybe_stop(ws)) {
+				release_rx_frame(ws, &cons, hdr, num);
+				break;
+			}
+
+			next:
+
+			release_rx_frame(ws, &cons, hdr, num);
+
+			if (unlikely(sigint == 1))
+				break;
+
+			if (!ctx->writer)
+				next_dump_maybe(ws);
+		}
+
+		rx_consumer_flush(&cons);
+
+		if (unlikely(sigint == 1))
+			break;
+		if (writer_wait(ws))
+			continue;
+
+		if (rx_ring_spin(&ws->spin, rx_consumer_status(&cons)))
+			continue;
+
+		poll(&ws->rx_poll, 1, timeout);
+		poll_error_maybe_die(ws->sock, &ws->rx_poll);
+	}
+
+	if (ctx->writer)
+		__atomic_store_n(&ws->wr.done, true, __ATOMIC_RELEASE);
+	else if (ctx->workers > 1)
+		finish_worker_pcap_file(ws);
+
+	return NULL;
+}
+
+/* Worker i takes queue i, their sockets go into the map of the program */
+static void setup_xdp_worker(struct worker_struct *ws,
+			     struct xsk_redirect *redirect, unsigned int size,
+			     int ifindex)
+{
+	struct ctx *ctx = ws->ctx;
+
+	create_xsk_ring(&ws->rx_ring, ifindex, ws->id, size,
+			rx_snaplen(ctx, true), ctx->verbose && ws->id == 0);
+	xsk_redirect_add(redirect, ws->rx_ring.xsk);
+
+	ws->sock = ws->rx_ring.xsk->sock;
+	prepare_polling(ws->sock, &ws->rx_poll);
+	if (ctx->busy_poll)
+		set_sockopt_busy_poll(ws->sock, ctx->busy_poll);
+}
+
+static void setup_rx_worker(struct worker_struct *ws, struct sock_fprog *bpf_ops,
+			    struct xsk_redirect *redirect, unsigned int size,
+			    int ifindex)
+{
+	struct ctx *ctx = ws->ctx;
+
+	ws->bpf_ops = bpf_ops;
+	ws->spin.num = ctx->spin;
+	ws->spin.usecs = ctx->spin_usecs;
+
+	if (ctx->xdp) {
+		setup_xdp_worker(ws, redirect, size, ifindex);
+		return;
+	}
+
+	ws->sock = pf_socket();
+
+	attach_sample_filter(ws, ctx->sample_rate, 0);
+	set_sockopt_hwtimestamp(ws->sock, ws->dev);
+
+	setup_rx_ring_layout(ws->sock, &ws->rx_ring, size, ctx->jumbo, ctx->v3,
+			     rx_snaplen(ctx, true));
+	if (ctx->v3 && ctx->block_tov)
+		ws->rx_ring.layout3.tp_retire_blk_tov = ctx->block_tov;
+
+	create_rx_ring(ws->sock, &ws->rx_ring, ctx->verbose && ws->id == 0);
+	mmap_rx_ring(ws->sock, &ws->rx_ring);
+	alloc_rx_ring_frames(&ws->rx_ring);
+	bind_rx_ring(ws->sock, &ws->rx_ring, ifindex);
+
+	/* Join after bind, the kernel only fans out on running sockets */
+	if (ctx->workers > 1 && !ctx->merge)
+		set_sockopt_fanout(ws->sock, ctx->fanout_id, ctx->fanout_type);
+
+	prepare_polling(ws->sock, &ws->rx_poll);
+	if (ctx->busy_poll)
+		set_sockopt_busy_poll(ws->sock, ctx->busy_poll);
+}
+
+static void destroy_rx_worker(struct worker_struct *ws)
+{
+	if (dump_on_trigger(ws->ctx))
+		pcap_trigger_destroy(&ws->trig);
+
+	if (ws->rx_ring.xsk) {
+		destroy_xsk_ring(&ws->rx_ring);
+		return;
+	}
+
+	destroy_rx_ring(ws->sock, &ws->rx_ring);
+	close(ws->sock);
+}
+
+static void start_rx_writers(struct ctx *ctx, struct worker_struct *threadpool)
+{
+	int ret;
+	unsigned int i;
+
+	for (i = 0; i < ctx->workers; ++i) {
+		struct worker_struct *ws = &threadpool[i];
+
+		/* Sized to the ring, every slot may be in flight at most once */
+		spsc_queue_init(&ws->wr.queue, rx_ring_slots(&ws->rx_ring));
+
+		ret = pthread_create(&ws->wr.trid, NULL, rx_writer, ws);
+		if (ret)
+			panic("Cannot create writer thread!\n");
+
+		while (!__atomic_load_n(&ws->wr.ready, __ATOMIC_ACQUIRE))
+			sched_yield();
+	}
+}
+
+static void stop_rx_writers(struct ctx *ctx, struct worker_struct *threadpool)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->workers; ++i) {
+		pthread_join(threadpool[i].wr.trid, NULL);
+		spsc_queue_destroy(&threadpool[i].wr.queue);
+	}
+}
+
+/*
+ * With several devices, each worker queues its slots as it would to a
+ * writer, and a single merger writes them out in timestamp order. The
+ * merger takes the oldest packet at the heads of all queues, but while a
+ * queue is empty, it waits until that packet is merge_window ms old, as
+ * an older one might still be on its way in the ring behind that queue.
+ */
+struct merge_input {
+	struct worker_struct *ws;
+	/* Slot at the head of the queue, and packets left to write of it */
+	struct spsc_elem *elem;
+	unsigned long left;
+	struct tpacket3_hdr *hdr;
+	/* Packet up next */
+	struct frame_map *fm, t3;
+	uint64_t ns;
+};
+
+struct merge_struct {
+	pthread_t trid;
+	struct ctx *ctx;
+	struct worker_struct *threadpool;
+	struct merge_input *in;
+	bool ready;
+	unsigned long packets, reordered;
+};
+
+static void merge_input_release(struct merge_input *in)
+{
+	struct writer_struct *wr = &in->ws->wr;
+	struct frame_map *hdr = in->elem->ptr;
+	uint64_t ns;
+
+	if (in->ws->rx_ring.v3) {
+		struct block_desc *pbd = in->elem->ptr;
+
+		ns = pcap_trigger_ns(pbd->h1.ts_last_pkt.ts_sec,
+				     pbd->h1.ts_last_pkt.ts_nsec);
+		kernel_may_pull_from_rx_block(pbd);
+	} else {
+		ns = pcap_trigger_ns(hdr->tp_h.tp_sec, hdr->tp_h.tp_nsec);
+		kernel_may_pull_from_rx(&hdr->tp_h);
+	}
+
+	__atomic_store_n(&wr->last_ns, ns, __ATOMIC_RELAXED);
+	spsc_queue_pop(&wr->queue);
+	wr->written++;
+	in->elem = NULL;
+}
+
+/* Makes the next packet of an input available, if it has any yet */
+static bool merge_input_peek(struct merge_input *in)
+{
+	struct writer_struct *wr = &in->ws->wr;
+	unsigned int depth;
+
+	if (in->elem)
+		return true;
+
+	while ((in->elem = spsc_queue_peek(&wr->queue))) {
+		depth = spsc_queue_used(&wr->queue);
+		if (depth > wr->max_depth)
+			wr->max_depth = depth;
+
+		in->left = in->elem->val;
+		if (in->left)
+			break;
+
+		merge_input_release(in);
+	}
+
+	if (!in->elem)
+		return false;
+
+	if (in->ws->rx_ring.v3) {
+		struct block_desc *pbd = in->elem->ptr;
+
+		in->hdr = (void *) ((uint8_t *) pbd + pbd->h1.offset_to_first_pkt);
+		tpacket3_hdr_to_frame_map(in->hdr, &in->t3);
+		in->fm = &in->t3;
+	} else {
+		in->fm = in->elem->ptr;
+	}
+
+	in->ns = pcap_trigger_ns(in->fm->tp_h.tp_sec, in->fm->tp_h.tp_nsec);
+	return true;
+}
+
+static void merge_input_advance(struct merge_input *in)
+{
+	if (--in->left == 0) {
+		merge_input_release(in);
+		return;
+	}
+
+	in->hdr = (void *) ((uint8_t *) in->hdr + in->hdr->tp_next_offset);
+	tpacket3_hdr_to_frame_map(in->hdr, &in->t3);
+	in->ns = pcap_trigger_ns(in->t3.tp_h.tp_sec, in->t3.tp_h.tp_nsec);
+}
+
+static inline bool merge_input_done(struct merge_input *in)
+{
+	return __atomic_load_n(&in->ws->wr.done, __ATOMIC_ACQUIRE) &&
+	       !merge_input_peek(in);
+}
+
+static void *rx_merger(void *self)
+{
+	bool waiting;
+	unsigned int i, idle = 0, done;
+	uint64_t last = 0;
+	struct merge_struct *ms = self;
+	struct ctx *ctx = ms->ctx;
+	struct merge_input *in, *next;
+	/* The first worker owns the file */
+	struct worker_struct *out = &ms->threadpool[0];
+	uint64_t window = pcap_trigger_ns(0, ctx->merge_window * 1000000UL);
+
+	begin_worker_pcap_file(out);
+	__atomic_store_n(&ms->ready, true, __ATOMIC_RELEASE);
+
+	while (1) {
+		next = NULL;
+		waiting = false;
+
+		for (i = 0, done = 0; i < ctx->merge; ++i) {
+			in = &ms->in[i];
+
+			if (merge_input_peek(in)) {
+				if (!next || in->ns < next->ns)
+					next = in;
+			} else if (merge_input_done(in)) {
+				done++;
+			} else {
+				waiting = true;
+			}
+		}
+
+		if (done == ctx->merge)
+			break;
+
+		/* A full queue means a full ring, which cannot wait */
+		if (!next || (waiting &&
+		    !spsc_queue_full(&next->ws->wr.queue) &&
+		    telemetry_now() < next->ns + window)) {
+			if (idle++ < WRITER_IDLE_SPINS)
+				sched_yield();
+			else
+				usleep(WRITER_IDLE_US);
+			continue;
+		}
+
+		idle = 0;
+
+		if (next->ns < last)
+			ms->reordered++;
+		last = next->ns;
+
+		dump_frame(out, next->fm, ((uint8_t *) next->fm) +
+			   next->fm->tp_h.tp_mac);
+		ms->packets++;
+
+		merge_input_advance(next);
+		next_dump_maybe(out);
+	}
+
+	finish_worker_pcap_file(out);
+
+	return NULL;
+}
+
+static void start_rx_merger(struct merge_struct *ms)
+{
+	int ret;
+	unsigned int i;
+	struct ctx *ctx = ms->ctx;
+
+	ms->in = xzmalloc(ctx->merge * sizeof(*ms->in));
+
+	for (i = 0; i < ctx->merge; ++i) {
+		struct worker_struct *ws = &ms->threadpool[i];
+
+		spsc_queue_init(&ws->wr.queue, rx_ring_slots(&ws->rx_ring));
+		ms->in[i].ws = ws;
+	}
+
+	ret = pthread_create(&ms->trid, NULL, rx_merger, ms);
+	if (ret)
+		panic("Cannot create merger thread!\n");
+
+	while (!__atomic_load_n(&ms->ready, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void stop_rx_merger(struct merge_struct *ms)
+{
+	unsigned int i;
+
+	pthread_join(ms->trid, NULL);
+
+	for (i = 0; i < ms->ctx->merge; ++i)
+		spsc_queue_destroy(&ms->threadpool[i].wr.queue);
+
+	xfree(ms->in);
+}
+
+struct telemetry_struct {
+	pthread_t trid;
+	struct ctx *ctx;
+	struct worker_struct *threadpool;
+	struct telemetry_page *page;
+	/* Totals of the previous sample */
+	struct telemetry_worker *last;
+	uint64_t last_ns;
+};
+
+static inline uint64_t telemetry_rate(uint64_t delta, uint64_t ns)
+{
+	return ns ? delta * TELEMETRY_INTERVAL / ns : 0;
+}
+
+static void telemetry_sample_worker(struct telemetry_struct *ts,
+				    struct worker_struct *ws,
+				    struct telemetry_worker *tw, uint64_t now)
+{
+	unsigned int i;
+	uint64_t interval = now - ts->last_ns, written, age;
+	struct telemetry_worker *last = &ts->last[ws->id];
+
+	update_worker_stats(ws);
+
+	fmemset(tw, 0, sizeof(*tw));
+
+	tw->packets = __atomic_load_n(&ws->frame_count, __ATOMIC_RELAXED);
+	tw->bytes = __atomic_load_n(&ws->bytes, __ATOMIC_RELAXED);
+	tw->drops = __atomic_load_n(&ws->kstats.tp_drops, __ATOMIC_RELAXED);
+	tw->freezes = __atomic_load_n(&ws->freezes, __ATOMIC_RELAXED);
+
+	tw->pps = telemetry_rate(tw->packets - last->packets, interval);
+	tw->bps = telemetry_rate((tw->bytes - last->bytes) * 8, interval);
+	tw->drops_ps = telemetry_rate(tw->drops - last->drops, interval);
+
+	tw->ring_slots = rx_ring_slots(&ws->rx_ring);
+	tw->ring_used = rx_ring_used(&ws->rx_ring,
+				     __atomic_load_n(&ws->ring_next,
+						     __ATOMIC_RELAXED));
+
+	if (ts->ctx->writer) {
+		tw->writer_queued = spsc_queue_used(&ws->wr.queue);
+		tw->ring_used += tw->writer_queued;
+		written = __atomic_load_n(&ws->wr.last_ns, __ATOMIC_RELAXED);
+		if (tw->writer_queued > 0 && written > 0 && now > written)
+			tw->writer_lag_us = (now - written) / 1000;
+	}
+
+	for (i = 0; i < TELEMETRY_AGE_BUCKETS; ++i) {
+		age = __atomic_load_n(&ws->age[i], __ATOMIC_RELAXED);
+		tw->age[i] = age - last->age[i];
+		last->age[i] = age;
+	}
+
+	last->packets = tw->packets;
+	last->bytes = tw->bytes;
+	last->drops = tw->drops;
+}
+
+/* Samples are taken off the page first, so that updates are short */
+static void telemetry_sample(struct telemetry_struct *ts)
+{
+	unsigned int i, workers = ts->ctx->workers;
+	uint64_t now = telemetry_now();
+	struct telemetry_worker tw[workers];
+
+	for (i = 0; i < workers; ++i)
+		telemetry_sample_worker(ts, &ts->threadpool[i], &tw[i], now);
+
+	telemetry_update_begin(ts->page);
+	ts->page->time_ns = now;
+	ts->page->interval_ns = now - ts->last_ns;
+	fmemcpy(ts->page->worker, tw, sizeof(tw));
+	telemetry_update_end(ts->page);
+
+	ts->last_ns = now;
+}
+
+static void *telemetry_worker(void *self)
+{
+	struct telemetry_struct *ts = self;
+
+	while (likely(sigint == 0)) {
+		usleep(WORKER_POLL_TIMEOUT * 1000);
+
+		if (telemetry_now() - ts->last_ns >= TELEMETRY_INTERVAL)
+			telemetry_sample(ts);
+	}
+
+	telemetry_sample(ts);
+
+	return NULL;
+}
+
+static void start_telemetry(struct telemetry_struct *ts)
+{
+	int ret;
+
+	ts->last_ns = telemetry_now();
+
+	ret = pthread_create(&ts->trid, NULL, telemetry_worker, ts);
+	if (ret)
+		panic("Cannot create telemetry thread!\n");
+}
+
+static void stop_telemetry(struct telemetry_struct *ts)
+{
+	pthread_join(ts->trid, NULL);
+
+	telemetry_destroy(ts->page);
+	xfree(ts->last);
+}
+
+static void print_worker_stats(struct ctx *ctx, struct worker_struct *threadpool)
+{
+	unsigned int i;
+	struct tpacket_stats kstats;
+	unsigned long skipped = 0;
+
+	fmemset(&kstats, 0, sizeof(kstats));
+
+	for (i = 0; i < ctx->workers; ++i) {
+		struct worker_struct *ws = &threadpool[i];
+
+		update_worker_stats(ws);
+
+		kstats.tp_packets += ws->kstats.tp_packets;
+		kstats.tp_drops += ws->kstats.tp_drops;
+		skipped += ws->skipped;
+
+		if (ctx->verbose && ctx->workers > 1)
+			printf("\rWorker %u (CPU%d): %u packets, %u drops\n",
+			       ws->id, ws->cpu, ws->kstats.tp_packets,
+			       ws->kstats.tp_drops);
+		if (ctx->verbose && ctx->writer)
+			printf("\rWriter %u: %lu slots written, %lu stalls, "
+			       "max %u of %u slots queued\n", ws->id,
+			       ws->wr.written, ws->wr.stalls, ws->wr.max_depth,
+			       rx_ring_slots(&ws->rx_ring));
+		if (ctx->verbose && dump_on_trigger(ctx))
+			printf("\rTrigger %u: %lu events, %lu packets held, "
+			       "%lu expired unwritten\n", ws->id,
+			       ws->trig_events, ws->trig.held,
+			       ws->trig.expired);
+		if (ctx->verbose)
+			printf("\rSpin %u: %lu hits, %lu sleeps\n", ws->id,
+			       ws->spin.hits, ws->spin.sleeps);
+		if (ctx->verbose && sample_enabled(ctx))
+			printf("\rSampling %u: 1 in %u, %u changes\n", ws->id,
+			       ws->sample_rate, ws->sample_changes);
+	}
+
+	print_net_stats(&kstats, skipped);
+}
+
+static int worker_cpu(struct ctx *ctx, unsigned int i, int cpus)
+{
+	int cpu;
+
+	if (ctx->workers == 1)
+		return -1;
+
+	/* Without a CPU given, spread over the node of the device */
+	if (ctx->cpu < 0 && ctx->numa_node >= 0) {
+		cpu = numa_node_cpu(ctx->numa_node, i);
+		if (cpu >= 0)
+			return cpu;
+	}
+
+	return (max(ctx->cpu, 0) + i) % cpus;
+}
+
+/* Merged devices get a worker each, otherwise all work on the one */
+static inline unsigned int rx_devices(struct ctx *ctx)
+{
+	return ctx->merge ? : 1;
+}
+
+static inline char *rx_device(struct ctx *ctx, unsigned int i)
+{
+	return ctx->merge ? ctx->devices[i] : ctx->device_in;
+}
+
+/* Streams go to a collector, whatever the name looks like locally */
+static void check_dump_dir(struct ctx *ctx)
+{
+	int ret;
+	struct stat stats;
+
+	fmemset(&stats, 0, sizeof(stats));
+	ret = stat(ctx->device_out, &stats);
+	ctx->dump_dir = !ctx->stream && ret == 0 && S_ISDIR(stats.st_mode);
+
+	if (ctx->dump_dir &&
+	    ctx->device_out[strlen(ctx->device_out) - 1] == '/')
+		ctx->device_out[strlen(ctx->device_out) - 1] = 0;
+}
+
+static void recv_only_or_dump(struct ctx *ctx)
+{
+	short *ifflags;
+	int ifindex, ret, cpus, bound, *irq_cpus;
+	unsigned int size, i, devs = rx_devices(ctx);
+	struct irq_affinity *irq_aff;
+	struct worker_struct *threadpool;
+	struct telemetry_struct telemetry;
+	struct merge_struct merge;
+	struct xsk_redirect redirect;
+	struct sock_fprog bpf_ops;
+	struct timeval start, end, diff;
+
+	for (i = 0; i < devs; ++i) {
+		if (!device_up_and_running(rx_device(ctx, i)) && !ctx->rfraw)
+			panic("Device %s not up and running!\n",
+			      rx_device(ctx, i));
+	}
 
-	prepare_polling(sock, &rx_poll);
-	dissector_init_all(ctx->print_mode);
+	if (pcap_sharded(ctx) && dump_to_pcap(ctx) &&
+	    !strncmp("-", ctx->device_out, strlen("-")))
+		panic("Workers cannot share a pcap on stdout!\n");
+	/* Workers of merged devices hand their slots to the merger instead */
+	if (ctx->merge)
+		ctx->writer = true;
+	if (!dump_to_pcap(ctx))
+		ctx->writer = false;
+	if (dump_on_trigger(ctx) && !dump_to_pcap(ctx))
+		panic("Triggers need a pcap to dump into!\n");
 
-	if (ctx->cpu >= 0 && ifindex > 0) {
-		irq = device_irq_number(ctx->device_in);
-		device_bind_irq_to_cpu(irq, ctx->cpu);
+	if (ctx->rfraw) {
+		ctx->device_trans = xstrdup(ctx->device_in);
+		xfree(ctx->device_in);
 
-		if (ctx->verbose)
-			printf("IRQ: %s:%d > CPU%d\n",
-			       ctx->device_in, irq, ctx->cpu);
+		enter_rfmon_mac80211(ctx->device_trans, &ctx->device_in);
+		ctx->link_type = LINKTYPE_IEEE802_11;
 	}
 
-	if (ctx->promiscuous)
-		ifflags = enter_promiscuous_mode(ctx->device_in);
+	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
 
-	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
+	ifindex = device_ifindex(ctx->device_in);
 
-	if (dump_to_pcap(ctx)) {
-		__label__ try_file;
-		struct stat stats;
+	enable_kernel_bpf_jit_compiler();
 
-		fmemset(&stats, 0, sizeof(stats));
-		ret = stat(ctx->device_out, &stats);
-		if (ret < 0) {
-			ctx->dump_dir = 0;
-			goto try_file;
-		}
+	if (ctx->snaphdr && ctx->link_type != LINKTYPE_EN10MB)
+		panic("Header snaplen needs an Ethernet device!\n");
 
-		ctx->dump_dir = S_ISDIR(stats.st_mode);
-		if (ctx->dump_dir) {
-			fd = begin_multi_pcap_file(ctx);
-		} else {
-		try_file:
-			fd = begin_single_pcap_file(ctx);
-		}
+	bpf_parse_rules(ctx->device_in, ctx->filter, &bpf_ops);
+	bpf_append_pkttype_snaplen(&bpf_ops, ctx->packet_type, ctx->snaplen,
+				   ctx->snaphdr);
+	if (ctx->dump_bpf)
+		bpf_dump_all(&bpf_ops);
+
+	if (ctx->trigger_filter)
+		bpf_parse_rules(ctx->device_in, ctx->trigger_filter,
+				&ctx->trigger_ops);
+
+	threadpool = xzmalloc(ctx->workers * sizeof(*threadpool));
+	cpus = get_number_cpus_online();
+	ctx->fanout_id = getpid() & 0xffff;
+	ctx->fanout_type = PACKET_FANOUT_POLICY_DEFAULT;
+
+	for (i = 0; i < ctx->workers; ++i) {
+		threadpool[i].id = i;
+		threadpool[i].ctx = ctx;
+		threadpool[i].cpu = worker_cpu(ctx, i, cpus);
+		threadpool[i].dev = rx_device(ctx, ctx->merge ? i : 0);
+		threadpool[i].sample_fd = -1;
 	}
 
-	printf("Running! Hang up with ^C!\n\n");
-	fflush(stdout);
+	/*
+	 * Vector i goes to the CPU of worker i % workers. If there is one
+	 * vector per queue, in queue order, queue mapping fanout hands
+	 * queue i to that same worker, so that each packet is captured on
+	 * the CPU that took its interrupt. Merged devices have all their
+	 * vectors on the CPU of their worker.
+	 */
+	irq_aff = xzmalloc(devs * sizeof(*irq_aff));
+	if (ctx->cpu >= 0 && ctx->merge) {
+		for (i = 0; i < devs; ++i)
+			bind_irqs(ctx, threadpool[i].dev, &threadpool[i].cpu, 1,
+				  &irq_aff[i]);
+	} else if (ctx->cpu >= 0 && ifindex > 0) {
+		irq_cpus = xmalloc(ctx->workers * sizeof(*irq_cpus));
+		for (i = 0; i < ctx->workers; ++i)
+			irq_cpus[i] = ctx->workers > 1 ? threadpool[i].cpu :
+				      ctx->cpu;
+
+		bound = bind_irqs(ctx, ctx->device_in, irq_cpus, ctx->workers,
+				  irq_aff);
+		if (bound > 1 && ctx->workers > 1 &&
+		    bound == (int) device_rx_queues(ctx->device_in))
+			ctx->fanout_type = PACKET_FANOUT_POLICY_QM;
+
+		xfree(irq_cpus);
+	}
 
-	bug_on(gettimeofday(&start, NULL));
+	if (ctx->xdp) {
+		if (ctx->workers > device_rx_queues(ctx->device_in))
+			panic("%s has only %u queues for XDP workers!\n",
+			      ctx->device_in, device_rx_queues(ctx->device_in));
 
-	while (likely(sigint == 0)) {
-		while (user_may_pull_from_rx(rx_ring.frames[it].iov_base)) {
-			__label__ next;
+		xsk_redirect_create(&redirect, ctx->workers);
+	}
 
-			hdr = rx_ring.frames[it].iov_base;
-			packet = ((uint8_t *) hdr) + hdr->tp_h.tp_mac;
-			frame_count++;
+	for (i = 0; i < ctx->workers; ++i) {
+		struct worker_struct *ws = &threadpool[i];
 
-			if (ctx->packet_type != -1)
-				if (ctx->packet_type != hdr->s_ll.sll_pkttype)
-					goto next;
+		/* The ring budget is split among all workers */
+		size = ring_size(ws->dev, ctx->reserve_size) / ctx->workers;
 
-			if (unlikely(ring_frame_size(&rx_ring) < hdr->tp_h.tp_snaplen)) {
-				skipped++;
-				goto next;
-			}
+		setup_rx_worker(ws, &bpf_ops, &redirect, size,
+				device_ifindex(ws->dev));
 
-			if (dump_to_pcap(ctx)) {
-				tpacket_hdr_to_pcap_pkthdr(&hdr->tp_h, &hdr->s_ll, &phdr, ctx->magic);
+		if (dump_on_trigger(ctx))
+			pcap_trigger_init(&threadpool[i].trig,
+					  ctx->trigger_mem / ctx->workers,
+					  ctx->trigger);
+	}
 
-				ret = __pcap_io->write_pcap(fd, &phdr, ctx->magic, packet,
-							    pcap_get_length(&phdr, ctx->magic));
-				if (unlikely(ret != pcap_get_total_length(&phdr, ctx->magic)))
-					panic("Write error to pcap!\n");
-			}
+	/* Only now that all queues have a socket, packets go to them */
+	if (ctx->xdp)
+		xsk_redirect_attach(&redirect, ifindex);
 
-			show_frame_hdr(hdr, ctx->print_mode);
+	dissector_init_all(ctx->print_mode);
 
-			dissector_entry_point(packet, hdr->tp_h.tp_snaplen,
-					      ctx->link_type, ctx->print_mode);
+	fmemset(&telemetry, 0, sizeof(telemetry));
+	if (ctx->telemetry) {
+		telemetry.ctx = ctx;
+		telemetry.threadpool = threadpool;
+		telemetry.page = telemetry_create(ctx->telemetry, ctx->workers);
+		telemetry.last = xzmalloc(ctx->workers * sizeof(*telemetry.last));
 
-			if (frame_count_max != 0) {
-				if (frame_count >= frame_count_max) {
-					sigint = 1;
-					break;
-				}
-			}
+		if (ctx->verbose)
+			printf("Telemetry: %s, %u workers\n", ctx->telemetry,
+			       ctx->workers);
+	}
 
-			next:
+	if (ctx->publish) {
+		ctx->shm = shm_ring_create(ctx->publish, ctx->publish_size);
 
-			kernel_may_pull_from_rx(&hdr->tp_h);
+		if (ctx->verbose)
+			printf("Publish: %s, %lu bytes\n", ctx->publish,
+			       ctx->publish_size);
+	}
 
-			it++;
-			if (it >= rx_ring.layout.tp_frame_nr)
-				it = 0;
+	ifflags = xzmalloc(devs * sizeof(*ifflags));
+	for (i = 0; ctx->promiscuous && i < devs; ++i)
+		ifflags[i] = enter_promiscuous_mode(rx_device(ctx, i));
 
-			if (unlikely(sigint == 1))
-				break;
+	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
 
-			if (dump_to_pcap(ctx)) {
-				if (ctx->dump_mode == DUMP_INTERVAL_SIZE) {
-					interval += hdr->tp_h.tp_snaplen;
+	if (dump_to_pcap(ctx))
+		check_dump_dir(ctx);
 
-					if (interval > ctx->dump_interval) {
-						next_dump = true;
-						interval = 0;
-					}
-				}
+	if (ctx->keep && !ctx->dump_dir)
+		panic("Keeping files needs a directory to dump into!\n");
 
-				if (next_dump) {
-					fd = next_multi_pcap_file(ctx, fd);
-					next_dump = false;
+	/* Opened up front, so that a pcap on stdout comes first */
+	fmemset(&merge, 0, sizeof(merge));
+	if (ctx->writer && ctx->merge) {
+		merge.ctx = ctx;
+		merge.threadpool = threadpool;
+		start_rx_merger(&merge);
 
-					if (ctx->verbose)
-						print_pcap_file_stats(sock, ctx, skipped);
-				}
-			}
+		if (ctx->verbose)
+			printf("Merge: %u devices, %u ms window\n", ctx->merge,
+			       ctx->merge_window);
+	} else if (ctx->writer)
+		start_rx_writers(ctx, threadpool);
+	else if (ctx->workers == 1)
+		begin_worker_pcap_file(&threadpool[0]);
+
+	printf("Running! Hang up with ^C!\n\n");
+	fflush(stdout);
+
+	bug_on(gettimeofday(&start, NULL));
+
+	if (ctx->telemetry)
+		start_telemetry(&telemetry);
+
+	if (ctx->workers > 1) {
+		for (i = 0; i < ctx->workers; ++i) {
+			ret = pthread_create(&threadpool[i].trid, NULL, rx_worker,
+					     &threadpool[i]);
+			if (ret)
+				panic("Cannot create worker thread!\n");
+
+			if (ctx->verbose)
+				printf("Worker %u: %s socket %d > CPU%d\n", i,
+				       threadpool[i].dev, threadpool[i].sock,
+				       threadpool[i].cpu);
 		}
 
-		poll(&rx_poll, 1, -1);
-		poll_error_maybe_die(sock, &rx_poll);
+		for (i = 0; i < ctx->workers; ++i)
+			pthread_join(threadpool[i].trid, NULL);
+	} else {
+		rx_worker(&threadpool[0]);
 	}
 
+	if (ctx->telemetry)
+		stop_telemetry(&telemetry);
+
+	if (ctx->writer && ctx->merge)
+		stop_rx_merger(&merge);
+	else if (ctx->writer)
+		stop_rx_writers(ctx, threadpool);
+
 	bug_on(gettimeofday(&end, NULL));
 	diff = tv_subtract(end, start);
 
-	if (!(ctx->dump_dir && ctx->print_mode == PRINT_NONE)) {
-		sock_print_net_stats(sock, skipped);
+	if (!(ctx->dump_dir && ctx->print_mode == PRINT_NONE) ||
+	    ctx->workers > 1) {
+		print_worker_stats(ctx, threadpool);
+
+		if (ctx->verbose && ctx->writer && ctx->merge)
+			printf("\rMerge: %lu packets, %lu out of order\n",
+			       merge.packets, merge.reordered);
+		if (ctx->verbose && ctx->shm) {
+			unsigned long packets, overwritten;
+
+			shm_ring_stats(ctx->shm, &packets, &overwritten);
+			printf("\rPublish: %lu packets, %lu overwritten\n",
+			       packets, overwritten);
+		}
 
 		printf("\r%12lu  sec, %lu usec in total\n",
 		       diff.tv_sec, diff.tv_usec);
@@ -968,23 +2825,240 @@ static void recv_only_or_dump(struct ctx *ctx)
 	}
 
 	bpf_release(&bpf_ops);
+	if (ctx->trigger_filter)
+		bpf_release(&ctx->trigger_ops);
 	dissector_cleanup_all();
-	destroy_rx_ring(sock, &rx_ring);
 
-	if (ctx->promiscuous)
-		leave_promiscuous_mode(ctx->device_in, ifflags);
+	if (ctx->xdp)
+		xsk_redirect_destroy(&redirect);
+
+	if (ctx->shm)
+		shm_ring_destroy(ctx->shm);
+
+	for (i = 0; i < ctx->workers; ++i)
+		destroy_rx_worker(&threadpool[i]);
+
+	for (i = 0; i < devs; ++i)
+		device_restore_irqs(&irq_aff[i]);
+	xfree(irq_aff);
+
+	for (i = 0; ctx->promiscuous && i < devs; ++i)
+		leave_promiscuous_mode(rx_device(ctx, i), ifflags[i]);
+	xfree(ifflags);
 
 	if (ctx->rfraw)
 		leave_rfmon_mac80211(ctx->device_trans, ctx->device_in);
 
-	if (dump_to_pcap(ctx)) {
-		if (ctx->dump_dir)
-			finish_multi_pcap_file(ctx, fd);
+	if (ctx->workers == 1 && !ctx->writer)
+		finish_worker_pcap_file(&threadpool[0]);
+
+	/* Only now all data went through, a pcap on stdout gets no text */
+	if (ctx->verbose && dump_to_pcap(ctx) && __pcap_io->print_stats_pcap &&
+	    strncmp("-", ctx->device_out, strlen("-")))
+		__pcap_io->print_stats_pcap();
+
+	xfree(threadpool);
+}
+
+struct collect_struct {
+	pthread_t trid;
+	int sock;
+	char peer[NI_MAXHOST + NI_MAXSERV], prefix[256];
+	/* Agents differ in pcap type and file names, so each has a copy */
+	struct ctx ctx;
+	struct worker_struct ws;
+};
+
+static unsigned int collect_agents = 0;
+
+/* Writes what one agent streams through the pcap I/O of the output */
+static void *collect_agent(void *self)
+{
+	int ret;
+	uint8_t *packet;
+	unsigned long packets = 0, bytes = 0;
+	struct collect_struct *cs = self;
+	struct ctx *ctx = &cs->ctx;
+	struct tpacket2_hdr thdr;
+	struct sockaddr_ll sll;
+	pcap_pkthdr_t phdr;
+
+	do {
+		ret = pcap_stream_ops.pull_fhdr_pcap(cs->sock, &ctx->magic,
+						     &ctx->link_type);
+	} while (ret == -EAGAIN && sigint == 0);
+	if (ret)
+		goto out;
+
+	begin_worker_pcap_file(&cs->ws);
+
+	while (likely(sigint == 0)) {
+		ret = pcap_read_zc(&pcap_stream_ops, cs->sock, &phdr,
+				   ctx->magic, &packet, NULL, 0);
+		if (ret == -EAGAIN)
+			continue;
+		if (unlikely(ret < 0))
+			break;
+
+		pcap_pkthdr_to_tpacket_hdr(&phdr, ctx->magic, &thdr, &sll);
+		dump_record(&cs->ws, &phdr, packet, thdr.tp_sec, thdr.tp_nsec);
+
+		packets++;
+		bytes += thdr.tp_len;
+
+		next_dump_maybe(&cs->ws);
+	}
+
+	finish_worker_pcap_file(&cs->ws);
+
+	if (strncmp("-", ctx->device_out, strlen("-")))
+		printf("%s: %lu packets, %lu bytes%s\n", cs->peer, packets,
+		       bytes, ret == -EINVAL ? ", stream broken off" : "");
+out:
+	pcap_stream_ops.prepare_close_pcap(cs->sock, PCAP_MODE_RD);
+	close(cs->sock);
+	xfree(cs);
+
+	__sync_sub_and_fetch(&collect_agents, 1);
+
+	return NULL;
+}
+
+/*
+ * Agents are served each in a thread of its own and into files of its
+ * own if the output is a directory, otherwise the first one that connects
+ * is written to the output and the collector is done once it hangs up.
+ */
+static void collect_pcap(struct ctx *ctx)
+{
+	int lsock, sock, ret;
+	unsigned int conns = 0;
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	struct collect_struct *cs;
+	struct pollfd lpoll;
+	/* Readers look up for sigint as often as the workers do */
+	struct timeval tv = {
+		.tv_usec = WORKER_POLL_TIMEOUT * 1000,
+	};
+
+	lsock = pcap_stream_listen(ctx->collect);
+
+	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
+
+	check_dump_dir(ctx);
+	if (ctx->keep && !ctx->dump_dir)
+		panic("Keeping files needs a directory to dump into!\n");
+
+	/* Agents come and go, so the timer does not belong to any of them */
+	if (ctx->dump_dir && ctx->dump_mode == DUMP_INTERVAL_TIME) {
+		interval = ctx->dump_interval;
+
+		set_itimer_interval_value(&itimer, interval, 0);
+		setitimer(ITIMER_REAL, &itimer, NULL);
+	}
+
+	if (strncmp("-", ctx->device_out, strlen("-"))) {
+		printf("Running! Hang up with ^C!\n\n");
+		fflush(stdout);
+	}
+
+	lpoll.fd = lsock;
+	lpoll.events = POLLIN;
+
+	while (likely(sigint == 0)) {
+		if (poll(&lpoll, 1, WORKER_POLL_TIMEOUT) <= 0)
+			continue;
+
+		addr_len = sizeof(addr);
+		sock = accept(lsock, (struct sockaddr *) &addr, &addr_len);
+		if (sock < 0)
+			continue;
+
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		cs = xzmalloc(sizeof(*cs));
+		cs->sock = sock;
+		cs->ctx = *ctx;
+		cs->ws.ctx = &cs->ctx;
+		cs->ws.id = ++conns;
+		cs->ws.fd = -1;
+		cs->ws.sample_fd = -1;
+		cs->ws.dump_gen = dump_gen;
+
+		ret = getnameinfo((struct sockaddr *) &addr, addr_len, host,
+				  sizeof(host), serv, sizeof(serv),
+				  NI_NUMERICHOST | NI_NUMERICSERV);
+		if (ret)
+			slprintf(cs->peer, sizeof(cs->peer), "agent%u", conns);
 		else
-			finish_single_pcap_file(ctx, fd);
+			slprintf(cs->peer, sizeof(cs->peer), "%s-%s", host, serv);
+
+		__sync_add_and_fetch(&collect_agents, 1);
+
+		if (!ctx->dump_dir) {
+			collect_agent(cs);
+			break;
+		}
+
+		slprintf(cs->prefix, sizeof(cs->prefix), "%s%s-",
+			 ctx->prefix ? : "dump-", cs->peer);
+		cs->ctx.prefix = cs->prefix;
+
+		ret = pthread_create(&cs->trid, NULL, collect_agent, cs);
+		if (ret)
+			panic("Cannot create collector thread!\n");
+		pthread_detach(cs->trid);
+	}
+
+	while (__atomic_load_n(&collect_agents, __ATOMIC_ACQUIRE) > 0)
+		usleep(WORKER_POLL_TIMEOUT * 1000);
+
+	close(lsock);
+
+	fmemset(&itimer, 0, sizeof(itimer));
+	setitimer(ITIMER_REAL, &itimer, NULL);
+
+	if (ctx->verbose && __pcap_io->print_stats_pcap &&
+	    strncmp("-", ctx->device_out, strlen("-")))
+		__pcap_io->print_stats_pcap();
+}
+
+/*
+ * Runs the threads on the NUMA node of the device, unless a CPU was given,
+ * and makes their rings and buffers come from its memory. Both are set on
+ * the main thread before anything is allocated, the others inherit them.
+ */
+static void numa_placement(struct ctx *ctx, const char *dev)
+{
+	int ret, cpus = 0;
+
+	if (!ctx->numa)
+		return;
+
+	ctx->numa_node = device_numa_node(dev);
+	if (ctx->numa_node < 0) {
+		if (ctx->verbose)
+			printf("NUMA: %s has no node\n", dev);
+		return;
 	}
 
-	close(sock);
+	ret = numa_prefer_node(ctx->numa_node);
+	if (ctx->cpu < 0)
+		cpus = numa_node_affinity(ctx->numa_node);
+
+	if (!ctx->verbose)
+		return;
+
+	printf("NUMA: %s on node %d, ", dev, ctx->numa_node);
+	if (ctx->cpu >= 0)
+		printf("threads on CPU%d as given, ", ctx->cpu);
+	else if (cpus > 0)
+		printf("threads on its %d CPUs, ", cpus);
+	else
+		printf("threads not pinned, ");
+	printf("memory %s\n", ret == 0 ? "from there" : "not placed");
 }
 
 static void help(void)
@@ -997,8 +3071,31 @@ static void help(void)
 	     "  -o|--out <dev|pcap|dir|cfg|->  Output sink as netdev, pcap, directory, trafgen, or stdout\n"
 	     "  -f|--filter <bpf-file|expr>    Use BPF filter file from bpfc or tcpdump-like expression\n"
 	     "  -t|--type <type>               Filter for: host|broadcast|multicast|others|outgoing\n"
+	     "  -L|--snaplen <len|hdr[,len]>   Capture len bytes, or TCP headers, DNS in full, rest up to len\n"
+	     "  -j|--sample [flow:]<num|auto>  Capture 1 in num packets or flows, or adapt num to drops\n"
+	     "  --telemetry <file>             Publish rates, drops, ring fill and lag in file each second\n"
+	     "  --merge-window <ms>            Reorder window when merging --in eth0,eth1 (def: 10)\n"
+	     "  --xdp                          Capture via AF_XDP in generic mode, a worker per queue\n"
+	     "  --publish <file>               Publish packets in a shared memory ring for local readers\n"
+	     "  --publish-size <size>          Size of the published ring in KiB/MiB/GiB (def: 64MiB)\n"
+	     "  --stream <host:port>           Stream the capture over TCP to a collector, -Z compresses\n"
+	     "  --collect <[addr:]port>        Collect streamed captures into the pcap, dir or stdout of -o\n"
 	     "  -F|--interval <size|time>      Dump interval if -o is a dir: <num>KiB/MiB/GiB/s/sec/min/hrs\n"
+	     "  -K|--keep <num>                Keep only the last num pcaps in dir, reusing the oldest\n"
+	     "  -e|--trigger <sec>             Hold packets in memory, dump sec before/after a trigger\n"
+	     "  -E|--trigger-filter <bpf>      Trigger on packets matching this filter file or expression\n"
+	     "  -Y|--trigger-drops <percent>   Trigger when this share of packets is dropped in a second\n"
+	     "  -C|--trigger-mem <size>        Memory for held packets in KiB/MiB/GiB (def: 64MiB)\n"
 	     "  -J|--jumbo-support             Support for 64KB Super Jumbo Frames (def: 2048B)\n"
+	     "  -3|--tpacket-v3                Capture into TPACKET_V3 variable-length blocks\n"
+	     "  -W|--block-timeout <ms>        Retire partially filled v3 blocks after ms (def: 100)\n"
+	     "  -y|--spin <num|<num>us>        Spin num rounds or num us on the next slot before sleeping\n"
+	     "  -p|--busy-poll <us>            Let the kernel busy poll the device for us (SO_BUSY_POLL)\n"
+	     "  -x|--writer-thread             Dump pcaps from a separate writer thread per worker\n"
+	     "  -w|--workers <num>             Capture/read pcap with num workers, implies --silent\n"
+	     "  -I|--index                     Write a time index <pcap>.idx next to pcaps\n"
+	     "  -a|--time-from <time>          Read/replay pcap records from this time on\n"
+	     "  -z|--time-to <time>            Read/replay pcap records before this time\n"
 	     "  -R|--rfraw                     Capture or inject raw 802.11 frames\n"
 	     "  -n|--num <0|uint>              Number of packets until exit (def: 0)\n"
 	     "  -P|--prefix <name>             Prefix for pcaps stored in directory\n"
@@ -1010,6 +3107,10 @@ static void help(void)
 	     "  -A|--no-sock-mem               Don't tune core socket memory\n"
 	     "  -m|--mmap                      Mmap(2) pcap file i.e., for replaying pcaps\n"
 	     "  -G|--sg                        Scatter/gather pcap file I/O\n"
+	     "  -U|--uring                     Asynchronous io_uring(7) pcap file I/O\n"
+	     "  -O|--direct                    Double-buffered O_DIRECT pcap file I/O\n"
+	     "  --vmsplice                     Vmsplice(2) a pcap on stdout into its pipe\n"
+	     "  -Z|--compress                  Write gzip compressed pcaps (.pcap.gz in dir)\n"
 	     "  -c|--clrw                      Use slower read(2)/write(2) I/O\n"
 	     "  -S|--ring-size <size>          Specify ring size to: <num>KiB/MiB/GiB\n"
 	     "  -k|--kernel-pull <uint>        Kernel pull from user interval in us (def: 10us)\n"
@@ -1018,6 +3119,7 @@ static void help(void)
 	     "  -g|--group <groupid>           Drop privileges and change to groupid\n"
 	     "  -H|--prio-high                 Make this high priority process\n"
 	     "  -Q|--notouch-irq               Do not touch IRQ CPU affinity of NIC\n"
+	     "  -N|--no-numa                   Do not place threads and memory on the NIC's NUMA node\n"
 	     "  -s|--silent                    Do not print captured packets\n"
 	     "  -q|--less                      Print less-verbose packet information\n"
 	     "  -X|--hex                       Print packet data in hex format\n"
@@ -1032,6 +3134,10 @@ static void help(void)
 	     "  netsniff-ng --in dump.pcap --out dump.cfg --silent --bind-cpu 0\n"
 	     "  netsniff-ng --in eth0 --out eth1 --silent --bind-cpu 0 --type host\n"
 	     "  netsniff-ng --in eth1 --out /opt/probe/ -s -m -J --interval 100MiB -b 0\n"
+	     "  netsniff-ng --in eth0 --out dump.pcap -s --tpacket-v3 --block-timeout 10\n"
+	     "  netsniff-ng --in eth0 --out /opt/probe/ --workers 4 --bind-cpu 0\n"
+	     "  netsniff-ng --in eth0,eth1 --out tap.pcap -s -T 0xa1e2cb12\n"
+	     "  netsniff-ng --in dump.pcap --time-from 2013-06-01T12:00:00 --time-to 2013-06-01T12:05:00\n"
 	     "  netsniff-ng --in vlan0 --out dump.pcap -c -u `id -u bob` -g `id -g bob`\n"
 	     "  netsniff-ng --in any --filter http.bpf --jumbo-support --ascii -V\n\n"
 	     "Note:\n"
@@ -1061,10 +3167,99 @@ static void version(void)
 	die();
 }
 
+/* Seconds since the epoch, or a local time as in 2013-06-01T12:00:00 */
+static uint32_t parse_time(const char *str)
+{
+	char *end;
+	struct tm tm;
+	unsigned long sec;
+
+	fmemset(&tm, 0, sizeof(tm));
+	tm.tm_isdst = -1;
+
+	end = strptime(str, "%Y-%m-%dT%H:%M:%S", &tm);
+	if (!end || *end)
+		end = strptime(str, "%Y-%m-%d %H:%M:%S", &tm);
+	if (end && !*end)
+		return (uint32_t) mktime(&tm);
+
+	sec = strtoul(str, &end, 0);
+	if (*end || end == str)
+		panic("Cannot parse time %s!\n", str);
+
+	return (uint32_t) sec;
+}
+
+/*
+ * AF_XDP sockets get their packets past the socket filter, the rest of
+ * the filter still runs in user space. By default, all queues are taken.
+ */
+static void xdp_workers(struct ctx *ctx, int workers_touched)
+{
+	if (ctx->merge)
+		panic("Cannot merge devices with XDP!\n");
+	if (ctx->rfraw || ctx->v3)
+		panic("XDP has no monitor mode or TPACKET_V3 blocks!\n");
+	if (ctx->packet_type != -1 || ctx->snaphdr)
+		panic("Packet types and header snaplen need PF_PACKET!\n");
+	if (sample_enabled(ctx))
+		panic("Sampling needs PF_PACKET!\n");
+	if (!device_mtu(ctx->device_in))
+		panic("XDP needs a network device!\n");
+
+	if (!workers_touched)
+		ctx->workers = device_rx_queues(ctx->device_in);
+}
+
+/* In --in eth0,eth1 the first device stands in wherever one is needed */
+static void merge_devices(struct ctx *ctx)
+{
+	unsigned int i;
+	char *dev, *save = NULL;
+
+	for (dev = strtok_r(ctx->device_in, ",", &save); dev;
+	     dev = strtok_r(NULL, ",", &save)) {
+		ctx->devices = xrealloc(ctx->devices, ctx->merge + 1,
+					sizeof(*ctx->devices));
+		ctx->devices[ctx->merge++] = xstrdup(dev);
+	}
+
+	if (ctx->merge < 2)
+		panic("Need at least two devices to merge!\n");
+
+	for (i = 0; i < ctx->merge; ++i) {
+		if (!device_mtu(ctx->devices[i]))
+			panic("Cannot merge %s, no such device!\n",
+			      ctx->devices[i]);
+	}
+
+	if (ctx->workers > 1)
+		panic("Merged devices get a worker each, drop --workers!\n");
+	if (ctx->rfraw)
+		panic("Cannot merge devices in monitor mode!\n");
+	if (ctx->trigger)
+		panic("Triggers cannot be used with merged devices!\n");
+	if (ctx->sample_auto)
+		panic("Merged devices need a fixed sampling rate!\n");
+
+	/*
+	 * TPACKET_V3 hands out a block only once it is retired, so a packet
+	 * may show up that late behind a newer one of another device.
+	 */
+	if (ctx->v3 && ctx->merge_window)
+		ctx->merge_window = max(ctx->merge_window, ctx->block_tov ? :
+					RX_BLOCK_TOV_DEFAULT);
+
+	xfree(ctx->device_in);
+	ctx->device_in = xstrdup(ctx->devices[0]);
+	ctx->workers = ctx->merge;
+}
+
 int main(int argc, char **argv)
 {
 	char *ptr;
 	int c, i, j, cpu_tmp, opt_index, ops_touched = 0, vals[4] = {0};
+	int workers_touched = 0;
 	bool prio_high = false, setsockmem = true;
 	void (*main_loop)(struct ctx *ctx) = NULL;
 	struct ctx ctx = {
@@ -1080,6 +3275,13 @@ int main(int argc, char **argv)
 		.uid = getuid(),
 		.gid = getgid(),
 		.magic = ORIGINAL_TCPDUMP_MAGIC,
+		.workers = 1,
+		.trigger_mem = TRIGGER_MEM_DEFAULT,
+		.numa = true,
+		.numa_node = -1,
+		.sample_rate = 1,
+		.merge_window = MERGE_WINDOW_DEFAULT,
+		.publish_size = PUBLISH_SIZE_DEFAULT,
 	};
 
 	srand(time(NULL));
@@ -1107,6 +3309,157 @@ int main(int argc, char **argv)
 		case 'J':
 			ctx.jumbo = true;
 			break;
+		case '3':
+			ctx.v3 = true;
+			break;
+		case 'W':
+			ctx.block_tov = strtoul(optarg, NULL, 0);
+			ctx.v3 = true;
+			break;
+		case 'x':
+			ctx.writer = true;
+			break;
+		case 'w':
+			ctx.workers = strtoul(optarg, NULL, 0);
+			if (ctx.workers == 0)
+				panic("Need at least one worker!\n");
+			workers_touched = 1;
+			break;
+		case 'I':
+			ctx.index = true;
+			break;
+		case 'K':
+			ctx.keep = strtoul(optarg, NULL, 0);
+			if (ctx.keep == 0)
+				panic("Need to keep at least one pcap!\n");
+			break;
+		case 'e':
+			ctx.trigger = strtoul(optarg, NULL, 0);
+			if (ctx.trigger == 0)
+				panic("Trigger window needs at least a second!\n");
+			break;
+		case 'E':
+			ctx.trigger_filter = xstrdup(optarg);
+			break;
+		case 'Y':
+			ctx.trigger_drops = strtoul(optarg, NULL, 0);
+			if (ctx.trigger_drops == 0 || ctx.trigger_drops > 100)
+				panic("Drop rate trigger is in 1..100 percent!\n");
+			break;
+		case 'C':
+			ptr = optarg;
+			ctx.trigger_mem = 0;
+
+			for (j = i = strlen(optarg); i > 0; --i) {
+				if (!isdigit(optarg[j - i]))
+					break;
+				ptr++;
+			}
+
+			if (!strncmp(ptr, "KiB", strlen("KiB")))
+				ctx.trigger_mem = 1 << 10;
+			else if (!strncmp(ptr, "MiB", strlen("MiB")))
+				ctx.trigger_mem = 1 << 20;
+			else if (!strncmp(ptr, "GiB", strlen("GiB")))
+				ctx.trigger_mem = 1 << 30;
+			else
+				panic("Syntax error in trigger memory param!\n");
+			*ptr = 0;
+
+			ctx.trigger_mem *= strtoul(optarg, NULL, 0);
+			break;
+		case 'y':
+			ptr = NULL;
+			i = strtoul(optarg, &ptr, 0);
+			if (i <= 0 || (*ptr && strncmp(ptr, "us", strlen("us"))))
+				panic("Syntax error in spin param!\n");
+
+			if (*ptr)
+				ctx.spin_usecs = i;
+			else
+				ctx.spin = i;
+			break;
+		case 'p':
+			ctx.busy_poll = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			if (!strncmp(optarg, "hdr", strlen("hdr"))) {
+				ctx.snaphdr = true;
+				optarg += strlen("hdr");
+				if (*optarg == ',')
+					optarg++;
+			}
+
+			if (*optarg) {
+				ctx.snaplen = strtoul(optarg, NULL, 0);
+				if (ctx.snaplen == 0)
+					panic("Syntax error in snaplen param!\n");
+			}
+			break;
+		case OPT_TELEMETRY:
+			ctx.telemetry = xstrdup(optarg);
+			break;
+		case OPT_MERGE_WINDOW:
+			ctx.merge_window = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_XDP:
+			ctx.xdp = true;
+			break;
+		case OPT_PUBLISH:
+			ctx.publish = xstrdup(optarg);
+			break;
+		case OPT_PUBLISH_SIZE:
+			ptr = optarg;
+			ctx.publish_size = 0;
+
+			for (j = i = strlen(optarg); i > 0; --i) {
+				if (!isdigit(optarg[j - i]))
+					break;
+				ptr++;
+			}
+
+			if (!strncmp(ptr, "KiB", strlen("KiB")))
+				ctx.publish_size = 1 << 10;
+			else if (!strncmp(ptr, "MiB", strlen("MiB")))
+				ctx.publish_size = 1 << 20;
+			else if (!strncmp(ptr, "GiB", strlen("GiB")))
+				ctx.publish_size = 1 << 30;
+			else
+				panic("Syntax error in publish size param!\n");
+			*ptr = 0;
+
+			ctx.publish_size *= strtoul(optarg, NULL, 0);
+			if (ctx.publish_size < PUBLISH_SIZE_MIN)
+				panic("Publish size is at least 1MiB!\n");
+			while (ctx.publish_size & (ctx.publish_size - 1))
+				ctx.publish_size += ctx.publish_size & -ctx.publish_size;
+			break;
+		case OPT_STREAM:
+			ctx.stream = xstrdup(optarg);
+			break;
+		case OPT_COLLECT:
+			ctx.collect = xstrdup(optarg);
+			break;
+		case 'j':
+			if (!strncmp(optarg, "flow:", strlen("flow:"))) {
+				ctx.sample_mode = BPF_SAMPLE_FLOW;
+				optarg += strlen("flow:");
+			}
+
+			if (!strcmp(optarg, "auto")) {
+				ctx.sample_auto = true;
+			} else {
+				ctx.sample_rate = strtoul(optarg, NULL, 0);
+				if (ctx.sample_rate == 0)
+					panic("Syntax error in sample param!\n");
+			}
+			break;
+		case 'a':
+			ctx.time_from = parse_time(optarg);
+			break;
+		case 'z':
+			ctx.time_to = parse_time(optarg);
+			break;
 		case 'T':
 			ctx.magic = (uint32_t) strtoul(optarg, NULL, 0);
 			pcap_check_magic(ctx.magic);
@@ -1186,9 +3539,28 @@ int main(int argc, char **argv)
 			ctx.pcap = PCAP_OPS_SG;
 			ops_touched = 1;
 			break;
+		case 'U':
+			ctx.pcap = PCAP_OPS_URING;
+			ops_touched = 1;
+			break;
+		case 'O':
+			ctx.pcap = PCAP_OPS_DIRECT;
+			ops_touched = 1;
+			break;
+		case OPT_VMSPLICE:
+			ctx.pcap = PCAP_OPS_PIPE;
+			ops_touched = 1;
+			break;
+		case 'Z':
+			ctx.pcap = PCAP_OPS_ZLIB;
+			ops_touched = 1;
+			break;
 		case 'Q':
 			ctx.cpu = -2;
 			break;
+		case 'N':
+			ctx.numa = false;
+			break;
 		case 's':
 			ctx.print_mode = PRINT_NONE;
 			break;
@@ -1281,7 +3653,19 @@ int main(int argc, char **argv)
 			case 'T':
 			case 'u':
 			case 'g':
+			case 'W':
+			case 'w':
+			case 'a':
+			case 'z':
+			case 'K':
 			case 'e':
+			case 'E':
+			case 'Y':
+			case 'C':
+			case 'L':
+			case 'y':
+			case 'p':
+			case 'j':
 				panic("Option -%c requires an argument!\n",
 				      optopt);
 			default:
@@ -1313,9 +3697,26 @@ int main(int argc, char **argv)
 
 	if (!ctx.device_in)
 		ctx.device_in = xstrdup("any");
+	if (strchr(ctx.device_in, ','))
+		merge_devices(&ctx);
+	if (ctx.xdp)
+		xdp_workers(&ctx, workers_touched);
+
+	if (!pcap_ops[ctx.pcap])
+		panic("No %s pcap I/O support compiled in!\n",
+		      pcap_ops_group_to_str[ctx.pcap]);
+
+	/* Workers would interleave their output on the terminal */
+	if (ctx.workers > 1)
+		ctx.print_mode = PRINT_NONE;
+
+	if ((ctx.trigger_filter || ctx.trigger_drops) && !ctx.trigger)
+		panic("Trigger conditions need a --trigger window!\n");
 
 	register_signal(SIGINT, signal_handler);
 	register_signal(SIGHUP, signal_handler);
+	if (ctx.trigger)
+		register_signal(SIGUSR1, signal_handler);
 
 	tprintf_init();
 
@@ -1324,7 +3725,23 @@ int main(int argc, char **argv)
 		set_sched_status(get_default_sched_policy(), get_default_sched_prio());
 	}
 
-	if (ctx.device_in && (device_mtu(ctx.device_in) ||
+	if (ctx.stream) {
+		if (ctx.device_out)
+			panic("Streams go to the collector, not to --out!\n");
+		ctx.device_out = xstrdup(ctx.stream);
+	}
+
+	if (ctx.collect) {
+		if (!ctx.device_out)
+			panic("Collected streams need an --out to go to!\n");
+		if (ctx.workers > 1)
+			panic("Collectors take a thread per agent, not workers!\n");
+		ctx.dump = 1;
+		register_signal_f(SIGALRM, timer_next_dump, SA_SIGINFO);
+		main_loop = collect_pcap;
+		if (!ops_touched)
+			ctx.pcap = PCAP_OPS_SG;
+	} else if (ctx.device_in && (device_mtu(ctx.device_in) ||
 	    !strncmp("any", ctx.device_in, strlen(ctx.device_in)))) {
 		if (!ctx.device_out) {
 			ctx.dump = 0;
@@ -1347,13 +3764,38 @@ int main(int argc, char **argv)
 				ctx.pcap = PCAP_OPS_MM;
 		} else {
 			main_loop = read_pcap;
+			/* Only mmap'ed files can be split up among workers */
 			if (!ops_touched)
-				ctx.pcap = PCAP_OPS_SG;
+				ctx.pcap = ctx.workers > 1 ? PCAP_OPS_MM :
+							     PCAP_OPS_SG;
 		}
 	}
 
 	bug_on(!main_loop);
 
+	if (ctx.merge && main_loop != recv_only_or_dump)
+		panic("Merged devices can only be captured, not forwarded!\n");
+	if (ctx.xdp && main_loop != recv_only_or_dump)
+		panic("XDP can only capture, not forward!\n");
+	if (ctx.publish && main_loop != recv_only_or_dump)
+		panic("Only captured packets can be published!\n");
+	if (ctx.stream && main_loop != recv_only_or_dump)
+		panic("Only captures can be streamed!\n");
+
+	/* The stream compresses its messages, instead of writing gzip */
+	if (ctx.stream) {
+		ctx.stream_zlib = ctx.pcap == PCAP_OPS_ZLIB;
+		ctx.pcap = PCAP_OPS_STREAM;
+	}
+	if (ctx.pcap == PCAP_OPS_PIPE && (main_loop != recv_only_or_dump ||
+	    !ctx.dump || strncmp("-", ctx.device_out, strlen("-"))))
+		panic("Vmsplice is for captures to a pcap on stdout!\n");
+
+	if (main_loop == recv_only_or_dump || main_loop == receive_to_xmit)
+		numa_placement(&ctx, ctx.device_in);
+	else if (main_loop == pcap_to_xmit)
+		numa_placement(&ctx, ctx.device_out);
+
 	if (setsockmem)
 		set_system_socket_memory(vals, array_size(vals));
 	xlockme();
@@ -1370,6 +3812,14 @@ int main(int argc, char **argv)
 	free(ctx.device_out);
 	free(ctx.device_trans);
 	free(ctx.prefix);
+	free(ctx.trigger_filter);
+	free(ctx.telemetry);
+	free(ctx.publish);
+	free(ctx.stream);
+	free(ctx.collect);
+	for (i = 0; i < (int) ctx.merge; ++i)
+		free(ctx.devices[i]);
+	free(ctx.devices);
 
 	return 0;
 }
@@ -29,6 +29,12 @@
 #define PCAP_VERSION_MAJOR			2
 #define PCAP_VERSION_MINOR			4
 #define PCAP_DEFAULT_SNAPSHOT_LEN		65535
+#define PCAP_MAX_SNAPSHOT_LEN			262144
+/* How far seek_pcap has to look to resync on a few records of any size */
+#define PCAP_SEEK_PROBE				(8 * PCAP_MAX_SNAPSHOT_LEN)
+
+/* Sidecar log of sampling rates, one "<sec>.<nsec> <rate>" line per change */
+#define PCAP_SAMPLE_SUFFIX			".smp"
 
 #define LINKTYPE_EN10MB				1   /* Ethernet (10Mb) */
 #define LINKTYPE_IEEE802_11			105 /* IEEE 802.11 wireless */
@@ -108,6 +114,11 @@ enum pcap_ops_groups {
 	PCAP_OPS_RW = 0,
 	PCAP_OPS_SG,
 	PCAP_OPS_MM,
+	PCAP_OPS_URING,
+	PCAP_OPS_DIRECT,
+	PCAP_OPS_ZLIB,
+	PCAP_OPS_PIPE,
+	PCAP_OPS_STREAM,
 };
 
 enum pcap_mode {
@@ -123,13 +134,68 @@ struct pcap_file_ops {
 			      const uint8_t *packet, size_t len);
 	ssize_t (*read_pcap)(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
 			     uint8_t *packet, size_t len);
+	ssize_t (*read_pcap_zc)(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+				uint8_t **packet, uint8_t *bounce, size_t len);
+	off_t (*seek_pcap)(int fd, enum pcap_type type, off_t start, off_t end);
 	void (*prepare_close_pcap)(int fd, enum pcap_mode mode);
+	void (*rotate_pcap)(int fd, int fd_next);
 	void (*fsync_pcap)(int fd);
+	void (*print_stats_pcap)(void);
 };
 
 extern const struct pcap_file_ops pcap_rw_ops;
 extern const struct pcap_file_ops pcap_sg_ops;
 extern const struct pcap_file_ops pcap_mm_ops;
+#ifdef __WITH_IO_URING
+extern const struct pcap_file_ops pcap_uring_ops;
+#endif
+extern const struct pcap_file_ops pcap_dio_ops;
+extern const struct pcap_file_ops pcap_pipe_ops;
+extern const struct pcap_file_ops pcap_stream_ops;
+#ifdef __WITH_ZLIB
+extern const struct pcap_file_ops pcap_zlib_ops;
+#endif
+
+/*
+ * Move dumping from fd over to fd_next, which already got its file
+ * header. What is still buffered for fd is written out, but fd is not
+ * synced and left open, so that the caller can do that out of line.
+ * Backends without rotate_pcap are torn down and set up again.
+ */
+static inline int pcap_rotate(const struct pcap_file_ops *ops, int fd,
+			      int fd_next, bool jumbo)
+{
+	if (ops->rotate_pcap) {
+		ops->rotate_pcap(fd, fd_next);
+		return 0;
+	}
+
+	ops->fsync_pcap(fd);
+
+	if (ops->prepare_close_pcap)
+		ops->prepare_close_pcap(fd, PCAP_MODE_WR);
+	if (ops->prepare_access_pcap)
+		return ops->prepare_access_pcap(fd_next, PCAP_MODE_WR, jumbo);
+
+	return 0;
+}
+
+/*
+ * Read the next record without copying it, if the backend can. *packet
+ * then points into backend memory, is read-only and valid until the
+ * next read; records a backend cannot hand out in one piece end up in
+ * bounce, which is also what backends without read_pcap_zc read into.
+ */
+static inline ssize_t pcap_read_zc(const struct pcap_file_ops *ops, int fd,
+				   pcap_pkthdr_t *phdr, enum pcap_type type,
+				   uint8_t **packet, uint8_t *bounce, size_t len)
+{
+	if (ops->read_pcap_zc)
+		return ops->read_pcap_zc(fd, phdr, type, packet, bounce, len);
+
+	*packet = bounce;
+	return ops->read_pcap(fd, phdr, type, bounce, len);
+}
 
 static inline void pcap_check_magic(uint32_t magic)
 {
@@ -405,6 +471,24 @@ static inline void pcap_pkthdr_to_tpacket_hdr(pcap_pkthdr_t *phdr,
 	}
 }
 
+/*
+ * Sanity check for a record header found at an arbitrary file offset,
+ * which is what resynchronizing in the middle of a pcap relies on.
+ */
+static inline bool pcap_pkthdr_plausible(pcap_pkthdr_t *phdr,
+					 enum pcap_type type)
+{
+	struct tpacket2_hdr thdr;
+	struct sockaddr_ll sll;
+
+	pcap_pkthdr_to_tpacket_hdr(phdr, type, &thdr, &sll);
+
+	return thdr.tp_snaplen > 0 &&
+	       thdr.tp_snaplen <= PCAP_MAX_SNAPSHOT_LEN &&
+	       thdr.tp_len >= thdr.tp_snaplen &&
+	       thdr.tp_nsec < 1000000000;
+}
+
 #define FEATURE_UNKNOWN		(0 << 0)
 #define FEATURE_TIMEVAL_MS	(1 << 0)
 #define FEATURE_TIMEVAL_NS	(1 << 1)
@@ -495,12 +579,28 @@ static const char *pcap_ops_group_to_str[] __maybe_unused = {
 	[PCAP_OPS_RW] = "rw",
 	[PCAP_OPS_SG] = "sg",
 	[PCAP_OPS_MM] = "mm",
+	[PCAP_OPS_URING] = "uring",
+	[PCAP_OPS_DIRECT] = "direct",
+	[PCAP_OPS_ZLIB] = "zlib",
+	[PCAP_OPS_PIPE] = "pipe",
+	[PCAP_OPS_STREAM] = "stream",
 };
 
 static const struct pcap_file_ops const *pcap_ops[] __maybe_unused = {
 	[PCAP_OPS_RW]		=	&pcap_rw_ops,
 	[PCAP_OPS_SG]		=	&pcap_sg_ops,
 	[PCAP_OPS_MM]		=	&pcap_mm_ops,
+#ifdef __WITH_IO_URING
+	[PCAP_OPS_URING]	=	&pcap_uring_ops,
+#endif
+	[PCAP_OPS_DIRECT]	=	&pcap_dio_ops,
+#ifdef __WITH_ZLIB
+	[PCAP_OPS_ZLIB]		=	&pcap_zlib_ops,
+#else
+	[PCAP_OPS_ZLIB]		=	NULL,
+#endif
+	[PCAP_OPS_PIPE]		=	&pcap_pipe_ops,
+	[PCAP_OPS_STREAM]	=	&pcap_stream_ops,
 };
 
 static inline void pcap_prepare_header(struct pcap_filehdr *hdr, uint32_t magic,
@@ -518,9 +618,22 @@ static inline void pcap_prepare_header(struct pcap_filehdr *hdr, uint32_t magic,
 	hdr->linktype = swapped ? ___constant_swab32(linktype) : linktype;
 }
 
-static inline void pcap_validate_header(const struct pcap_filehdr *hdr)
+/* For headers from the network, which must not take us down */
+static inline bool pcap_header_is_valid(const struct pcap_filehdr *hdr)
 {
-	pcap_check_magic(hdr->magic);
+	switch (hdr->magic) {
+	case ORIGINAL_TCPDUMP_MAGIC:
+	case NSEC_TCPDUMP_MAGIC:
+	case KUZNETZOV_TCPDUMP_MAGIC:
+	case BORKMANN_TCPDUMP_MAGIC:
+	case ___constant_swab32(ORIGINAL_TCPDUMP_MAGIC):
+	case ___constant_swab32(NSEC_TCPDUMP_MAGIC):
+	case ___constant_swab32(KUZNETZOV_TCPDUMP_MAGIC):
+	case ___constant_swab32(BORKMANN_TCPDUMP_MAGIC):
+		break;
+	default:
+		return false;
+	}
 
 	switch (hdr->linktype) {
 	case LINKTYPE_EN10MB:
@@ -529,14 +642,24 @@ static inline void pcap_validate_header(const struct pcap_filehdr *hdr)
 	case ___constant_swab32(LINKTYPE_IEEE802_11):
 		break;
 	default:
-		panic("This file has not a valid pcap header\n");
+		return false;
 	}
 
-	if (unlikely(hdr->version_major != PCAP_VERSION_MAJOR) &&
-		     ___constant_swab16(hdr->version_major) != PCAP_VERSION_MAJOR)
-		panic("This file has not a valid pcap header\n");
-	if (unlikely(hdr->version_minor != PCAP_VERSION_MINOR) &&
-		     ___constant_swab16(hdr->version_minor) != PCAP_VERSION_MINOR)
+	if (hdr->version_major != PCAP_VERSION_MAJOR &&
+	    ___constant_swab16(hdr->version_major) != PCAP_VERSION_MAJOR)
+		return false;
+	if (hdr->version_minor != PCAP_VERSION_MINOR &&
+	    ___constant_swab16(hdr->version_minor) != PCAP_VERSION_MINOR)
+		return false;
+
+	return true;
+}
+
+static inline void pcap_validate_header(const struct pcap_filehdr *hdr)
+{
+	pcap_check_magic(hdr->magic);
+
+	if (unlikely(!pcap_header_is_valid(hdr)))
 		panic("This file has not a valid pcap header\n");
 }
 
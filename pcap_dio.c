@@ -0,0 +1,314 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "pcap.h"
+#include "built_in.h"
+#include "xmalloc.h"
+#include "xutils.h"
+#include "die.h"
+
+/*
+ * Packets are staged in page-aligned buffers, which always hand full
+ * buffers at aligned file offsets to a flush thread that writes them
+ * with O_DIRECT, so dumps do not go through the page cache. Only the
+ * tail is written padded at fsync/close time and then truncated back
+ * to the real file length.
+ */
+
+#define DIO_NR_BUFS		2
+#define DIO_BUF_SIZE		(4 << 20)
+#define DIO_ALIGN		4096
+#define DIO_PREALLOC_SIZE	(64 << 20)
+
+struct dio_buf {
+	uint8_t *data;
+	off_t off;
+	bool busy;
+};
+
+struct dio_state {
+	int fd;
+	struct dio_buf bufs[DIO_NR_BUFS];
+	unsigned int curr, next_flush;
+	size_t fill;
+	off_t off, prealloc;
+	bool stop, falloc;
+	pthread_t trid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static __thread struct dio_state dio;
+
+static void dio_preallocate(struct dio_state *d, off_t end)
+{
+	int ret;
+
+	while (d->falloc && end > d->prealloc) {
+		/* Keep the size, so a reader never runs into zeroes */
+		ret = fallocate(d->fd, FALLOC_FL_KEEP_SIZE, d->prealloc,
+				DIO_PREALLOC_SIZE);
+		if (ret < 0) {
+			d->falloc = false;
+			break;
+		}
+
+		d->prealloc += DIO_PREALLOC_SIZE;
+	}
+}
+
+static void dio_pwrite(struct dio_state *d, struct dio_buf *b, size_t len)
+{
+	ssize_t ret;
+
+	dio_preallocate(d, b->off + len);
+
+	do {
+		ret = pwrite(d->fd, b->data, len, b->off);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret != len)
+		panic("O_DIRECT write error: %s!\n",
+		      ret < 0 ? strerror(errno) : "short write");
+}
+
+static void *dio_flush_thread(void *self)
+{
+	bool work;
+	struct dio_state *d = self;
+	struct dio_buf *b;
+
+	while (1) {
+		pthread_mutex_lock(&d->lock);
+		b = &d->bufs[d->next_flush];
+		while (!b->busy && !d->stop)
+			pthread_cond_wait(&d->cond, &d->lock);
+		work = b->busy;
+		pthread_mutex_unlock(&d->lock);
+
+		if (!work)
+			break;
+
+		dio_pwrite(d, b, DIO_BUF_SIZE);
+
+		pthread_mutex_lock(&d->lock);
+		b->busy = false;
+		d->next_flush = (d->next_flush + 1) % DIO_NR_BUFS;
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	return NULL;
+}
+
+static void dio_submit_curr(void)
+{
+	struct dio_buf *b = &dio.bufs[dio.curr];
+
+	pthread_mutex_lock(&dio.lock);
+
+	b->off = dio.off;
+	b->busy = true;
+	pthread_cond_broadcast(&dio.cond);
+
+	dio.curr = (dio.curr + 1) % DIO_NR_BUFS;
+	while (dio.bufs[dio.curr].busy)
+		pthread_cond_wait(&dio.cond, &dio.lock);
+
+	pthread_mutex_unlock(&dio.lock);
+
+	dio.off += DIO_BUF_SIZE;
+	dio.fill = 0;
+}
+
+static void dio_wait_idle(void)
+{
+	int i;
+
+	pthread_mutex_lock(&dio.lock);
+	for (i = 0; i < DIO_NR_BUFS; ++i) {
+		while (dio.bufs[i].busy)
+			pthread_cond_wait(&dio.cond, &dio.lock);
+	}
+	pthread_mutex_unlock(&dio.lock);
+}
+
+static void dio_copy(const uint8_t *src, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		n = min(len, (size_t) DIO_BUF_SIZE - dio.fill);
+
+		fmemcpy(dio.bufs[dio.curr].data + dio.fill, src, n);
+		dio.fill += n;
+		src += n;
+		len -= n;
+
+		if (dio.fill == DIO_BUF_SIZE)
+			dio_submit_curr();
+	}
+}
+
+static void dio_write_tail(void)
+{
+	int ret;
+	size_t len = round_up(dio.fill, DIO_ALIGN);
+	struct dio_buf *b = &dio.bufs[dio.curr];
+
+	dio_wait_idle();
+
+	if (dio.fill > 0) {
+		fmemset(b->data + dio.fill, 0, len - dio.fill);
+		b->off = dio.off;
+
+		/* The buffer stays current and is rewritten once full */
+		dio_pwrite(&dio, b, len);
+	}
+
+	ret = ftruncate(dio.fd, dio.off + dio.fill);
+	if (ret < 0)
+		panic("Cannot truncate pcap tail: %s!\n", strerror(errno));
+
+	/* Truncating let go of the blocks reserved past the end, too */
+	dio.prealloc = (dio.off + dio.fill) & ~((off_t) DIO_ALIGN - 1);
+}
+
+static ssize_t pcap_dio_write(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+			      const uint8_t *packet, size_t len)
+{
+	ssize_t hdrsize = pcap_get_hdr_length(phdr, type);
+
+	dio_copy((uint8_t *) &phdr->raw, hdrsize);
+	dio_copy(packet, len);
+
+	return hdrsize + len;
+}
+
+static ssize_t pcap_dio_read(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+			     uint8_t *packet, size_t len)
+{
+	/* Only dumping bypasses the page cache, reads are plain read(2) */
+	return pcap_rw_ops.read_pcap(fd, phdr, type, packet, len);
+}
+
+static void pcap_dio_fsync(int fd)
+{
+	dio_write_tail();
+	fdatasync(fd);
+}
+
+static int dio_bind(int fd)
+{
+	int ret, flags;
+	off_t pos;
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0)
+		return -EIO;
+
+	dio.fd = fd;
+	dio.falloc = true;
+
+	/* Pull in what was written before, i.e. the pcap file header */
+	dio.off = pos & ~((off_t) DIO_ALIGN - 1);
+	dio.fill = pos - dio.off;
+	if (dio.fill > 0) {
+		ret = pread(fd, dio.bufs[dio.curr].data, dio.fill, dio.off);
+		if (ret != dio.fill)
+			return -EIO;
+	}
+
+	dio.prealloc = dio.off;
+	dio_preallocate(&dio, dio.off + DIO_PREALLOC_SIZE);
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0)
+		panic("Cannot enable O_DIRECT on pcap: %s!\n", strerror(errno));
+
+	return 0;
+}
+
+/* Buffers and flush thread stay, the tail goes out unsynced */
+static void pcap_dio_rotate(int fd, int fd_next)
+{
+	dio_write_tail();
+
+	if (dio_bind(fd_next))
+		panic("Cannot switch O_DIRECT pcap file!\n");
+}
+
+static int pcap_dio_prepare_access(int fd, enum pcap_mode mode, bool jumbo)
+{
+	int i, ret;
+
+	set_ioprio_rt();
+
+	if (mode == PCAP_MODE_RD)
+		return 0;
+
+	fmemset(&dio, 0, sizeof(dio));
+
+	for (i = 0; i < DIO_NR_BUFS; ++i)
+		dio.bufs[i].data = xzmalloc_aligned(DIO_BUF_SIZE, DIO_ALIGN);
+
+	ret = dio_bind(fd);
+	if (ret)
+		return ret;
+
+	pthread_mutex_init(&dio.lock, NULL);
+	pthread_cond_init(&dio.cond, NULL);
+
+	ret = pthread_create(&dio.trid, NULL, dio_flush_thread, &dio);
+	if (ret)
+		panic("Cannot create O_DIRECT flush thread!\n");
+
+	return 0;
+}
+
+static void pcap_dio_prepare_close(int fd, enum pcap_mode mode)
+{
+	int i;
+
+	if (mode == PCAP_MODE_RD)
+		return;
+
+	dio_write_tail();
+
+	pthread_mutex_lock(&dio.lock);
+	dio.stop = true;
+	pthread_cond_broadcast(&dio.cond);
+	pthread_mutex_unlock(&dio.lock);
+
+	pthread_join(dio.trid, NULL);
+
+	pthread_cond_destroy(&dio.cond);
+	pthread_mutex_destroy(&dio.lock);
+
+	for (i = 0; i < DIO_NR_BUFS; ++i)
+		xfree(dio.bufs[i].data);
+}
+
+const struct pcap_file_ops pcap_dio_ops = {
+	.pull_fhdr_pcap = pcap_generic_pull_fhdr,
+	.push_fhdr_pcap = pcap_generic_push_fhdr,
+	.prepare_access_pcap = pcap_dio_prepare_access,
+	.prepare_close_pcap = pcap_dio_prepare_close,
+	.read_pcap = pcap_dio_read,
+	.write_pcap = pcap_dio_write,
+	.rotate_pcap = pcap_dio_rotate,
+	.fsync_pcap = pcap_dio_fsync,
+};
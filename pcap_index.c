@@ -0,0 +1,156 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "pcap_index.h"
+#include "xio.h"
+#include "xutils.h"
+#include "die.h"
+
+static void pcap_index_name(const char *pcap, char *name, size_t len)
+{
+	slprintf(name, len, "%s%s", pcap, PCAP_INDEX_SUFFIX);
+}
+
+void pcap_index_open(struct pcap_index *idx, const char *pcap, off_t off)
+{
+	char name[512];
+	struct pcap_index_hdr hdr;
+
+	fmemset(idx, 0, sizeof(*idx));
+
+	pcap_index_name(pcap, name, sizeof(name));
+
+	idx->fd = open_or_die_m(name, O_WRONLY | O_CREAT | O_TRUNC |
+				O_LARGEFILE, DEFFILEMODE);
+	idx->bucket = PCAP_INDEX_BUCKET;
+	idx->off = off;
+
+	fmemset(&hdr, 0, sizeof(hdr));
+	hdr.magic = PCAP_INDEX_MAGIC;
+	hdr.version_major = PCAP_INDEX_VERSION;
+	hdr.bucket = idx->bucket;
+
+	write_or_die(idx->fd, &hdr, sizeof(hdr));
+}
+
+void pcap_index_flush(struct pcap_index *idx)
+{
+	if (idx->fill == 0)
+		return;
+
+	write_or_die(idx->fd, idx->buf, idx->fill * sizeof(idx->buf[0]));
+	idx->fill = 0;
+}
+
+void pcap_index_close(struct pcap_index *idx)
+{
+	uint64_t size;
+
+	if (!pcap_index_active(idx))
+		return;
+
+	pcap_index_flush(idx);
+
+	/* All records are in, so the index now goes with a pcap this large */
+	size = idx->off;
+	if (pwrite(idx->fd, &size, sizeof(size),
+		   offsetof(struct pcap_index_hdr, pcap_size)) != sizeof(size))
+		panic("Cannot write pcap index header!\n");
+
+	close(idx->fd);
+	fmemset(idx, 0, sizeof(*idx));
+}
+
+/* Dumping without an index must not leave the one of a former pcap */
+void pcap_index_remove(const char *pcap)
+{
+	char name[512];
+
+	pcap_index_name(pcap, name, sizeof(name));
+
+	unlink(name);
+}
+
+/*
+ * Finds the offset of the bucket that sec falls into, i.e. the last
+ * entry not younger than sec. Returns -ENOENT if there is no usable
+ * index, or it does not belong to the pcap in pcap_fd, so that the
+ * caller has to search the pcap itself.
+ */
+int pcap_index_lookup(const char *pcap, int pcap_fd, uint32_t sec, off_t *off)
+{
+	int fd, ret = -ENOENT;
+	char name[512];
+	size_t num, lo, hi, mid;
+	uint32_t rec_sec;
+	struct stat sb, psb;
+	struct pcap_index_hdr *hdr;
+	struct pcap_index_entry *ent;
+	void *map;
+
+	if (fstat(pcap_fd, &psb) < 0)
+		return -ENOENT;
+
+	pcap_index_name(pcap, name, sizeof(name));
+
+	fd = open(name, O_RDONLY | O_LARGEFILE);
+	if (fd < 0)
+		return -ENOENT;
+
+	if (fstat(fd, &sb) < 0 || sb.st_size < sizeof(*hdr))
+		goto out;
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto out;
+
+	hdr = map;
+	ent = map + sizeof(*hdr);
+	num = (sb.st_size - sizeof(*hdr)) / sizeof(*ent);
+
+	if (hdr->magic != PCAP_INDEX_MAGIC ||
+	    hdr->version_major != PCAP_INDEX_VERSION || num == 0 ||
+	    hdr->pcap_size != (uint64_t) psb.st_size)
+		goto out_unmap;
+
+	lo = 0;
+	hi = num;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ent[mid].tv_sec <= sec)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	ent += lo > 0 ? lo - 1 : 0;
+
+	/* A pcap rewritten to the same size still has other records there */
+	if (ent->offset >= (uint64_t) psb.st_size ||
+	    pread(pcap_fd, &rec_sec, sizeof(rec_sec),
+		  ent->offset) != sizeof(rec_sec) ||
+	    (rec_sec != ent->tv_sec &&
+	     rec_sec != ___constant_swab32(ent->tv_sec)))
+		goto out_unmap;
+
+	*off = ent->offset;
+	ret = 0;
+
+out_unmap:
+	munmap(map, sb.st_size);
+out:
+	close(fd);
+	return ret;
+}
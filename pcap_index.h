@@ -0,0 +1,89 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef PCAP_INDEX_H
+#define PCAP_INDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "built_in.h"
+
+/*
+ * A pcap index is a sidecar file <pcap>.idx that holds one entry per
+ * time bucket: the timestamp and file offset of the first record that
+ * fell into it. Entries only ever move forward in time, so a reader can
+ * binary search them. Fields are in host byte order. The header carries
+ * the size of the pcap once the index is complete, an index is only
+ * used for a pcap of that size.
+ */
+
+#define PCAP_INDEX_MAGIC	0x4e534958	/* "NSIX" */
+#define PCAP_INDEX_VERSION	2
+#define PCAP_INDEX_SUFFIX	".idx"
+#define PCAP_INDEX_BUCKET	1		/* seconds */
+#define PCAP_INDEX_BUF		256
+
+struct pcap_index_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	uint32_t bucket;
+	uint32_t reserved;
+	uint64_t pcap_size;
+};
+
+struct pcap_index_entry {
+	uint64_t offset;
+	uint32_t tv_sec;
+	uint32_t tv_nsec;
+};
+
+struct pcap_index {
+	int fd;
+	bool started;
+	uint32_t bucket, last;
+	off_t off;
+	unsigned int fill;
+	struct pcap_index_entry buf[PCAP_INDEX_BUF];
+};
+
+extern void pcap_index_open(struct pcap_index *idx, const char *pcap, off_t off);
+extern void pcap_index_flush(struct pcap_index *idx);
+extern void pcap_index_close(struct pcap_index *idx);
+extern void pcap_index_remove(const char *pcap);
+extern int pcap_index_lookup(const char *pcap, int pcap_fd, uint32_t sec,
+			     off_t *off);
+
+/* A zeroed index is inactive, records then are not tracked */
+static inline bool pcap_index_active(struct pcap_index *idx)
+{
+	return idx->bucket != 0;
+}
+
+/* Called for every record in file order, len is its on-disk size */
+static inline void pcap_index_add(struct pcap_index *idx, uint32_t sec,
+				  uint32_t nsec, size_t len)
+{
+	uint32_t bucket = sec / idx->bucket;
+
+	if (unlikely(!idx->started || bucket > idx->last)) {
+		if (idx->fill == PCAP_INDEX_BUF)
+			pcap_index_flush(idx);
+
+		idx->buf[idx->fill].offset = idx->off;
+		idx->buf[idx->fill].tv_sec = sec;
+		idx->buf[idx->fill].tv_nsec = nsec;
+		idx->fill++;
+
+		idx->last = bucket;
+		idx->started = true;
+	}
+
+	idx->off += len;
+}
+
+#endif /* PCAP_INDEX_H */
@@ -7,6 +7,7 @@
 
 #define _GNU_SOURCE 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -19,26 +20,41 @@
 #include "xutils.h"
 #include "built_in.h"
 
-static size_t map_size = 0;
-static char *ptr_va_start, *ptr_va_curr;
+static __thread size_t map_size = 0;
+static __thread char *ptr_va_start, *ptr_va_curr;
+static __thread off_t map_off = 0, map_alloc = 0;
+static __thread char *ptr_va_end;
 
-static void __pcap_mmap_write_need_remap(int fd)
+/*
+ * Dumps are written through a fixed-size window that slides along the
+ * file, so address space and page cache use stay bounded however large
+ * the file grows. Blocks are reserved ahead of the window, so stores
+ * never fault on a hole or run into ENOSPC as SIGBUS.
+ */
+
+static void __pcap_mmap_write_alloc(int fd, off_t end)
 {
 	int ret;
-	off_t pos, map_size_old = map_size;
-	off_t offset = ptr_va_curr - ptr_va_start;
 
-	map_size = PAGE_ALIGN(map_size_old * 10 / 8);
+	if (end <= map_alloc)
+		return;
 
-	pos = lseek(fd, map_size, SEEK_SET);
-	if (pos < 0)
-		panic("Cannot lseek pcap file!\n");
+	ret = fallocate(fd, 0, map_alloc, end - map_alloc);
+	if (ret < 0)
+		ret = ftruncate(fd, end);
+	if (ret < 0)
+		panic("Cannot extend pcap file!\n");
 
-	ret = write_or_die(fd, "", 1);
-	if (ret != 1)
-		panic("Cannot write file!\n");
+	map_alloc = end;
+}
 
-	ptr_va_start = mremap(ptr_va_start, map_size_old, map_size, MREMAP_MAYMOVE);
+static void __pcap_mmap_write_map(int fd)
+{
+	int ret;
+
+	__pcap_mmap_write_alloc(fd, map_off + 2 * map_size);
+
+	ptr_va_start = mmap(0, map_size, PROT_WRITE, MAP_SHARED, fd, map_off);
 	if (ptr_va_start == MAP_FAILED)
 		panic("mmap of file failed!");
 
@@ -46,7 +62,56 @@ static void __pcap_mmap_write_need_remap(int fd)
 	if (ret < 0)
 		panic("Failed to give kernel mmap advise!\n");
 
-	ptr_va_curr = ptr_va_start + offset;
+	ptr_va_curr = ptr_va_start;
+}
+
+static void __pcap_mmap_write_slide(int fd)
+{
+	int ret;
+	off_t prev = map_off - map_size;
+
+	/*
+	 * No MADV_DONTNEED, it fails on memory locked by xlockme(). The
+	 * unmap drops our view, and the page cache is let go of below.
+	 */
+	if (ptr_va_start) {
+		ret = munmap(ptr_va_start, map_size);
+		if (ret < 0)
+			panic("Cannot unmap the pcap file!\n");
+
+		ptr_va_start = NULL;
+	}
+
+	/* Start writeback of the completed window ... */
+	sync_file_range(fd, map_off, map_size, SYNC_FILE_RANGE_WRITE);
+
+	/* ... and drop the one before, which has long been written by now */
+	if (prev >= 0) {
+		sync_file_range(fd, prev, map_size, SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(fd, prev, map_size, POSIX_FADV_DONTNEED);
+	}
+
+	map_off += map_size;
+
+	__pcap_mmap_write_map(fd);
+}
+
+static inline void __pcap_mmap_write_copy(int fd, const void *src, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		if (unlikely(ptr_va_curr == ptr_va_start + map_size))
+			__pcap_mmap_write_slide(fd);
+
+		n = min(len, (size_t) (ptr_va_start + map_size - ptr_va_curr));
+
+		fmemcpy(ptr_va_curr, src, n);
+		ptr_va_curr += n;
+		src += n;
+		len -= n;
+	}
 }
 
 static ssize_t pcap_mm_write(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
@@ -54,13 +119,8 @@ static ssize_t pcap_mm_write(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
 {
 	size_t hdrsize = pcap_get_hdr_length(phdr, type);
 
-	if ((off_t) (ptr_va_curr - ptr_va_start) + hdrsize + len > map_size)
-		__pcap_mmap_write_need_remap(fd);
-
-	fmemcpy(ptr_va_curr, &phdr->raw, hdrsize);
-	ptr_va_curr += hdrsize;
-	fmemcpy(ptr_va_curr, packet, len);
-	ptr_va_curr += len;
+	__pcap_mmap_write_copy(fd, &phdr->raw, hdrsize);
+	__pcap_mmap_write_copy(fd, packet, len);
 
 	return hdrsize + len;
 }
@@ -70,6 +130,8 @@ static ssize_t pcap_mm_read(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
 {
 	size_t hdrsize = pcap_get_hdr_length(phdr, type), hdrlen;
 
+	if (unlikely(ptr_va_curr >= ptr_va_end))
+		return -EIO;
 	if (unlikely((off_t) (ptr_va_curr + hdrsize - ptr_va_start) > map_size))
 		return -EIO;
 
@@ -88,6 +150,120 @@ static ssize_t pcap_mm_read(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
 	return hdrsize + hdrlen;
 }
 
+static ssize_t pcap_mm_read_zc(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+			       uint8_t **packet, uint8_t *bounce, size_t len)
+{
+	size_t hdrsize = pcap_get_hdr_length(phdr, type), hdrlen;
+
+	if (unlikely(ptr_va_curr >= ptr_va_end))
+		return -EIO;
+	if (unlikely((off_t) (ptr_va_curr + hdrsize - ptr_va_start) > map_size))
+		return -EIO;
+
+	fmemcpy(&phdr->raw, ptr_va_curr, hdrsize);
+	ptr_va_curr += hdrsize;
+	hdrlen = pcap_get_length(phdr, type);
+
+	if (unlikely((off_t) (ptr_va_curr + hdrlen - ptr_va_start) > map_size))
+		return -EIO;
+	if (unlikely(hdrlen == 0))
+		return -EINVAL;
+
+	/* Straight out of the file mapping, no bounce needed */
+	*packet = (uint8_t *) ptr_va_curr;
+	ptr_va_curr += hdrlen;
+
+	return hdrsize + hdrlen;
+}
+
+/*
+ * A candidate offset is taken as a record boundary if a chain of
+ * plausible headers with timestamps close to each other starts there
+ * and either ends exactly at the end of the file or runs out of the
+ * mapping. A false match thus needs several consecutive bogus headers.
+ */
+#define RESYNC_RECORDS		8
+#define RESYNC_MAX_SKEW		3600
+
+static bool __pcap_mm_resync_ok(char *pos, enum pcap_type type, bool file_end)
+{
+	int i;
+	pcap_pkthdr_t phdr;
+	struct tpacket2_hdr thdr;
+	struct sockaddr_ll sll;
+	size_t hdrsize = pcap_get_hdr_length(&phdr, type);
+	char *map_end = ptr_va_start + map_size;
+	uint32_t first = 0;
+
+	for (i = 0; i < RESYNC_RECORDS; ++i) {
+		if (pos == map_end && file_end)
+			return i > 0;
+		if (pos + hdrsize > map_end)
+			return i > 0 && !file_end;
+
+		fmemcpy(&phdr.raw, pos, hdrsize);
+		if (!pcap_pkthdr_plausible(&phdr, type))
+			return false;
+
+		pcap_pkthdr_to_tpacket_hdr(&phdr, type, &thdr, &sll);
+		if (i == 0)
+			first = thdr.tp_sec;
+		else if (abs((int32_t) (thdr.tp_sec - first)) > RESYNC_MAX_SKEW)
+			return false;
+
+		pos += hdrsize + thdr.tp_snaplen;
+		if (pos > map_end && file_end)
+			return false;
+	}
+
+	return true;
+}
+
+static off_t pcap_mm_seek(int fd, enum pcap_type type, off_t start, off_t end)
+{
+	int ret;
+	struct stat sb;
+	off_t map_end;
+	char *pos;
+
+	ret = fstat(fd, &sb);
+	if (ret < 0)
+		panic("Cannot fstat pcap file!\n");
+
+	if (ptr_va_start)
+		munmap(ptr_va_start, map_size);
+
+	start = max(start, (off_t) sizeof(struct pcap_filehdr));
+	end = min(end, sb.st_size);
+	if (start >= end) {
+		ptr_va_start = ptr_va_curr = ptr_va_end = NULL;
+		return end;
+	}
+
+	/* Leave room for the last record starting in range to end behind it */
+	map_off = start & ~((off_t) PAGE_SIZE - 1);
+	map_end = min(end + PCAP_MAX_SNAPSHOT_LEN + (off_t) PAGE_SIZE, sb.st_size);
+	map_size = map_end - map_off;
+
+	ptr_va_start = mmap(0, map_size, PROT_READ, MAP_SHARED, fd, map_off);
+	if (ptr_va_start == MAP_FAILED)
+		panic("mmap of file failed!");
+	ret = madvise(ptr_va_start, map_size, MADV_SEQUENTIAL);
+	if (ret < 0)
+		panic("Failed to give kernel mmap advise!\n");
+
+	ptr_va_end = ptr_va_start + (end - map_off);
+
+	for (pos = ptr_va_start + (start - map_off); pos < ptr_va_end; pos++) {
+		if (__pcap_mm_resync_ok(pos, type, map_end == sb.st_size))
+			break;
+	}
+
+	ptr_va_curr = pos;
+
+	return map_off + (off_t) (pos - ptr_va_start);
+}
+
 static inline off_t ____get_map_size(bool jumbo)
 {
 	int allocsz = jumbo ? 16 : 3;
@@ -98,10 +274,10 @@ static inline off_t ____get_map_size(bool jumbo)
 static void __pcap_mm_prepare_access_wr(int fd, bool jumbo)
 {
 	int ret;
-	off_t pos;
 	struct stat sb;
 
 	map_size = ____get_map_size(jumbo);
+	map_off = map_alloc = 0;
 
 	ret = fstat(fd, &sb);
 	if (ret < 0)
@@ -109,20 +285,7 @@ static void __pcap_mm_prepare_access_wr(int fd, bool jumbo)
 	if (!S_ISREG (sb.st_mode))
 		panic("pcap dump file is not a regular file!\n");
 
-	pos = lseek(fd, map_size, SEEK_SET);
-	if (pos < 0)
-		panic("Cannot lseek pcap file!\n");
-
-	ret = write_or_die(fd, "", 1);
-	if (ret != 1)
-		panic("Cannot write file!\n");
-
-	ptr_va_start = mmap(0, map_size, PROT_WRITE, MAP_SHARED, fd, 0);
-	if (ptr_va_start == MAP_FAILED)
-		panic("mmap of file failed!");
-	ret = madvise(ptr_va_start, map_size, MADV_SEQUENTIAL);
-	if (ret < 0)
-		panic("Failed to give kernel mmap advise!\n");
+	__pcap_mmap_write_map(fd);
 
 	ptr_va_curr = ptr_va_start + sizeof(struct pcap_filehdr);
 }
@@ -138,7 +301,12 @@ static void __pcap_mm_prepare_access_rd(int fd)
 	if (!S_ISREG (sb.st_mode))
 		panic("pcap dump file is not a regular file!\n");
 
+	/* A range a seek left behind, the whole file is mapped from here */
+	if (ptr_va_start)
+		munmap(ptr_va_start, map_size);
+
 	map_size = sb.st_size;
+	map_off = 0;
 	ptr_va_start = mmap(0, map_size, PROT_READ, MAP_SHARED | MAP_LOCKED, fd, 0);
 	if (ptr_va_start == MAP_FAILED)
 		panic("mmap of file failed!");
@@ -147,6 +315,7 @@ static void __pcap_mm_prepare_access_rd(int fd)
 		panic("Failed to give kernel mmap advise!\n");
 
 	ptr_va_curr = ptr_va_start + sizeof(struct pcap_filehdr);
+	ptr_va_end = ptr_va_start + map_size;
 }
 
 static int pcap_mm_prepare_access(int fd, enum pcap_mode mode, bool jumbo)
@@ -169,22 +338,41 @@ static int pcap_mm_prepare_access(int fd, enum pcap_mode mode, bool jumbo)
 
 static void pcap_mm_fsync(int fd)
 {
-	msync(ptr_va_start, (off_t) (ptr_va_curr - ptr_va_start), MS_ASYNC);
+	if (ptr_va_start)
+		msync(ptr_va_start, (off_t) (ptr_va_curr - ptr_va_start),
+		      MS_ASYNC);
 }
 
 static void pcap_mm_prepare_close(int fd, enum pcap_mode mode)
 {
 	int ret;
 
-	ret = munmap(ptr_va_start, map_size);
-	if (ret < 0)
-		panic("Cannot unmap the pcap file!\n");
+	/* Nothing is mapped after seeking to an empty range */
+	if (!ptr_va_start)
+		return;
 
 	if (mode == PCAP_MODE_WR) {
-		ret = ftruncate(fd, (off_t) (ptr_va_curr - ptr_va_start));
+		ret = ftruncate(fd, map_off + (off_t) (ptr_va_curr - ptr_va_start));
 		if (ret)
 			panic("Cannot truncate the pcap file!\n");
 	}
+
+	ret = munmap(ptr_va_start, map_size);
+	if (ret < 0)
+		panic("Cannot unmap the pcap file!\n");
+
+	ptr_va_start = NULL;
+}
+
+/* The window moves over to the new file, sized as before */
+static void pcap_mm_rotate(int fd, int fd_next)
+{
+	pcap_mm_prepare_close(fd, PCAP_MODE_WR);
+
+	map_off = map_alloc = 0;
+	__pcap_mmap_write_map(fd_next);
+
+	ptr_va_curr = ptr_va_start + sizeof(struct pcap_filehdr);
 }
 
 const struct pcap_file_ops pcap_mm_ops = {
@@ -193,6 +381,9 @@ const struct pcap_file_ops pcap_mm_ops = {
 	.prepare_access_pcap = pcap_mm_prepare_access,
 	.prepare_close_pcap = pcap_mm_prepare_close,
 	.read_pcap = pcap_mm_read,
+	.read_pcap_zc = pcap_mm_read_zc,
+	.seek_pcap = pcap_mm_seek,
 	.write_pcap = pcap_mm_write,
+	.rotate_pcap = pcap_mm_rotate,
 	.fsync_pcap = pcap_mm_fsync,
 };
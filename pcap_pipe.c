@@ -0,0 +1,157 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+
+#include "pcap.h"
+#include "built_in.h"
+#include "xutils.h"
+#include "die.h"
+
+/*
+ * Records are staged in page-aligned memory that is vmsplice()d into the
+ * pipe batch by batch, so the pipe references our pages instead of taking
+ * a copy of them. Staging memory is only written again once more than a
+ * pipe full of data went in after it, so the reader must have taken it off
+ * by then. Readers that splice() the data on instead of reading it hold on
+ * to our pages for longer and may see them change.
+ */
+
+#define PIPE_SIZE		(1 << 20)
+#define PIPE_BATCH_MIN		(64 << 10)
+/* Largest record, a jumbo frame plus the largest record header */
+#define PIPE_REC_MAX		((PAGE_SIZE * 16) + 64)
+
+struct pipe_state {
+	uint8_t *buf;
+	size_t len, batch;
+	/* Records are staged up to head, and spliced up to sent */
+	size_t head, sent;
+};
+
+static __thread struct pipe_state ps;
+
+static void pipe_splice(int fd)
+{
+	ssize_t ret;
+	struct iovec iov;
+
+	while (ps.sent < ps.head) {
+		iov.iov_base = ps.buf + ps.sent;
+		iov.iov_len = ps.head - ps.sent;
+
+		ret = vmsplice(fd, &iov, 1, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			panic("vmsplice I/O error: %s!\n", strerror(errno));
+		}
+
+		ps.sent += ret;
+	}
+}
+
+/*
+ * Staging memory holds twice the pipe, plus slack for the batch that is
+ * being filled. Readers can grow the pipe, which is checked on each wrap,
+ * when all of the old memory has gone into the pipe and can be let go.
+ */
+static int pipe_fit(int fd)
+{
+	int size = fcntl(fd, F_GETPIPE_SZ);
+	size_t batch, len;
+
+	if (size < 0)
+		return -EINVAL;
+
+	batch = max((size_t) size / 4, (size_t) PIPE_BATCH_MIN);
+	len = round_up(2 * size + batch + 4 * PIPE_REC_MAX, PAGE_SIZE);
+	if (ps.buf && len <= ps.len)
+		return 0;
+
+	if (ps.buf)
+		munmap(ps.buf, ps.len);
+
+	ps.buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ps.buf == MAP_FAILED) {
+		ps.buf = NULL;
+		return -ENOMEM;
+	}
+
+	ps.len = len;
+	ps.batch = batch;
+
+	return 0;
+}
+
+static ssize_t pcap_pipe_write(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+			       const uint8_t *packet, size_t len)
+{
+	size_t hdrsize = pcap_get_hdr_length(phdr, type);
+
+	if (unlikely(ps.head + hdrsize + len > ps.len)) {
+		pipe_splice(fd);
+		if (pipe_fit(fd))
+			panic("Cannot grow pipe staging memory!\n");
+		ps.head = ps.sent = 0;
+	}
+
+	fmemcpy(ps.buf + ps.head, &phdr->raw, hdrsize);
+	fmemcpy(ps.buf + ps.head + hdrsize, packet, len);
+	ps.head += hdrsize + len;
+
+	if (ps.head - ps.sent >= ps.batch)
+		pipe_splice(fd);
+
+	return hdrsize + len;
+}
+
+static void pcap_pipe_rotate(int fd, int fd_next)
+{
+	pipe_splice(fd);
+}
+
+static void pcap_pipe_fsync(int fd)
+{
+	pipe_splice(fd);
+}
+
+static int pcap_pipe_prepare_access(int fd, enum pcap_mode mode, bool jumbo)
+{
+	bug_on(mode != PCAP_MODE_WR);
+
+	/* The pipe may stay smaller than asked for, which is fine */
+	fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+
+	ps.head = ps.sent = 0;
+
+	return pipe_fit(fd);
+}
+
+static void pcap_pipe_prepare_close(int fd, enum pcap_mode mode)
+{
+	pipe_splice(fd);
+
+	munmap(ps.buf, ps.len);
+	ps.buf = NULL;
+}
+
+const struct pcap_file_ops pcap_pipe_ops = {
+	.push_fhdr_pcap = pcap_generic_push_fhdr,
+	.prepare_access_pcap = pcap_pipe_prepare_access,
+	.prepare_close_pcap = pcap_pipe_prepare_close,
+	.write_pcap = pcap_pipe_write,
+	.rotate_pcap = pcap_pipe_rotate,
+	.fsync_pcap = pcap_pipe_fsync,
+};
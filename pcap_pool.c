@@ -0,0 +1,251 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "pcap_pool.h"
+#include "pcap.h"
+#include "pcap_index.h"
+#include "built_in.h"
+#include "xmalloc.h"
+#include "xio.h"
+#include "xutils.h"
+#include "die.h"
+
+static void pcap_pool_push_done(struct pcap_pool *pool, char *name)
+{
+	unsigned int size = pool->keep + 1;
+
+	/* Forget about the oldest one if it could not be reused yet */
+	if (pool->done_nr == size) {
+		xfree(pool->done_names[pool->done_head]);
+		pool->done_head = (pool->done_head + 1) % size;
+		pool->done_nr--;
+	}
+
+	pool->done_names[(pool->done_head + pool->done_nr) % size] = name;
+	pool->done_nr++;
+}
+
+static char *pcap_pool_pop_done(struct pcap_pool *pool)
+{
+	char *name;
+
+	if (pool->keep == 0 || pool->done_nr <= pool->keep)
+		return NULL;
+
+	name = pool->done_names[pool->done_head];
+	pool->done_head = (pool->done_head + 1) % (pool->keep + 1);
+	pool->done_nr--;
+
+	return name;
+}
+
+static int pcap_pool_make_spare(struct pcap_pool *pool, char *name,
+				off_t prealloc)
+{
+	int fd = -1;
+	char idx[512];
+
+	/* A recycled file keeps its inode, its blocks are given back */
+	if (name) {
+		slprintf(idx, sizeof(idx), "%s%s", name, PCAP_INDEX_SUFFIX);
+		unlink(idx);
+		slprintf(idx, sizeof(idx), "%s%s", name, PCAP_SAMPLE_SUFFIX);
+		unlink(idx);
+
+		if (rename(name, pool->spare_name) == 0)
+			fd = open(pool->spare_name, O_RDWR | O_TRUNC |
+				  O_LARGEFILE);
+		xfree(name);
+	}
+
+	if (fd < 0)
+		fd = open_or_die_m(pool->spare_name, O_RDWR | O_CREAT |
+				   O_TRUNC | O_LARGEFILE, DEFFILEMODE);
+
+	/* Keep the size, so that backends start on an empty file */
+	if (prealloc > 0 &&
+	    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, prealloc) < 0)
+		pool->prealloc = -1;
+
+	return fd;
+}
+
+static void pcap_pool_close(struct pcap_pool *pool, int fd)
+{
+	struct stat sb;
+
+	fdatasync(fd);
+
+	/* Truncating to the same size drops blocks reserved beyond it */
+	if (fstat(fd, &sb) == 0 && ftruncate(fd, sb.st_size) == 0)
+		pool->last_size = sb.st_size;
+
+	close(fd);
+}
+
+static void *pcap_pool_thread(void *self)
+{
+	int fd;
+	char *name;
+	off_t prealloc;
+	struct pcap_pool *pool = self;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (1) {
+		/* Finished files go first, the oldest might be reused next */
+		if (pool->job_nr > 0) {
+			fd = pool->jobs[pool->job_head];
+			pool->job_head = (pool->job_head + 1) % PCAP_POOL_JOBS;
+			pool->job_nr--;
+			pthread_cond_broadcast(&pool->cond);
+			pthread_mutex_unlock(&pool->lock);
+
+			pcap_pool_close(pool, fd);
+
+			pthread_mutex_lock(&pool->lock);
+			continue;
+		}
+
+		if (pool->stop)
+			break;
+
+		if (pool->spare < 0) {
+			name = pcap_pool_pop_done(pool);
+			/* Without a hint, the next file is as large as the last */
+			prealloc = pool->prealloc < 0 ? 0 :
+				   max(pool->prealloc, pool->last_size);
+			pthread_mutex_unlock(&pool->lock);
+
+			fd = pcap_pool_make_spare(pool, name, prealloc);
+
+			pthread_mutex_lock(&pool->lock);
+			pool->spare = fd;
+			pthread_cond_broadcast(&pool->cond);
+			continue;
+		}
+
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct pcap_pool *pcap_pool_create(const char *spare_name, unsigned int keep,
+				   off_t prealloc)
+{
+	int ret;
+	struct pcap_pool *pool = xzmalloc(sizeof(*pool));
+
+	pool->spare_name = xstrdup(spare_name);
+	pool->spare = -1;
+	pool->keep = keep;
+	pool->prealloc = prealloc;
+
+	if (keep)
+		pool->done_names = xzmalloc((keep + 1) * sizeof(char *));
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	ret = pthread_create(&pool->trid, NULL, pcap_pool_thread, pool);
+	if (ret)
+		panic("Cannot create pcap pool thread!\n");
+
+	return pool;
+}
+
+/* Hands out the spare as fname, it waits only if the pool fell behind */
+int pcap_pool_get(struct pcap_pool *pool, const char *fname)
+{
+	int fd;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (pool->spare < 0)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+
+	if (rename(pool->spare_name, fname) < 0)
+		panic("Cannot rename %s to %s: %s!\n", pool->spare_name,
+		      fname, strerror(errno));
+
+	fd = pool->spare;
+	pool->spare = -1;
+
+	if (pool->keep) {
+		/* Within the same second a file replaces its predecessor */
+		if (pool->curr_name && strcmp(pool->curr_name, fname))
+			pcap_pool_push_done(pool, pool->curr_name);
+		else if (pool->curr_name)
+			xfree(pool->curr_name);
+
+		pool->curr_name = xstrdup(fname);
+	}
+
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return fd;
+}
+
+/* The backend must be done with fd, the pool syncs and closes it */
+void pcap_pool_put(struct pcap_pool *pool, int fd)
+{
+	pthread_mutex_lock(&pool->lock);
+
+	while (pool->job_nr == PCAP_POOL_JOBS)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+
+	pool->jobs[(pool->job_head + pool->job_nr) % PCAP_POOL_JOBS] = fd;
+	pool->job_nr++;
+
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pcap_pool_destroy(struct pcap_pool *pool)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_join(pool->trid, NULL);
+
+	if (pool->spare >= 0) {
+		close(pool->spare);
+		unlink(pool->spare_name);
+	}
+
+	for (i = 0; i < pool->done_nr; ++i)
+		xfree(pool->done_names[(pool->done_head + i) %
+				       (pool->keep + 1)]);
+	if (pool->done_names)
+		xfree(pool->done_names);
+	if (pool->curr_name)
+		xfree(pool->curr_name);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+
+	xfree(pool->spare_name);
+	xfree(pool);
+}
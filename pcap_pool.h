@@ -0,0 +1,40 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef PCAP_POOL_H
+#define PCAP_POOL_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * A pcap pool keeps the next dump file of a worker created and its
+ * blocks reserved ahead of time under a hidden spare name, and syncs
+ * and closes finished files in the background, so that rotation in the
+ * capture path boils down to a rename(2). With keep set, only the last
+ * keep finished files stay around, the oldest one is reused as spare.
+ */
+
+#define PCAP_POOL_JOBS		16
+
+struct pcap_pool {
+	char *spare_name, *curr_name, **done_names;
+	int spare, jobs[PCAP_POOL_JOBS];
+	unsigned int keep, done_head, done_nr, job_head, job_nr;
+	off_t prealloc, last_size;
+	bool stop;
+	pthread_t trid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+extern struct pcap_pool *pcap_pool_create(const char *spare_name,
+					  unsigned int keep, off_t prealloc);
+extern int pcap_pool_get(struct pcap_pool *pool, const char *fname);
+extern void pcap_pool_put(struct pcap_pool *pool, int fd);
+extern void pcap_pool_destroy(struct pcap_pool *pool);
+
+#endif /* PCAP_POOL_H */
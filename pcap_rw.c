@@ -65,6 +65,11 @@ static int pcap_rw_prepare_access(int fd, enum pcap_mode mode, bool jumbo)
 	return 0;
 }
 
+static void pcap_rw_rotate(int fd, int fd_next)
+{
+	/* Records go straight to the file, nothing is buffered */
+}
+
 static void pcap_rw_fsync(int fd)
 {
 	fdatasync(fd);
@@ -76,5 +81,6 @@ const struct pcap_file_ops pcap_rw_ops = {
 	.prepare_access_pcap = pcap_rw_prepare_access,
 	.read_pcap = pcap_rw_read,
 	.write_pcap = pcap_rw_write,
+	.rotate_pcap = pcap_rw_rotate,
 	.fsync_pcap = pcap_rw_fsync,
 };
@@ -18,8 +18,9 @@
 #include "xutils.h"
 #include "built_in.h"
 
-static struct iovec iov[1024] __cacheline_aligned;
-static off_t iov_off_rd = 0, iov_slot = 0;
+/* Thread local, each capture worker dumps into its own file */
+static __thread struct iovec iov[1024] __cacheline_aligned;
+static __thread off_t iov_off_rd = 0, iov_slot = 0;
 
 static ssize_t pcap_sg_write(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
 			     const uint8_t *packet, size_t len)
@@ -105,45 +106,95 @@ static ssize_t __pcap_sg_inter_iov_data_read(int fd, uint8_t *packet, size_t len
 	return hdrlen;
 }
 
+static inline ssize_t __pcap_sg_hdr_read(int fd, pcap_pkthdr_t *phdr,
+					 enum pcap_type type, size_t hdrsize)
+{
+	if (likely(iov[iov_slot].iov_len - iov_off_rd >= hdrsize)) {
+		fmemcpy(&phdr->raw, iov[iov_slot].iov_base + iov_off_rd, hdrsize);
+		iov_off_rd += hdrsize;
+
+		return hdrsize;
+	}
+
+	return __pcap_sg_inter_iov_hdr_read(fd, phdr, type, NULL, 0, hdrsize);
+}
+
 static ssize_t pcap_sg_read(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
 			    uint8_t *packet, size_t len)
 {
 	ssize_t ret = 0;
 	size_t hdrsize = pcap_get_hdr_length(phdr, type), hdrlen;
 
-	if (likely(iov[iov_slot].iov_len - iov_off_rd >= hdrsize)) {
-		fmemcpy(&phdr->raw, iov[iov_slot].iov_base + iov_off_rd, hdrsize);
-		iov_off_rd += hdrsize;
+	ret = __pcap_sg_hdr_read(fd, phdr, type, hdrsize);
+	if (unlikely(ret < 0))
+		return ret;
+
+	hdrlen = pcap_get_length(phdr, type);
+	if (unlikely(hdrlen == 0 || hdrlen > len))
+		return -EINVAL;
+
+	if (likely(iov[iov_slot].iov_len - iov_off_rd >= hdrlen)) {
+		fmemcpy(packet, iov[iov_slot].iov_base + iov_off_rd, hdrlen);
+		iov_off_rd += hdrlen;
 	} else {
-		ret = __pcap_sg_inter_iov_hdr_read(fd, phdr, type, packet,
-						   len, hdrsize);
+		ret = __pcap_sg_inter_iov_data_read(fd, packet, len, hdrlen);
 		if (unlikely(ret < 0))
 			return ret;
 	}
 
+	return hdrsize + hdrlen;
+}
+
+static ssize_t pcap_sg_read_zc(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+			       uint8_t **packet, uint8_t *bounce, size_t len)
+{
+	ssize_t ret = 0;
+	size_t hdrsize = pcap_get_hdr_length(phdr, type), hdrlen;
+
+	ret = __pcap_sg_hdr_read(fd, phdr, type, hdrsize);
+	if (unlikely(ret < 0))
+		return ret;
+
 	hdrlen = pcap_get_length(phdr, type);
-	if (unlikely(hdrlen == 0 || hdrlen > len))
+	if (unlikely(hdrlen == 0))
 		return -EINVAL;
 
 	if (likely(iov[iov_slot].iov_len - iov_off_rd >= hdrlen)) {
-		fmemcpy(packet, iov[iov_slot].iov_base + iov_off_rd, hdrlen);
+		*packet = iov[iov_slot].iov_base + iov_off_rd;
 		iov_off_rd += hdrlen;
 	} else {
-		ret = __pcap_sg_inter_iov_data_read(fd, packet, len, hdrlen);
+		/* Straddles two iovecs, the next readv() would clobber it */
+		if (unlikely(hdrlen > len))
+			return -EINVAL;
+
+		ret = __pcap_sg_inter_iov_data_read(fd, bounce, len, hdrlen);
 		if (unlikely(ret < 0))
 			return ret;
+
+		*packet = bounce;
 	}
 
 	return hdrsize + hdrlen;
 }
 
-static void pcap_sg_fsync(int fd)
+static void __pcap_sg_flush(int fd)
 {
 	ssize_t ret = writev(fd, iov, iov_slot);
 	if (ret < 0)
 		panic("Writev I/O error: %s!\n", strerror(errno));
 
 	iov_slot = 0;
+}
+
+/* The iovec buffers stay, they are not bound to a file */
+static void pcap_sg_rotate(int fd, int fd_next)
+{
+	__pcap_sg_flush(fd);
+}
+
+static void pcap_sg_fsync(int fd)
+{
+	__pcap_sg_flush(fd);
 	fdatasync(fd);
 }
 
@@ -189,6 +240,8 @@ const struct pcap_file_ops pcap_sg_ops = {
 	.prepare_access_pcap =  pcap_sg_prepare_access,
 	.prepare_close_pcap = pcap_sg_prepare_close,
 	.read_pcap = pcap_sg_read,
+	.read_pcap_zc = pcap_sg_read_zc,
 	.write_pcap = pcap_sg_write,
+	.rotate_pcap = pcap_sg_rotate,
 	.fsync_pcap = pcap_sg_fsync,
 };
@@ -0,0 +1,656 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#ifdef __WITH_ZLIB
+# include <zlib.h>
+#endif
+
+#include "pcap.h"
+#include "pcap_stream.h"
+#include "built_in.h"
+#include "xmalloc.h"
+#include "xutils.h"
+#include "die.h"
+
+/*
+ * Records are batched into buffers of a message each, which a thread of
+ * its own compresses and sends, so that the capture only copies. Once all
+ * buffers wait to be sent, the capture waits, too, and the kernel drops
+ * what no longer fits into the ring; a slow collector or network thus
+ * shows up as drops and stalls instead of as memory use. A batch that is
+ * not full is taken by the sender itself once it was idle for a while,
+ * so a slow or paused capture still reaches the collector in time. The
+ * capture thus appends under the lock, which it mostly has to itself.
+ */
+
+#define STREAM_NR_BUFS		4
+#define STREAM_FLUSH_MS		100
+/* How long a send may block before it looks at sigint */
+#define STREAM_SEND_TIMEO	1
+
+enum stream_buf_state {
+	STREAM_BUF_FREE,
+	STREAM_BUF_FULL,
+};
+
+struct stream_buf {
+	uint8_t *raw;
+	size_t raw_len;
+	enum stream_buf_state state;
+};
+
+struct stream_wr {
+	int fd;
+	struct stream_buf bufs[STREAM_NR_BUFS];
+	/* Buffer the capture fills, and the one sent next */
+	unsigned int curr, next;
+	bool compress, stop;
+	/* The collector stopped reading on ^C, the rest is dropped */
+	bool cut;
+	uint8_t *z;
+	pthread_t trid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct stream_rd {
+	uint8_t *in, *out;
+	/* Bytes of the message read so far */
+	size_t in_len;
+	/* Records of the last message, inflated or not */
+	const uint8_t *data;
+	size_t data_len, data_pos;
+};
+
+static __thread struct stream_wr sw;
+static __thread struct stream_rd sr;
+
+/* Set when connecting, all connections of an agent do the same */
+static bool stream_compress;
+
+/* Summed up over all connections, for the verbose statistics */
+static unsigned long long stream_raw_bytes, stream_wire_bytes, stream_msgs,
+			  stream_stalls, stream_cut;
+
+extern volatile sig_atomic_t sigint;
+
+/* Splits [host:]port, host may be an IPv6 address in brackets */
+static int stream_addrinfo(const char *addr, bool passive,
+			   struct addrinfo **res)
+{
+	int ret;
+	char *buf = xstrdup(addr), *host = NULL, *port;
+	struct addrinfo hints;
+
+	port = strrchr(buf, ':');
+	if (port) {
+		*port++ = 0;
+		host = buf;
+		if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+			host[strlen(host) - 1] = 0;
+			host++;
+		}
+	} else {
+		port = buf;
+	}
+
+	if (!passive && (!host || !host[0]))
+		panic("Collector %s needs a host:port!\n", addr);
+
+	fmemset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = AI_NUMERICSERV | (passive ? AI_PASSIVE : 0);
+
+	ret = getaddrinfo(host && host[0] ? host : NULL, port, &hints, res);
+
+	xfree(buf);
+
+	return ret;
+}
+
+int pcap_stream_connect(const char *addr, bool compress)
+{
+	int fd = -1, ret, err = 0;
+	struct addrinfo *ahead, *ai;
+	struct timeval tv = {
+		.tv_sec = STREAM_SEND_TIMEO,
+	};
+
+#ifndef __WITH_ZLIB
+	if (compress)
+		panic("No zlib support compiled in!\n");
+#endif
+	ret = stream_addrinfo(addr, false, &ahead);
+	if (ret)
+		panic("Cannot resolve collector %s: %s!\n", addr,
+		      gai_strerror(ret));
+
+	for (ai = ahead; ai != NULL && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			err = errno;
+			continue;
+		}
+
+		ret = connect(fd, ai->ai_addr, ai->ai_addrlen);
+		if (ret < 0) {
+			err = errno;
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	freeaddrinfo(ahead);
+
+	if (fd < 0)
+		panic("Cannot connect to collector %s: %s!\n", addr,
+		      strerror(err));
+
+	/* Messages are sent whole, their last segment need not wait */
+	set_tcp_nodelay(fd);
+	set_socket_keepalive(fd);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	stream_compress = compress;
+
+	return fd;
+}
+
+int pcap_stream_listen(const char *addr)
+{
+	int fd = -1, ret;
+	struct addrinfo *ahead, *ai;
+
+	ret = stream_addrinfo(addr, true, &ahead);
+	if (ret)
+		panic("Cannot resolve %s: %s!\n", addr, gai_strerror(ret));
+
+	for (ai = ahead; ai != NULL && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		set_reuseaddr(fd);
+
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 ||
+		    listen(fd, 16) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	freeaddrinfo(ahead);
+
+	if (fd < 0)
+		panic("Cannot listen on %s!\n", addr);
+
+	return fd;
+}
+
+static int stream_send(int fd, uint8_t type, uint16_t flags,
+		       const void *data, size_t len, size_t raw_len)
+{
+	ssize_t ret;
+	struct pcap_stream_hdr hdr;
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	hdr.magic = htonl(PCAP_STREAM_MAGIC);
+	hdr.version = PCAP_STREAM_VERSION;
+	hdr.type = type;
+	hdr.flags = htons(flags);
+	hdr.len = htonl(len);
+	hdr.raw_len = htonl(raw_len);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = len;
+
+	fmemset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = array_size(iov);
+
+	while (msg.msg_iovlen) {
+		/* A collector that went away must not kill us by SIGPIPE */
+		ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* A collector that stopped reading is waited for until ^C */
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (sigint)
+					return -ETIMEDOUT;
+				continue;
+			}
+			panic("Cannot stream to collector: %s!\n",
+			      strerror(errno));
+		}
+
+		while (msg.msg_iovlen && (size_t) ret >= msg.msg_iov->iov_len) {
+			ret -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen) {
+			msg.msg_iov->iov_base =
+				(uint8_t *) msg.msg_iov->iov_base + ret;
+			msg.msg_iov->iov_len -= ret;
+		}
+	}
+
+	__sync_add_and_fetch(&stream_wire_bytes, sizeof(hdr) + len);
+
+	return 0;
+}
+
+static int stream_send_buf(struct stream_wr *w, struct stream_buf *b)
+{
+	int ret;
+	uint16_t flags = 0;
+	const uint8_t *data = b->raw;
+	size_t len = b->raw_len;
+#ifdef __WITH_ZLIB
+	uLongf z_len = PCAP_STREAM_MSG_MAX;
+
+	/* Batches that do not shrink, or do not fit, go out as they are */
+	if (w->compress && compress2(w->z, &z_len, b->raw, b->raw_len,
+				     Z_BEST_SPEED) == Z_OK &&
+	    z_len < b->raw_len) {
+		data = w->z;
+		len = z_len;
+		flags = PCAP_STREAM_ZLIB;
+	}
+#endif
+	ret = stream_send(w->fd, PCAP_STREAM_DATA, flags, data, len,
+			  b->raw_len);
+	if (ret)
+		return ret;
+
+	__sync_add_and_fetch(&stream_raw_bytes, b->raw_len);
+	__sync_add_and_fetch(&stream_msgs, 1);
+
+	return 0;
+}
+
+/* Hands the buffer being filled to the sender, called with the lock held */
+static void __stream_submit_curr(struct stream_wr *w)
+{
+	struct stream_buf *b = &w->bufs[w->curr];
+
+	if (b->raw_len == 0)
+		return;
+
+	b->state = STREAM_BUF_FULL;
+	pthread_cond_broadcast(&w->cond);
+
+	w->curr = (w->curr + 1) % STREAM_NR_BUFS;
+	if (w->bufs[w->curr].state != STREAM_BUF_FREE)
+		__sync_add_and_fetch(&stream_stalls, 1);
+	while (w->bufs[w->curr].state != STREAM_BUF_FREE)
+		pthread_cond_wait(&w->cond, &w->lock);
+}
+
+static void *stream_send_thread(void *self)
+{
+	bool full;
+	struct stream_wr *w = self;
+	struct stream_buf *b;
+	struct timespec ts;
+
+	while (1) {
+		pthread_mutex_lock(&w->lock);
+		b = &w->bufs[w->next];
+		while (b->state != STREAM_BUF_FULL && !w->stop) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += STREAM_FLUSH_MS * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+
+			/*
+			 * Nothing queued means all was sent, the next buffer
+			 * is the partial one and the one after it is free.
+			 */
+			if (pthread_cond_timedwait(&w->cond, &w->lock, &ts) ==
+			    ETIMEDOUT)
+				__stream_submit_curr(w);
+		}
+		full = b->state == STREAM_BUF_FULL;
+		pthread_mutex_unlock(&w->lock);
+
+		if (!full)
+			break;
+
+		if (!w->cut && stream_send_buf(w, b))
+			w->cut = true;
+		if (w->cut)
+			__sync_add_and_fetch(&stream_cut, 1);
+
+		pthread_mutex_lock(&w->lock);
+		b->raw_len = 0;
+		b->state = STREAM_BUF_FREE;
+		w->next = (w->next + 1) % STREAM_NR_BUFS;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return NULL;
+}
+
+static void stream_submit_curr(void)
+{
+	pthread_mutex_lock(&sw.lock);
+	__stream_submit_curr(&sw);
+	pthread_mutex_unlock(&sw.lock);
+}
+
+static void stream_wait_idle(void)
+{
+	int i;
+
+	pthread_mutex_lock(&sw.lock);
+	for (i = 0; i < STREAM_NR_BUFS; ++i) {
+		while (sw.bufs[i].state != STREAM_BUF_FREE)
+			pthread_cond_wait(&sw.cond, &sw.lock);
+	}
+	pthread_mutex_unlock(&sw.lock);
+}
+
+static int pcap_stream_push_fhdr(int fd, uint32_t magic, uint32_t linktype)
+{
+	struct pcap_filehdr hdr;
+
+	fmemset(&hdr, 0, sizeof(hdr));
+
+	pcap_prepare_header(&hdr, magic, linktype, 0, PCAP_DEFAULT_SNAPSHOT_LEN);
+
+	return stream_send(fd, PCAP_STREAM_FHDR, 0, &hdr, sizeof(hdr),
+			   sizeof(hdr));
+}
+
+static ssize_t pcap_stream_write(int fd, pcap_pkthdr_t *phdr,
+				 enum pcap_type type, const uint8_t *packet,
+				 size_t len)
+{
+	ssize_t hdrsize = pcap_get_hdr_length(phdr, type);
+	struct stream_buf *b;
+
+	pthread_mutex_lock(&sw.lock);
+
+	b = &sw.bufs[sw.curr];
+	if (unlikely(b->raw_len + hdrsize + len > PCAP_STREAM_MSG_MAX)) {
+		__stream_submit_curr(&sw);
+		b = &sw.bufs[sw.curr];
+	}
+
+	fmemcpy(b->raw + b->raw_len, &phdr->raw, hdrsize);
+	b->raw_len += hdrsize;
+
+	fmemcpy(b->raw + b->raw_len, packet, len);
+	b->raw_len += len;
+
+	pthread_mutex_unlock(&sw.lock);
+
+	return hdrsize + len;
+}
+
+static void pcap_stream_fsync(int fd)
+{
+	stream_submit_curr();
+	stream_wait_idle();
+}
+
+/* Reads on until a whole message is in, keeping what came so far */
+static int stream_rd_msg(int fd, struct pcap_stream_hdr *hdr)
+{
+	ssize_t ret;
+	size_t need;
+
+	while (1) {
+		need = sizeof(*hdr);
+		if (sr.in_len >= need) {
+			fmemcpy(hdr, sr.in, sizeof(*hdr));
+			hdr->magic = ntohl(hdr->magic);
+			hdr->flags = ntohs(hdr->flags);
+			hdr->len = ntohl(hdr->len);
+			hdr->raw_len = ntohl(hdr->raw_len);
+
+			if (hdr->magic != PCAP_STREAM_MAGIC ||
+			    hdr->version != PCAP_STREAM_VERSION ||
+			    hdr->len > PCAP_STREAM_MSG_MAX ||
+			    hdr->raw_len > PCAP_STREAM_MSG_MAX ||
+			    (!(hdr->flags & PCAP_STREAM_ZLIB) &&
+			     hdr->len != hdr->raw_len))
+				return -EINVAL;
+
+			need += hdr->len;
+			if (sr.in_len == need) {
+				sr.in_len = 0;
+				return 0;
+			}
+		}
+
+		ret = read(fd, sr.in + sr.in_len, need - sr.in_len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		/* Sockets with a receive timeout, so the caller can look up */
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return -EAGAIN;
+		if (ret <= 0)
+			return -EIO;
+
+		sr.in_len += ret;
+	}
+}
+
+static int stream_rd_data(int fd)
+{
+	int ret;
+	struct pcap_stream_hdr hdr;
+	uint8_t *payload = sr.in + sizeof(hdr);
+
+	ret = stream_rd_msg(fd, &hdr);
+	if (ret)
+		return ret;
+	if (hdr.type != PCAP_STREAM_DATA)
+		return -EINVAL;
+
+	if (hdr.flags & PCAP_STREAM_ZLIB) {
+#ifdef __WITH_ZLIB
+		uLongf len = PCAP_STREAM_MSG_MAX;
+
+		if (uncompress(sr.out, &len, payload, hdr.len) != Z_OK ||
+		    len != hdr.raw_len)
+			return -EINVAL;
+
+		sr.data = sr.out;
+#else
+		panic("No zlib support compiled in!\n");
+#endif
+	} else {
+		sr.data = payload;
+	}
+
+	sr.data_len = hdr.raw_len;
+	sr.data_pos = 0;
+
+	return 0;
+}
+
+static int pcap_stream_pull_fhdr(int fd, uint32_t *magic, uint32_t *linktype)
+{
+	int ret;
+	struct pcap_stream_hdr hdr;
+	struct pcap_filehdr fhdr;
+
+	if (!sr.in) {
+		sr.in = xmalloc(sizeof(hdr) + PCAP_STREAM_MSG_MAX);
+		sr.out = xmalloc(PCAP_STREAM_MSG_MAX);
+		sr.in_len = sr.data_len = sr.data_pos = 0;
+	}
+
+	ret = stream_rd_msg(fd, &hdr);
+	if (ret)
+		return ret;
+	if (hdr.type != PCAP_STREAM_FHDR || hdr.len != sizeof(fhdr))
+		return -EINVAL;
+
+	fmemcpy(&fhdr, sr.in + sizeof(hdr), sizeof(fhdr));
+
+	/* A broken agent only loses its own connection */
+	if (!pcap_header_is_valid(&fhdr))
+		return -EINVAL;
+
+	*magic = fhdr.magic;
+	*linktype = fhdr.linktype;
+
+	return 0;
+}
+
+/* Records never span messages, so they are handed out in place */
+static ssize_t pcap_stream_read_zc(int fd, pcap_pkthdr_t *phdr,
+				   enum pcap_type type, uint8_t **packet,
+				   uint8_t *bounce, size_t len)
+{
+	int ret;
+	size_t hdrsize = pcap_get_hdr_length(phdr, type), hdrlen;
+
+	while (sr.data_pos == sr.data_len) {
+		ret = stream_rd_data(fd);
+		if (ret)
+			return ret;
+	}
+
+	if (unlikely(sr.data_len - sr.data_pos < hdrsize))
+		return -EINVAL;
+
+	fmemcpy(&phdr->raw, sr.data + sr.data_pos, hdrsize);
+	hdrlen = pcap_get_length(phdr, type);
+
+	if (unlikely(hdrlen > PCAP_MAX_SNAPSHOT_LEN ||
+		     hdrlen > sr.data_len - sr.data_pos - hdrsize))
+		return -EINVAL;
+
+	*packet = (uint8_t *) sr.data + sr.data_pos + hdrsize;
+	sr.data_pos += hdrsize + hdrlen;
+
+	return hdrsize + hdrlen;
+}
+
+static ssize_t pcap_stream_read(int fd, pcap_pkthdr_t *phdr,
+				enum pcap_type type, uint8_t *packet,
+				size_t len)
+{
+	ssize_t ret;
+	uint8_t *data;
+
+	ret = pcap_stream_read_zc(fd, phdr, type, &data, packet, len);
+	if (ret < 0)
+		return ret;
+	if (unlikely(pcap_get_length(phdr, type) > len))
+		return -EINVAL;
+
+	fmemcpy(packet, data, pcap_get_length(phdr, type));
+
+	return ret;
+}
+
+static int pcap_stream_prepare_access(int fd, enum pcap_mode mode, bool jumbo)
+{
+	int i, ret;
+
+	/* Reading got ready when pulling the file header */
+	if (mode == PCAP_MODE_RD)
+		return 0;
+
+	fmemset(&sw, 0, sizeof(sw));
+	sw.fd = fd;
+	sw.compress = stream_compress;
+
+	for (i = 0; i < STREAM_NR_BUFS; ++i)
+		sw.bufs[i].raw = xmalloc_aligned(PCAP_STREAM_MSG_MAX, PAGE_SIZE);
+	if (sw.compress)
+		sw.z = xmalloc_aligned(PCAP_STREAM_MSG_MAX, PAGE_SIZE);
+
+	pthread_mutex_init(&sw.lock, NULL);
+	pthread_cond_init(&sw.cond, NULL);
+
+	ret = pthread_create(&sw.trid, NULL, stream_send_thread, &sw);
+	if (ret)
+		panic("Cannot create stream sender thread!\n");
+
+	return 0;
+}
+
+static void pcap_stream_prepare_close(int fd, enum pcap_mode mode)
+{
+	int i;
+
+	if (mode == PCAP_MODE_RD) {
+		xfree(sr.in);
+		xfree(sr.out);
+		sr.in = sr.out = NULL;
+		return;
+	}
+
+	stream_submit_curr();
+	stream_wait_idle();
+
+	pthread_mutex_lock(&sw.lock);
+	sw.stop = true;
+	pthread_cond_broadcast(&sw.cond);
+	pthread_mutex_unlock(&sw.lock);
+
+	pthread_join(sw.trid, NULL);
+
+	pthread_cond_destroy(&sw.cond);
+	pthread_mutex_destroy(&sw.lock);
+
+	for (i = 0; i < STREAM_NR_BUFS; ++i)
+		xfree(sw.bufs[i].raw);
+	if (sw.z)
+		xfree(sw.z);
+}
+
+static void pcap_stream_print_stats(void)
+{
+	if (stream_msgs == 0 && stream_cut == 0)
+		return;
+
+	printf("\r%12llu bytes streamed in %llu messages, %llu on the wire, %llu stalls\n",
+	       stream_raw_bytes, stream_msgs, stream_wire_bytes, stream_stalls);
+	if (stream_cut)
+		printf("\r%12llu messages cut off on exit\n", stream_cut);
+}
+
+const struct pcap_file_ops pcap_stream_ops = {
+	.pull_fhdr_pcap = pcap_stream_pull_fhdr,
+	.push_fhdr_pcap = pcap_stream_push_fhdr,
+	.prepare_access_pcap = pcap_stream_prepare_access,
+	.prepare_close_pcap = pcap_stream_prepare_close,
+	.read_pcap = pcap_stream_read,
+	.read_pcap_zc = pcap_stream_read_zc,
+	.write_pcap = pcap_stream_write,
+	.fsync_pcap = pcap_stream_fsync,
+	.print_stats_pcap = pcap_stream_print_stats,
+};
@@ -0,0 +1,45 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef PCAP_STREAM_H
+#define PCAP_STREAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * An agent streams its capture to a collector over TCP as a sequence of
+ * messages, each a header and the payload behind it. The first message
+ * carries the pcap file header, all others a batch of whole pcap records,
+ * deflated with zlib framing if the agent compresses. Header fields are
+ * in network byte order, file header and records are as the agent would
+ * have written them into a pcap.
+ */
+
+#define PCAP_STREAM_MAGIC	0x4e535354	/* "NSST" */
+#define PCAP_STREAM_VERSION	1
+/* Largest payload before compression */
+#define PCAP_STREAM_MSG_MAX	(1 << 20)
+
+enum pcap_stream_type {
+	PCAP_STREAM_FHDR = 1,
+	PCAP_STREAM_DATA,
+};
+
+/* The payload is deflated and inflates to raw_len bytes */
+#define PCAP_STREAM_ZLIB	(1 << 0)
+
+struct pcap_stream_hdr {
+	uint32_t magic;
+	uint8_t version, type;
+	uint16_t flags;
+	uint32_t len, raw_len;
+};
+
+/* Both take [host:]port, IPv6 addresses in brackets, and die on errors */
+extern int pcap_stream_connect(const char *addr, bool compress);
+extern int pcap_stream_listen(const char *addr);
+
+#endif /* PCAP_STREAM_H */
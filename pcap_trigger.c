@@ -0,0 +1,142 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "pcap_trigger.h"
+#include "built_in.h"
+#include "xmalloc.h"
+#include "xutils.h"
+
+#define PCAP_TRIGGER_ALIGN	8
+
+void pcap_trigger_init(struct pcap_trigger *t, size_t size, uint32_t window)
+{
+	fmemset(t, 0, sizeof(*t));
+
+	t->size = size & ~((size_t) PCAP_TRIGGER_ALIGN - 1);
+	t->buf = xmalloc_aligned(t->size, PCAP_TRIGGER_ALIGN);
+	t->window = pcap_trigger_ns(window, 0);
+}
+
+void pcap_trigger_destroy(struct pcap_trigger *t)
+{
+	if (t->buf)
+		xfree(t->buf);
+
+	fmemset(t, 0, sizeof(*t));
+}
+
+/* Oldest record, after skipping the unused end of the buffer */
+static struct pcap_trigger_rec *pcap_trigger_oldest(struct pcap_trigger *t)
+{
+	struct pcap_trigger_rec *rec;
+
+	if (t->used == 0)
+		return NULL;
+
+	rec = (void *) (t->buf + t->tail);
+	if (rec->size == 0) {
+		t->used -= t->size - t->tail;
+		t->tail = 0;
+		rec = (void *) t->buf;
+	}
+
+	return rec;
+}
+
+static struct pcap_trigger_rec *pcap_trigger_drop(struct pcap_trigger *t)
+{
+	struct pcap_trigger_rec *rec = pcap_trigger_oldest(t);
+
+	if (!rec)
+		return NULL;
+
+	t->used -= rec->size;
+	t->tail += rec->size;
+	if (t->tail == t->size)
+		t->tail = 0;
+
+	return rec;
+}
+
+/* Makes room for size bytes at head, wrapping around if need be */
+static bool pcap_trigger_room(struct pcap_trigger *t, size_t size)
+{
+	struct pcap_trigger_rec *wrap;
+
+	if (t->used == 0) {
+		t->head = t->tail = 0;
+		return true;
+	}
+
+	if (t->head < t->tail)
+		return t->head + size <= t->tail;
+	if (t->head == t->tail)
+		return false;
+	if (t->head + size <= t->size)
+		return true;
+	if (size > t->tail)
+		return false;
+
+	wrap = (void *) (t->buf + t->head);
+	wrap->size = 0;
+
+	t->used += t->size - t->head;
+	t->head = 0;
+
+	return true;
+}
+
+void pcap_trigger_hold(struct pcap_trigger *t, pcap_pkthdr_t *phdr,
+		       enum pcap_type type, const uint8_t *packet,
+		       uint32_t sec, uint32_t nsec)
+{
+	size_t len = pcap_get_length(phdr, type);
+	size_t size = round_up(sizeof(struct pcap_trigger_rec) + len,
+			       PCAP_TRIGGER_ALIGN);
+	uint64_t now = pcap_trigger_ns(sec, nsec);
+	struct pcap_trigger_rec *rec;
+
+	/* What is older than the window is of no use for the next trigger */
+	while ((rec = pcap_trigger_oldest(t)) &&
+	       pcap_trigger_ns(rec->tv_sec, rec->tv_nsec) + t->window < now) {
+		pcap_trigger_drop(t);
+		t->expired++;
+	}
+
+	if (unlikely(size > t->size)) {
+		t->expired++;
+		return;
+	}
+
+	while (!pcap_trigger_room(t, size)) {
+		pcap_trigger_drop(t);
+		t->expired++;
+	}
+
+	rec = (void *) (t->buf + t->head);
+	rec->size = size;
+	rec->len = len;
+	rec->tv_sec = sec;
+	rec->tv_nsec = nsec;
+	fmemcpy(&rec->phdr, phdr, sizeof(*phdr));
+	fmemcpy(rec->packet, packet, len);
+
+	t->used += size;
+	t->head += size;
+	if (t->head == t->size)
+		t->head = 0;
+
+	t->held++;
+}
+
+/* Hands out the oldest record, valid until the next hold */
+struct pcap_trigger_rec *pcap_trigger_pop(struct pcap_trigger *t)
+{
+	return pcap_trigger_drop(t);
+}
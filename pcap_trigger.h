@@ -0,0 +1,48 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef PCAP_TRIGGER_H
+#define PCAP_TRIGGER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "pcap.h"
+
+/*
+ * A trigger buffer holds the latest records of a capture in memory,
+ * bounded in bytes and in seconds, until a trigger wants them written.
+ * Records keep their pcap header, so they go to write_pcap as they are.
+ */
+
+struct pcap_trigger_rec {
+	uint32_t size;		/* Bytes to the next record, 0 wraps around */
+	uint32_t len;
+	uint32_t tv_sec, tv_nsec;
+	pcap_pkthdr_t phdr;
+	uint8_t packet[0];
+};
+
+struct pcap_trigger {
+	uint8_t *buf;
+	size_t size, head, tail, used;
+	uint64_t window;
+	unsigned long held, expired;
+};
+
+static inline uint64_t pcap_trigger_ns(uint32_t sec, uint32_t nsec)
+{
+	return sec * 1000000000ULL + nsec;
+}
+
+extern void pcap_trigger_init(struct pcap_trigger *t, size_t size,
+			      uint32_t window);
+extern void pcap_trigger_destroy(struct pcap_trigger *t);
+extern void pcap_trigger_hold(struct pcap_trigger *t, pcap_pkthdr_t *phdr,
+			      enum pcap_type type, const uint8_t *packet,
+			      uint32_t sec, uint32_t nsec);
+extern struct pcap_trigger_rec *pcap_trigger_pop(struct pcap_trigger *t);
+
+#endif /* PCAP_TRIGGER_H */
@@ -0,0 +1,372 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifdef __WITH_IO_URING
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "pcap.h"
+#include "built_in.h"
+#include "xmalloc.h"
+#include "xutils.h"
+#include "die.h"
+
+/*
+ * Packets are copied into a ring of registered buffers. A full buffer
+ * is queued as a single fixed write at its file offset, so there is one
+ * io_uring_enter(2) per buffer and none per packet. The pcap file header
+ * is written synchronously before, by push_fhdr_pcap.
+ */
+
+#define URING_NR_BUFS		8
+#define URING_BUF_SIZE		(1 << 20)
+#define URING_FSYNC_TAG		((uint64_t) -1)
+
+struct uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+};
+
+static __thread struct uring ring;
+static __thread struct iovec bufs[URING_NR_BUFS];
+static __thread bool busy[URING_NR_BUFS];
+static __thread unsigned int buf_curr, inflight;
+static __thread size_t buf_fill;
+static __thread off_t file_off;
+static __thread int file_fd;
+
+static inline int sys_io_uring_setup(unsigned int entries,
+				     struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned int to_submit,
+				     unsigned int min_complete,
+				     unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned int opcode,
+					void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_setup(void)
+{
+	int ret;
+	struct io_uring_params p;
+
+	fmemset(&p, 0, sizeof(p));
+
+	/* Room for every buffer plus a linked fsync */
+	ring.fd = sys_io_uring_setup(URING_NR_BUFS * 2, &p);
+	if (ring.fd < 0)
+		panic("Cannot set up io_uring: %s!\n", strerror(errno));
+
+	ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring.sq_len = ring.cq_len = max(ring.sq_len, ring.cq_len);
+
+	ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ptr == MAP_FAILED)
+		panic("Cannot mmap io_uring SQ ring!\n");
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring.cq_ptr = ring.sq_ptr;
+	} else {
+		ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, ring.fd,
+				   IORING_OFF_CQ_RING);
+		if (ring.cq_ptr == MAP_FAILED)
+			panic("Cannot mmap io_uring CQ ring!\n");
+	}
+
+	ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		panic("Cannot mmap io_uring SQEs!\n");
+
+	ring.sq_head = ring.sq_ptr + p.sq_off.head;
+	ring.sq_tail = ring.sq_ptr + p.sq_off.tail;
+	ring.sq_mask = ring.sq_ptr + p.sq_off.ring_mask;
+	ring.sq_array = ring.sq_ptr + p.sq_off.array;
+
+	ring.cq_head = ring.cq_ptr + p.cq_off.head;
+	ring.cq_tail = ring.cq_ptr + p.cq_off.tail;
+	ring.cq_mask = ring.cq_ptr + p.cq_off.ring_mask;
+	ring.cqes = ring.cq_ptr + p.cq_off.cqes;
+
+	ret = sys_io_uring_register(ring.fd, IORING_REGISTER_BUFFERS, bufs,
+				    URING_NR_BUFS);
+	if (ret < 0)
+		panic("Cannot register io_uring buffers: %s!\n",
+		      strerror(errno));
+}
+
+static void uring_teardown(void)
+{
+	sys_io_uring_register(ring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+
+	munmap(ring.sqes, ring.sqes_len);
+	if (ring.cq_ptr != ring.sq_ptr)
+		munmap(ring.cq_ptr, ring.cq_len);
+	munmap(ring.sq_ptr, ring.sq_len);
+
+	close(ring.fd);
+}
+
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	unsigned int tail = *ring.sq_tail, idx = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+	fmemset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[idx] = idx;
+
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	inflight++;
+
+	return sqe;
+}
+
+static void uring_reap(unsigned int min_complete)
+{
+	int ret;
+	unsigned int head, done = 0;
+	struct io_uring_cqe *cqe;
+
+	while (done < min_complete || min_complete == 0) {
+		head = *ring.cq_head;
+
+		if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			if (min_complete == 0)
+				break;
+
+			ret = sys_io_uring_enter(ring.fd, 0, min_complete - done,
+						 IORING_ENTER_GETEVENTS);
+			if (ret < 0 && errno != EINTR)
+				panic("io_uring wait error: %s!\n",
+				      strerror(errno));
+			continue;
+		}
+
+		cqe = &ring.cqes[head & *ring.cq_mask];
+		if (cqe->res < 0)
+			panic("io_uring I/O error: %s!\n", strerror(-cqe->res));
+
+		if (cqe->user_data != URING_FSYNC_TAG) {
+			if (unlikely(cqe->res != bufs[cqe->user_data].iov_len))
+				panic("io_uring short write!\n");
+			busy[cqe->user_data] = false;
+		}
+
+		__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+		inflight--;
+		done++;
+	}
+}
+
+static void uring_submit(unsigned int to_submit)
+{
+	int ret;
+
+	do {
+		ret = sys_io_uring_enter(ring.fd, to_submit, 0, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		panic("io_uring submit error: %s!\n", strerror(errno));
+}
+
+static struct io_uring_sqe *uring_queue_curr(void)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	bufs[buf_curr].iov_len = buf_fill;
+	busy[buf_curr] = true;
+
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = file_fd;
+	sqe->addr = (unsigned long) bufs[buf_curr].iov_base;
+	sqe->len = buf_fill;
+	sqe->off = file_off;
+	sqe->buf_index = buf_curr;
+	sqe->user_data = buf_curr;
+
+	file_off += buf_fill;
+
+	return sqe;
+}
+
+static void uring_next_buf(void)
+{
+	buf_curr = (buf_curr + 1) % URING_NR_BUFS;
+	buf_fill = 0;
+
+	/* Pick up what completed meanwhile, wait only if we have to */
+	uring_reap(0);
+	while (busy[buf_curr])
+		uring_reap(1);
+}
+
+static void uring_flush_curr(void)
+{
+	uring_queue_curr();
+	uring_submit(1);
+	uring_next_buf();
+}
+
+static ssize_t pcap_uring_write(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+				const uint8_t *packet, size_t len)
+{
+	ssize_t hdrsize = pcap_get_hdr_length(phdr, type);
+
+	if (unlikely(buf_fill + hdrsize + len > URING_BUF_SIZE))
+		uring_flush_curr();
+
+	fmemcpy(bufs[buf_curr].iov_base + buf_fill, &phdr->raw, hdrsize);
+	buf_fill += hdrsize;
+
+	fmemcpy(bufs[buf_curr].iov_base + buf_fill, packet, len);
+	buf_fill += len;
+
+	return hdrsize + len;
+}
+
+static ssize_t pcap_uring_read(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+			       uint8_t *packet, size_t len)
+{
+	/* Reads are not queued, they go through plain read(2) */
+	return pcap_rw_ops.read_pcap(fd, phdr, type, packet, len);
+}
+
+static void pcap_uring_fsync(int fd)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int to_submit = 1;
+
+	if (buf_fill > 0) {
+		uring_queue_curr();
+		to_submit++;
+	}
+
+	/*
+	 * Data sync starts only after every write queued before it has
+	 * completed, not just the last one, so drain rather than link.
+	 */
+	sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_FSYNC;
+	sqe->flags = IOSQE_IO_DRAIN;
+	sqe->fd = file_fd;
+	sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	sqe->user_data = URING_FSYNC_TAG;
+
+	uring_submit(to_submit);
+	if (inflight)
+		uring_reap(inflight);
+
+	if (to_submit > 1)
+		uring_next_buf();
+}
+
+/* Ring and registered buffers stay, only the target file changes */
+static void pcap_uring_rotate(int fd, int fd_next)
+{
+	if (buf_fill > 0)
+		uring_flush_curr();
+	if (inflight)
+		uring_reap(inflight);
+
+	file_fd = fd_next;
+	file_off = lseek(fd_next, 0, SEEK_CUR);
+	if (file_off < 0)
+		panic("Cannot seek pcap file: %s!\n", strerror(errno));
+}
+
+static int pcap_uring_prepare_access(int fd, enum pcap_mode mode, bool jumbo)
+{
+	int i;
+
+	set_ioprio_rt();
+
+	if (mode == PCAP_MODE_RD)
+		return 0;
+
+	file_off = lseek(fd, 0, SEEK_CUR);
+	if (file_off < 0)
+		return -EIO;
+
+	file_fd = fd;
+	buf_curr = inflight = 0;
+	buf_fill = 0;
+
+	for (i = 0; i < URING_NR_BUFS; ++i) {
+		bufs[i].iov_base = xzmalloc_aligned(URING_BUF_SIZE, PAGE_SIZE);
+		bufs[i].iov_len = URING_BUF_SIZE;
+		busy[i] = false;
+	}
+
+	uring_setup();
+
+	return 0;
+}
+
+static void pcap_uring_prepare_close(int fd, enum pcap_mode mode)
+{
+	int i;
+
+	if (mode == PCAP_MODE_RD)
+		return;
+
+	if (buf_fill > 0) {
+		uring_queue_curr();
+		uring_submit(1);
+	}
+
+	if (inflight)
+		uring_reap(inflight);
+
+	uring_teardown();
+
+	for (i = 0; i < URING_NR_BUFS; ++i)
+		xfree(bufs[i].iov_base);
+}
+
+const struct pcap_file_ops pcap_uring_ops = {
+	.pull_fhdr_pcap = pcap_generic_pull_fhdr,
+	.push_fhdr_pcap = pcap_generic_push_fhdr,
+	.prepare_access_pcap = pcap_uring_prepare_access,
+	.prepare_close_pcap = pcap_uring_prepare_close,
+	.read_pcap = pcap_uring_read,
+	.write_pcap = pcap_uring_write,
+	.rotate_pcap = pcap_uring_rotate,
+	.fsync_pcap = pcap_uring_fsync,
+};
+
+#endif /* __WITH_IO_URING */
@@ -0,0 +1,591 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifdef __WITH_ZLIB
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "pcap.h"
+#include "built_in.h"
+#include "xmalloc.h"
+#include "xutils.h"
+#include "die.h"
+
+/*
+ * Dumps are written as a multi-member gzip of the pcap, so zcat(1) gives
+ * the plain pcap back. The file header is a member of its own, records
+ * are gathered into chunks that end on a record boundary, and each chunk
+ * is compressed into a member of its own by a small pool of threads and
+ * written out in order. Decompression can thus start at any member, and
+ * seek_pcap finds members by their fixed gzip header.
+ */
+
+#define ZLIB_NR_THREADS		2
+#define ZLIB_NR_BUFS		4
+#define ZLIB_BUF_SIZE		(1 << 20)
+#define ZLIB_LEVEL		Z_BEST_SPEED
+#define ZLIB_IN_SIZE		(256 << 10)
+#define ZLIB_PROBE_SIZE		(4 << 10)
+
+/* What deflate puts in front of each member: no name, no mtime */
+static const uint8_t zlib_member_magic[] = {
+	0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+enum zlib_buf_state {
+	ZLIB_BUF_FREE,
+	ZLIB_BUF_FULL,
+	ZLIB_BUF_BUSY,
+};
+
+struct zlib_buf {
+	uint8_t *raw, *z;
+	size_t raw_len, z_size;
+	unsigned long seq;
+	enum zlib_buf_state state;
+};
+
+struct zlib_wr {
+	int fd;
+	struct zlib_buf bufs[ZLIB_NR_BUFS];
+	unsigned int curr;
+	unsigned long next_seq, write_seq;
+	bool stop;
+	pthread_t trids[ZLIB_NR_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct zlib_rd {
+	z_stream strm;
+	uint8_t *in, *out;
+	size_t out_len, out_pos;
+	off_t off, end;
+	bool init, seekable, eof;
+};
+
+static __thread struct zlib_wr zw;
+static __thread struct zlib_rd zr;
+
+/* Summed up over all files and threads, for the verbose statistics */
+static unsigned long long zlib_raw_bytes, zlib_z_bytes, zlib_cpu_ns;
+
+static size_t zlib_deflate(const uint8_t *src, size_t len, uint8_t *dst,
+			   size_t size)
+{
+	int ret;
+	z_stream strm;
+
+	fmemset(&strm, 0, sizeof(strm));
+
+	/* 16 + window bits asks for a gzip header and trailer */
+	ret = deflateInit2(&strm, ZLIB_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8,
+			   Z_DEFAULT_STRATEGY);
+	if (ret != Z_OK)
+		panic("Cannot init zlib deflate!\n");
+
+	strm.next_in = (uint8_t *) src;
+	strm.avail_in = len;
+	strm.next_out = dst;
+	strm.avail_out = size;
+
+	ret = deflate(&strm, Z_FINISH);
+	if (ret != Z_STREAM_END)
+		panic("zlib deflate error %d!\n", ret);
+
+	deflateEnd(&strm);
+
+	return size - strm.avail_out;
+}
+
+static inline size_t zlib_z_size(size_t len)
+{
+	/* compressBound() plus the gzip header and trailer */
+	return compressBound(len) + 32;
+}
+
+static struct zlib_buf *zlib_next_full(struct zlib_wr *w)
+{
+	int i;
+	struct zlib_buf *b = NULL;
+
+	for (i = 0; i < ZLIB_NR_BUFS; ++i) {
+		if (w->bufs[i].state == ZLIB_BUF_FULL &&
+		    (!b || w->bufs[i].seq < b->seq))
+			b = &w->bufs[i];
+	}
+
+	return b;
+}
+
+static void *zlib_compress_thread(void *self)
+{
+	size_t z_len;
+	struct zlib_wr *w = self;
+	struct zlib_buf *b;
+	struct timespec t0, t1;
+
+	while (1) {
+		pthread_mutex_lock(&w->lock);
+		while (!(b = zlib_next_full(w)) && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (b)
+			b->state = ZLIB_BUF_BUSY;
+		pthread_mutex_unlock(&w->lock);
+
+		if (!b)
+			break;
+
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+		z_len = zlib_deflate(b->raw, b->raw_len, b->z, b->z_size);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+
+		__sync_add_and_fetch(&zlib_cpu_ns,
+				     (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+				     t1.tv_nsec - t0.tv_nsec);
+		__sync_add_and_fetch(&zlib_raw_bytes, b->raw_len);
+		__sync_add_and_fetch(&zlib_z_bytes, z_len);
+
+		/* Members go out in the order their chunks were filled */
+		pthread_mutex_lock(&w->lock);
+		while (w->write_seq != b->seq)
+			pthread_cond_wait(&w->cond, &w->lock);
+		pthread_mutex_unlock(&w->lock);
+
+		write_or_die(w->fd, b->z, z_len);
+
+		pthread_mutex_lock(&w->lock);
+		w->write_seq++;
+		b->raw_len = 0;
+		b->state = ZLIB_BUF_FREE;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return NULL;
+}
+
+static void zlib_submit_curr(void)
+{
+	struct zlib_buf *b = &zw.bufs[zw.curr];
+
+	if (b->raw_len == 0)
+		return;
+
+	pthread_mutex_lock(&zw.lock);
+
+	b->seq = zw.next_seq++;
+	b->state = ZLIB_BUF_FULL;
+	pthread_cond_broadcast(&zw.cond);
+
+	zw.curr = (zw.curr + 1) % ZLIB_NR_BUFS;
+	while (zw.bufs[zw.curr].state != ZLIB_BUF_FREE)
+		pthread_cond_wait(&zw.cond, &zw.lock);
+
+	pthread_mutex_unlock(&zw.lock);
+}
+
+static void zlib_wait_idle(void)
+{
+	int i;
+
+	pthread_mutex_lock(&zw.lock);
+	for (i = 0; i < ZLIB_NR_BUFS; ++i) {
+		while (zw.bufs[i].state != ZLIB_BUF_FREE)
+			pthread_cond_wait(&zw.cond, &zw.lock);
+	}
+	pthread_mutex_unlock(&zw.lock);
+}
+
+static int pcap_zlib_push_fhdr(int fd, uint32_t magic, uint32_t linktype)
+{
+	size_t len;
+	uint8_t z[zlib_z_size(sizeof(struct pcap_filehdr))];
+	struct pcap_filehdr hdr;
+
+	fmemset(&hdr, 0, sizeof(hdr));
+
+	pcap_prepare_header(&hdr, magic, linktype, 0, PCAP_DEFAULT_SNAPSHOT_LEN);
+
+	len = zlib_deflate((uint8_t *) &hdr, sizeof(hdr), z, sizeof(z));
+	write_or_die(fd, z, len);
+
+	return 0;
+}
+
+static ssize_t pcap_zlib_write(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+			       const uint8_t *packet, size_t len)
+{
+	ssize_t hdrsize = pcap_get_hdr_length(phdr, type);
+	struct zlib_buf *b = &zw.bufs[zw.curr];
+
+	if (unlikely(b->raw_len + hdrsize + len > ZLIB_BUF_SIZE)) {
+		zlib_submit_curr();
+		b = &zw.bufs[zw.curr];
+	}
+
+	fmemcpy(b->raw + b->raw_len, &phdr->raw, hdrsize);
+	b->raw_len += hdrsize;
+
+	fmemcpy(b->raw + b->raw_len, packet, len);
+	b->raw_len += len;
+
+	return hdrsize + len;
+}
+
+/* Compression threads and buffers stay, they follow zw.fd */
+static void pcap_zlib_rotate(int fd, int fd_next)
+{
+	zlib_submit_curr();
+	zlib_wait_idle();
+
+	zw.fd = fd_next;
+}
+
+static void pcap_zlib_fsync(int fd)
+{
+	zlib_submit_curr();
+	zlib_wait_idle();
+
+	fdatasync(fd);
+}
+
+static void zlib_rd_setup(int fd)
+{
+	int ret;
+
+	if (zr.init) {
+		inflateReset(&zr.strm);
+	} else {
+		fmemset(&zr, 0, sizeof(zr));
+
+		/* 32 + window bits detects gzip framing by itself */
+		ret = inflateInit2(&zr.strm, 32 + MAX_WBITS);
+		if (ret != Z_OK)
+			panic("Cannot init zlib inflate!\n");
+
+		zr.in = xmalloc(ZLIB_IN_SIZE);
+		zr.out = xmalloc(ZLIB_BUF_SIZE);
+		zr.init = true;
+	}
+
+	zr.strm.next_in = zr.in;
+	zr.strm.avail_in = 0;
+	zr.out_len = zr.out_pos = 0;
+	zr.eof = false;
+	zr.end = 0;
+}
+
+static ssize_t zlib_rd_input(int fd)
+{
+	ssize_t ret;
+
+	if (zr.seekable)
+		ret = pread(fd, zr.in, ZLIB_IN_SIZE, zr.off);
+	else
+		ret = read(fd, zr.in, ZLIB_IN_SIZE);
+	if (ret > 0)
+		zr.off += ret;
+
+	zr.strm.next_in = zr.in;
+	zr.strm.avail_in = ret > 0 ? ret : 0;
+
+	return ret;
+}
+
+/* Compressed offset of the first byte not yet fed to inflate */
+static inline off_t zlib_rd_pos(void)
+{
+	return zr.off - zr.strm.avail_in;
+}
+
+/* Makes sure need bytes are decompressed, returns how many there are */
+static size_t zlib_rd_fill(int fd, size_t need)
+{
+	int ret;
+
+	if (zr.out_len - zr.out_pos >= need)
+		return need;
+
+	memmove(zr.out, zr.out + zr.out_pos, zr.out_len - zr.out_pos);
+	zr.out_len -= zr.out_pos;
+	zr.out_pos = 0;
+
+	while (zr.out_len < need && !zr.eof) {
+		if (zr.strm.avail_in == 0 && zlib_rd_input(fd) <= 0) {
+			zr.eof = true;
+			break;
+		}
+
+		zr.strm.next_out = zr.out + zr.out_len;
+		zr.strm.avail_out = ZLIB_BUF_SIZE - zr.out_len;
+
+		ret = inflate(&zr.strm, Z_NO_FLUSH);
+		zr.out_len = ZLIB_BUF_SIZE - zr.strm.avail_out;
+
+		if (ret == Z_STREAM_END) {
+			/* Next member, unless it starts a range of its own */
+			if (zr.end && zlib_rd_pos() >= zr.end)
+				zr.eof = true;
+			else
+				inflateReset(&zr.strm);
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			zr.eof = true;
+		}
+	}
+
+	return min(need, zr.out_len);
+}
+
+static int pcap_zlib_pull_fhdr(int fd, uint32_t *magic, uint32_t *linktype)
+{
+	off_t pos;
+	struct pcap_filehdr hdr;
+
+	zlib_rd_setup(fd);
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	zr.seekable = pos >= 0;
+	zr.off = max(pos, (off_t) 0);
+
+	/* The file header is a member of its own, records start behind it */
+	zr.end = 1;
+
+	if (zlib_rd_fill(fd, sizeof(hdr)) != sizeof(hdr))
+		return -EIO;
+
+	fmemcpy(&hdr, zr.out, sizeof(hdr));
+	zr.out_pos += sizeof(hdr);
+
+	pcap_validate_header(&hdr);
+
+	*magic = hdr.magic;
+	*linktype = hdr.linktype;
+
+	zr.eof = false;
+	zr.end = 0;
+
+	if (zr.seekable) {
+		/* Leave the file offset at the first record member */
+		zr.off = zlib_rd_pos();
+		zr.strm.avail_in = 0;
+		lseek(fd, zr.off, SEEK_SET);
+	}
+
+	inflateReset(&zr.strm);
+
+	return 0;
+}
+
+static ssize_t pcap_zlib_read_zc(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+				 uint8_t **packet, uint8_t *bounce, size_t len)
+{
+	size_t hdrsize = pcap_get_hdr_length(phdr, type), hdrlen;
+
+	if (zlib_rd_fill(fd, hdrsize) != hdrsize)
+		return -EIO;
+
+	fmemcpy(&phdr->raw, zr.out + zr.out_pos, hdrsize);
+	hdrlen = pcap_get_length(phdr, type);
+
+	if (unlikely(hdrlen == 0 || hdrlen > PCAP_MAX_SNAPSHOT_LEN))
+		return -EINVAL;
+	if (zlib_rd_fill(fd, hdrsize + hdrlen) != hdrsize + hdrlen)
+		return -EIO;
+
+	/* Valid until the next read moves the decompressed data */
+	*packet = zr.out + zr.out_pos + hdrsize;
+	zr.out_pos += hdrsize + hdrlen;
+
+	return hdrsize + hdrlen;
+}
+
+static ssize_t pcap_zlib_read(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+			      uint8_t *packet, size_t len)
+{
+	ssize_t ret;
+	uint8_t *data;
+
+	ret = pcap_zlib_read_zc(fd, phdr, type, &data, packet, len);
+	if (ret < 0)
+		return ret;
+	if (unlikely(pcap_get_length(phdr, type) > len))
+		return -EINVAL;
+
+	fmemcpy(packet, data, pcap_get_length(phdr, type));
+
+	return ret;
+}
+
+/* A member header only counts if a plausible record inflates from it */
+static bool zlib_member_ok(int fd, off_t off, enum pcap_type type)
+{
+	int ret;
+	bool ok = false;
+	ssize_t len;
+	z_stream strm;
+	pcap_pkthdr_t phdr;
+	uint8_t in[ZLIB_PROBE_SIZE];
+	size_t hdrsize = pcap_get_hdr_length(&phdr, type);
+
+	len = pread(fd, in, sizeof(in), off);
+	if (len <= 0)
+		return false;
+
+	fmemset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK)
+		return false;
+
+	strm.next_in = in;
+	strm.avail_in = len;
+	strm.next_out = &phdr.raw;
+	strm.avail_out = hdrsize;
+
+	ret = inflate(&strm, Z_NO_FLUSH);
+	if ((ret == Z_OK || ret == Z_STREAM_END) && strm.avail_out == 0)
+		ok = pcap_pkthdr_plausible(&phdr, type);
+
+	inflateEnd(&strm);
+
+	return ok;
+}
+
+static off_t pcap_zlib_seek(int fd, enum pcap_type type, off_t start, off_t end)
+{
+	ssize_t len, i;
+	off_t pos;
+	uint8_t buf[64 << 10];
+	const size_t mlen = sizeof(zlib_member_magic);
+
+	zlib_rd_setup(fd);
+	zr.seekable = true;
+
+	for (pos = start; pos < end; pos += len - (mlen - 1)) {
+		len = pread(fd, buf, sizeof(buf), pos);
+		if (len < (ssize_t) mlen)
+			break;
+
+		for (i = 0; i + mlen <= len && pos + i < end; ++i) {
+			if (buf[i] != zlib_member_magic[0] ||
+			    memcmp(buf + i, zlib_member_magic, mlen))
+				continue;
+			if (!zlib_member_ok(fd, pos + i, type))
+				continue;
+
+			zr.off = pos + i;
+			zr.end = end;
+			return zr.off;
+		}
+	}
+
+	zr.off = end;
+	zr.eof = true;
+
+	return end;
+}
+
+static int pcap_zlib_prepare_access(int fd, enum pcap_mode mode, bool jumbo)
+{
+	int i, ret;
+
+	set_ioprio_be();
+
+	/* Reading got ready when pulling the file header */
+	if (mode == PCAP_MODE_RD)
+		return 0;
+
+	fmemset(&zw, 0, sizeof(zw));
+	zw.fd = fd;
+
+	for (i = 0; i < ZLIB_NR_BUFS; ++i) {
+		zw.bufs[i].raw = xmalloc_aligned(ZLIB_BUF_SIZE, PAGE_SIZE);
+		zw.bufs[i].z_size = zlib_z_size(ZLIB_BUF_SIZE);
+		zw.bufs[i].z = xmalloc_aligned(zw.bufs[i].z_size, PAGE_SIZE);
+	}
+
+	pthread_mutex_init(&zw.lock, NULL);
+	pthread_cond_init(&zw.cond, NULL);
+
+	for (i = 0; i < ZLIB_NR_THREADS; ++i) {
+		ret = pthread_create(&zw.trids[i], NULL, zlib_compress_thread,
+				     &zw);
+		if (ret)
+			panic("Cannot create compression thread!\n");
+	}
+
+	return 0;
+}
+
+static void pcap_zlib_prepare_close(int fd, enum pcap_mode mode)
+{
+	int i;
+
+	if (mode == PCAP_MODE_RD) {
+		if (zr.init) {
+			inflateEnd(&zr.strm);
+			xfree(zr.in);
+			xfree(zr.out);
+			zr.init = false;
+		}
+		return;
+	}
+
+	zlib_submit_curr();
+	zlib_wait_idle();
+
+	pthread_mutex_lock(&zw.lock);
+	zw.stop = true;
+	pthread_cond_broadcast(&zw.cond);
+	pthread_mutex_unlock(&zw.lock);
+
+	for (i = 0; i < ZLIB_NR_THREADS; ++i)
+		pthread_join(zw.trids[i], NULL);
+
+	pthread_cond_destroy(&zw.cond);
+	pthread_mutex_destroy(&zw.lock);
+
+	for (i = 0; i < ZLIB_NR_BUFS; ++i) {
+		xfree(zw.bufs[i].raw);
+		xfree(zw.bufs[i].z);
+	}
+}
+
+static void pcap_zlib_print_stats(void)
+{
+	unsigned long long raw = zlib_raw_bytes, z = zlib_z_bytes;
+
+	if (raw == 0 || z == 0)
+		return;
+
+	printf("\r%12llu bytes compressed to %llu, ratio %.2f, %.3f CPU sec per Gbit\n",
+	       raw, z, (double) raw / z,
+	       (zlib_cpu_ns / 1e9) / (raw * 8 / 1e9));
+}
+
+const struct pcap_file_ops pcap_zlib_ops = {
+	.pull_fhdr_pcap = pcap_zlib_pull_fhdr,
+	.push_fhdr_pcap = pcap_zlib_push_fhdr,
+	.prepare_access_pcap = pcap_zlib_prepare_access,
+	.prepare_close_pcap = pcap_zlib_prepare_close,
+	.read_pcap = pcap_zlib_read,
+	.read_pcap_zc = pcap_zlib_read_zc,
+	.seek_pcap = pcap_zlib_seek,
+	.write_pcap = pcap_zlib_write,
+	.rotate_pcap = pcap_zlib_rotate,
+	.fsync_pcap = pcap_zlib_fsync,
+	.print_stats_pcap = pcap_zlib_print_stats,
+};
+
+#endif /* __WITH_ZLIB */
@@ -15,11 +15,13 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <linux/if_packet.h>
 #include <linux/socket.h>
 #include <linux/sockios.h>
 #include <sys/ioctl.h>
 #include <string.h>
+#include <errno.h>
 #include <poll.h>
 #include <sys/poll.h>
 
@@ -29,22 +31,45 @@
 
 #ifndef PACKET_FANOUT
 # define PACKET_FANOUT			18
-# define PACKET_FANOUT_POLICY_HASH	0
-# define PACKET_FANOUT_POLICY_LB	1
-# define PACKET_FANOUT_POLICY_DEFAULT	PACKET_FANOUT_HASH
+# define PACKET_FANOUT_HASH		0
+# define PACKET_FANOUT_LB		1
 #endif
 
+#ifndef PACKET_FANOUT_QM
+# define PACKET_FANOUT_QM		5
+#endif
+
+#define PACKET_FANOUT_POLICY_HASH	PACKET_FANOUT_HASH
+#define PACKET_FANOUT_POLICY_LB		PACKET_FANOUT_LB
+#define PACKET_FANOUT_POLICY_QM		PACKET_FANOUT_QM
+#define PACKET_FANOUT_POLICY_DEFAULT	PACKET_FANOUT_HASH
+
 struct frame_map {
 	struct tpacket2_hdr tp_h __aligned_tpacket;
 	struct sockaddr_ll s_ll __align_tpacket(sizeof(struct tpacket2_hdr));
 };
 
+struct block_desc {
+	uint32_t version;
+	uint32_t offset_to_priv;
+	struct tpacket_hdr_v1 h1;
+};
+
+struct xsk;
+
 struct ring {
 	struct iovec *frames;
 	uint8_t *mm_space;
 	size_t mm_len;
-	struct tpacket_req layout;
 	struct sockaddr_ll s_ll;
+	unsigned int snaplen;
+	bool v3;
+	/* Set if frames come from an AF_XDP socket, see ring_xsk.h */
+	struct xsk *xsk;
+	union {
+		struct tpacket_req layout;
+		struct tpacket_req3 layout3;
+	};
 };
 
 static inline void next_rnd_slot(unsigned int *it, struct ring *ring)
@@ -83,6 +108,11 @@ static inline unsigned int ring_frame_size(struct ring *ring)
 	return ring->layout.tp_frame_size;
 }
 
+static inline size_t ring_layout_size(struct ring *ring)
+{
+	return ring->v3 ? sizeof(ring->layout3) : sizeof(ring->layout);
+}
+
 static inline void tpacket_hdr_clone(struct tpacket2_hdr *thdrd,
 				     struct tpacket2_hdr *thdrs)
 {
@@ -92,6 +122,21 @@ static inline void tpacket_hdr_clone(struct tpacket2_hdr *thdrd,
         thdrd->tp_len = thdrs->tp_len;
 }
 
+static inline void tpacket3_hdr_to_frame_map(struct tpacket3_hdr *thdr,
+					     struct frame_map *fm)
+{
+	struct sockaddr_ll *sll = (void *) ((uint8_t *) thdr +
+					    TPACKET_ALIGN(sizeof(*thdr)));
+
+	fm->tp_h.tp_sec = thdr->tp_sec;
+	fm->tp_h.tp_nsec = thdr->tp_nsec;
+	fm->tp_h.tp_snaplen = thdr->tp_snaplen;
+	fm->tp_h.tp_len = thdr->tp_len;
+	fm->tp_h.tp_mac = thdr->tp_mac;
+
+	fmemcpy(&fm->s_ll, sll, sizeof(fm->s_ll));
+}
+
 #ifndef POLLRDNORM
 # define POLLRDNORM	0x0040
 #endif
@@ -123,7 +168,7 @@ static inline void set_sockopt_fanout(int sock, unsigned int fanout_id,
 		panic("No packet fanout support!\n");
 }
 
-static inline void set_sockopt_tpacket(int sock)
+static inline void set_sockopt_tpacket_v2(int sock)
 {
 	int ret, val = TPACKET_V2;
 
@@ -132,6 +177,27 @@ static inline void set_sockopt_tpacket(int sock)
 		panic("Cannot set tpacketv2!\n");
 }
 
+static inline void set_sockopt_tpacket_v3(int sock)
+{
+	int ret, val = TPACKET_V3;
+
+	ret = setsockopt(sock, SOL_PACKET, PACKET_VERSION, &val, sizeof(val));
+	if (ret)
+		panic("Cannot set tpacketv3!\n");
+}
+
+#ifndef SO_BUSY_POLL
+# define SO_BUSY_POLL		46
+#endif
+
+static inline void set_sockopt_busy_poll(int sock, unsigned int usecs)
+{
+	int ret = setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usecs,
+			     sizeof(usecs));
+	if (ret)
+		printf("Cannot set busy polling: %s\n", strerror(errno));
+}
+
 #ifdef __WITH_HARDWARE_TIMESTAMPING
 # include <linux/net_tstamp.h>
 
@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -22,9 +23,9 @@
 
 void destroy_rx_ring(int sock, struct ring *ring)
 {
-	fmemset(&ring->layout, 0, sizeof(ring->layout));
-	setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &ring->layout,
-		   sizeof(ring->layout));
+	fmemset(&ring->layout3, 0, sizeof(ring->layout3));
+	setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &ring->layout3,
+		   ring_layout_size(ring));
 
 	munmap(ring->mm_space, ring->mm_len);
 	ring->mm_len = 0;
@@ -32,35 +33,79 @@ void destroy_rx_ring(int sock, struct ring *ring)
 	xfree(ring->frames);
 }
 
+/*
+ * Worst case room a frame needs for snaplen bytes of packet: the kernel
+ * puts the network header at an aligned offset of at least 16 bytes past
+ * the tpacket header and the link layer header right before it.
+ */
+static unsigned int rx_frame_size(unsigned int snaplen, bool v3)
+{
+	unsigned int hdrlen = v3 ? TPACKET3_HDRLEN : TPACKET2_HDRLEN;
+
+	return TPACKET_ALIGN(TPACKET_ALIGN(hdrlen + 16) + snaplen);
+}
+
 void setup_rx_ring_layout(int sock, struct ring *ring, unsigned int size,
-			  int jumbo_support)
+			  int jumbo_support, bool v3, unsigned int snaplen)
 {
-	fmemset(&ring->layout, 0, sizeof(ring->layout));
+	unsigned int frame_size;
 
-	ring->layout.tp_block_size = (jumbo_support ?
-				      getpagesize() << 4 :
-				      getpagesize() << 2);
+	fmemset(&ring->layout3, 0, sizeof(ring->layout3));
+
+	ring->v3 = v3;
+	/*
+	 * With TPACKET_V3, packets are packed back to back into a block, so
+	 * frame size is only an upper bound. Larger blocks mean fewer block
+	 * retirements and status word updates per packet.
+	 */
+	if (v3)
+		ring->layout.tp_block_size = (jumbo_support ?
+					      getpagesize() << 8 :
+					      getpagesize() << 6);
+	else
+		ring->layout.tp_block_size = (jumbo_support ?
+					      getpagesize() << 4 :
+					      getpagesize() << 2);
 	ring->layout.tp_frame_size = (jumbo_support ?
 				      TPACKET_ALIGNMENT << 12 :
 				      TPACKET_ALIGNMENT << 7);
+
+	/* Frames only as large as the largest packet that we can get */
+	frame_size = rx_frame_size(snaplen, v3);
+	if (snaplen && frame_size < ring->layout.tp_frame_size) {
+		ring->layout.tp_frame_size = frame_size;
+		ring->snaplen = snaplen;
+	} else {
+		ring->snaplen = ring->layout.tp_frame_size -
+				rx_frame_size(0, v3);
+	}
+
 	ring->layout.tp_block_nr = size / ring->layout.tp_block_size;
 	ring->layout.tp_frame_nr = ring->layout.tp_block_size /
 				   ring->layout.tp_frame_size *
 				   ring->layout.tp_block_nr;
 
 	bug_on(ring->layout.tp_block_size < ring->layout.tp_frame_size);
-	bug_on((ring->layout.tp_block_size % ring->layout.tp_frame_size) != 0);
 	bug_on((ring->layout.tp_block_size % getpagesize()) != 0);
+
+	if (v3) {
+		ring->layout3.tp_retire_blk_tov = RX_BLOCK_TOV_DEFAULT;
+		ring->layout3.tp_sizeof_priv = 0;
+		ring->layout3.tp_feature_req_word = 0;
+	}
 }
 
 void create_rx_ring(int sock, struct ring *ring, int verbose)
 {
 	int ret;
 
-	set_sockopt_tpacket(sock);
+	if (ring->v3)
+		set_sockopt_tpacket_v3(sock);
+	else
+		set_sockopt_tpacket_v2(sock);
 retry:
-	ret = setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &ring->layout,
-			 sizeof(ring->layout));
+	ret = setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &ring->layout3,
+			 ring_layout_size(ring));
 	if (errno == ENOMEM && ring->layout.tp_block_nr > 1) {
 		ring->layout.tp_block_nr >>= 1;
 		ring->layout.tp_frame_nr = ring->layout.tp_block_size / 
@@ -74,10 +119,24 @@ retry:
 
 	ring->mm_len = ring->layout.tp_block_size * ring->layout.tp_block_nr;
 
-	if (verbose) {
+	if (verbose && ring->v3) {
+		printf("RX: %.2Lf MiB, %u Blocks, each %u Byte allocated, "
+		       "%u ms block timeout\n",
+		       (long double) ring->mm_len / (1 << 20),
+		       ring->layout3.tp_block_nr, ring->layout3.tp_block_size,
+		       ring->layout3.tp_retire_blk_tov);
+		/* Packets are packed, smaller ones take less than this */
+		printf("RX: at least %u Frames per MiB at snaplen %u\n",
+		       (1 << 20) / ring->layout.tp_frame_size, ring->snaplen);
+	} else if (verbose) {
 		printf("RX: %.2Lf MiB, %u Frames, each %u Byte allocated\n",
 		       (long double) ring->mm_len / (1 << 20),
 		       ring->layout.tp_frame_nr, ring->layout.tp_frame_size);
+		printf("RX: %u Frames per MiB at snaplen %u\n",
+		       (unsigned int) (((1ULL << 20) / ring->layout.tp_block_size) *
+				       (ring->layout.tp_block_size /
+					ring->layout.tp_frame_size)),
+		       ring->snaplen);
 	}
 }
 
@@ -94,16 +153,64 @@ void mmap_rx_ring(int sock, struct ring *ring)
 void alloc_rx_ring_frames(struct ring *ring)
 {
 	int i;
-	size_t len = ring->layout.tp_frame_nr * sizeof(*ring->frames);
+	unsigned int num = rx_ring_slots(ring), step, per_block;
+	size_t len = num * sizeof(*ring->frames);
+
+	/* In case of TPACKET_V3, we walk the ring block-wise */
+	step = ring->v3 ? ring->layout3.tp_block_size :
+			  ring->layout.tp_frame_size;
+	/* Frames need not fill a block, its tail is left unused then */
+	per_block = ring->layout.tp_block_size / step;
 
 	ring->frames = xmalloc_aligned(len, CO_CACHE_LINE_SIZE);
 	fmemset(ring->frames, 0, len);
 
-	for (i = 0; i < ring->layout.tp_frame_nr; ++i) {
-		ring->frames[i].iov_len = ring->layout.tp_frame_size;
+	for (i = 0; i < num; ++i) {
+		ring->frames[i].iov_len = step;
 		ring->frames[i].iov_base = ring->mm_space +
-					   (i * ring->layout.tp_frame_size);
+				(i / per_block) * ring->layout.tp_block_size +
+				(i % per_block) * step;
+	}
+}
+
+/*
+ * Waits for the kernel to hand over the slot behind status, true if it
+ * did. Otherwise the caller is about to sleep, which is counted as well.
+ * The clock is only read every few rounds, it is slower than a round.
+ * Without a status to watch, as on AF_XDP rings, it sleeps right away.
+ */
+bool rx_ring_spin(struct rx_spin *spin, uint32_t *status)
+{
+	unsigned int i;
+	uint64_t until = 0;
+	struct timespec now;
+
+	if (!status || (spin->num == 0 && spin->usecs == 0))
+		goto sleep;
+
+	if (spin->usecs) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		until = now.tv_sec * 1000000000ULL + now.tv_nsec +
+			spin->usecs * 1000ULL;
+	}
+
+	for (i = 0; spin->usecs || i < spin->num; ++i) {
+		if (__atomic_load_n(status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) {
+			spin->hits++;
+			return true;
+		}
+
+		cpu_relax();
+
+		if (spin->usecs && (i & 63) == 63) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec * 1000000000ULL + now.tv_nsec >= until)
+				break;
+		}
 	}
+sleep:
+	spin->sleeps++;
+	return false;
 }
 
 void bind_rx_ring(int sock, struct ring *ring, int ifindex)
@@ -129,3 +236,46 @@ void bind_rx_ring(int sock, struct ring *ring, int ifindex)
 		panic("Cannot bind RX_RING!\n");
 	}
 }
+
+static bool rx_ring_slot_held(struct ring *ring, unsigned int i)
+{
+	uint32_t status;
+
+	if (ring->v3) {
+		struct block_desc *pbd = ring->frames[i].iov_base;
+
+		status = __atomic_load_n(&pbd->h1.block_status,
+					 __ATOMIC_RELAXED);
+	} else {
+		struct tpacket2_hdr *hdr = ring->frames[i].iov_base;
+
+		status = __atomic_load_n(&hdr->tp_status, __ATOMIC_RELAXED);
+	}
+
+	return (status & TP_STATUS_USER) == TP_STATUS_USER;
+}
+
+/*
+ * Slots filled by the kernel from slot next on, i.e. those user space has
+ * yet to look at. The kernel fills slots in ring order, so they are held
+ * up to some point and free after it, which a binary search finds without
+ * touching every slot of a large ring.
+ */
+unsigned int rx_ring_used(struct ring *ring, unsigned int next)
+{
+	unsigned int lo = 0, hi = rx_ring_slots(ring), mid;
+
+	if (ring->xsk)
+		return xsk_used(ring->xsk, next);
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (rx_ring_slot_held(ring, (next + mid) % rx_ring_slots(ring)))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
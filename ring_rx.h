@@ -9,15 +9,34 @@
 #define RX_RING_H
 
 #include "ring.h"
+#include "ring_xsk.h"
 #include "built_in.h"
 
+/* Retire a partially filled TPACKET_V3 block after 100 ms */
+#define RX_BLOCK_TOV_DEFAULT	100
+
 extern void destroy_rx_ring(int sock, struct ring *ring);
 extern void create_rx_ring(int sock, struct ring *ring, int verbose);
 extern void mmap_rx_ring(int sock, struct ring *ring);
 extern void alloc_rx_ring_frames(struct ring *ring);
 extern void bind_rx_ring(int sock, struct ring *ring, int ifindex);
 extern void setup_rx_ring_layout(int sock, struct ring *ring,
-				 unsigned int size, int jumbo_support);
+				 unsigned int size, int jumbo_support, bool v3,
+				 unsigned int snaplen);
+
+/* Spinning on the next slot for num rounds or usecs before poll(2) */
+struct rx_spin {
+	unsigned int num, usecs;
+	unsigned long hits, sleeps;
+};
+
+extern bool rx_ring_spin(struct rx_spin *spin, uint32_t *status);
+extern unsigned int rx_ring_used(struct ring *ring, unsigned int next);
+
+static inline unsigned int rx_ring_slots(struct ring *ring)
+{
+	return ring->v3 ? ring->layout3.tp_block_nr : ring->layout.tp_frame_nr;
+}
 
 static inline int user_may_pull_from_rx(struct tpacket2_hdr *hdr)
 {
@@ -29,4 +48,124 @@ static inline void kernel_may_pull_from_rx(struct tpacket2_hdr *hdr)
 	hdr->tp_status = TP_STATUS_KERNEL;
 }
 
+/* Frames handed back to the kernel at once, and headers looked ahead */
+#define RX_CONSUMER_BATCH	8
+#define RX_CONSUMER_AHEAD	2
+
+/*
+ * A consumer walks the frames of a TPACKET_V2 ring in order. It prefetches
+ * the headers of the frames ahead and the packet of the current one, and
+ * hands frames back to the kernel in small batches, oldest first, so that
+ * status words are not bounced between CPUs once per packet. Frames still
+ * held must be flushed before sleeping on the ring. On an AF_XDP ring,
+ * indices are those of the frames in the order they came in instead.
+ */
+struct rx_consumer {
+	struct ring *ring;
+	unsigned int head, tail, pending, batch, nr;
+};
+
+static inline unsigned int rx_consumer_step(struct rx_consumer *c,
+					    unsigned int it)
+{
+	return ++it == c->nr ? 0 : it;
+}
+
+static inline void rx_consumer_init(struct rx_consumer *c, struct ring *ring)
+{
+	c->ring = ring;
+	c->head = c->tail = c->pending = 0;
+	c->nr = ring->xsk ? ring->xsk->nr : ring->layout.tp_frame_nr;
+	/* Tiny rings must not have a good share of them held back */
+	c->batch = min(RX_CONSUMER_BATCH, max(c->nr / 4, 1U));
+}
+
+static inline struct frame_map *rx_consumer_frame(struct rx_consumer *c,
+						 unsigned int it)
+{
+	if (c->ring->xsk)
+		return xsk_frame(c->ring->xsk, it);
+
+	return c->ring->frames[it].iov_base;
+}
+
+/* Next frame in the ring, or NULL if the kernel has not filled it yet */
+static inline struct frame_map *rx_consumer_next(struct rx_consumer *c)
+{
+	unsigned int i, it = c->head;
+	struct frame_map *hdr;
+
+	if (c->ring->xsk && c->head == c->ring->xsk->avail &&
+	    !xsk_receive(c->ring->xsk))
+		return NULL;
+
+	hdr = rx_consumer_frame(c, it);
+	if (!user_may_pull_from_rx(&hdr->tp_h))
+		return NULL;
+
+	prefetch_rd((uint8_t *) hdr + hdr->tp_h.tp_mac);
+	for (i = 0; i < RX_CONSUMER_AHEAD; ++i) {
+		it = rx_consumer_step(c, it);
+		prefetch_rd(rx_consumer_frame(c, it));
+	}
+
+	c->head = rx_consumer_step(c, c->head);
+
+	return hdr;
+}
+
+/* Hands back all frames that are done with, in ring order */
+static inline void rx_consumer_flush(struct rx_consumer *c)
+{
+	for (; c->pending > 0; c->pending--) {
+		kernel_may_pull_from_rx(&rx_consumer_frame(c, c->tail)->tp_h);
+		c->tail = rx_consumer_step(c, c->tail);
+	}
+
+	/* Frames handed on may have been given back by now, too */
+	if (c->ring->xsk)
+		xsk_reclaim(c->ring->xsk, c->tail);
+}
+
+/* The frame from the oldest rx_consumer_next() is done with */
+static inline void rx_consumer_release(struct rx_consumer *c)
+{
+	if (++c->pending >= c->batch)
+		rx_consumer_flush(c);
+}
+
+/* The oldest frame is handed on, someone else gives it back */
+static inline void rx_consumer_pass(struct rx_consumer *c)
+{
+	rx_consumer_flush(c);
+	c->tail = rx_consumer_step(c, c->tail);
+}
+
+/* Slot the consumer waits for when the ring ran dry, if it knows it */
+static inline uint32_t *rx_consumer_status(struct rx_consumer *c)
+{
+	struct frame_map *hdr;
+
+	if (c->ring->xsk)
+		return NULL;
+
+	hdr = c->ring->frames[c->head].iov_base;
+
+	return &hdr->tp_h.tp_status;
+}
+
+#define rx_consumer_for_each(hdr, c)					\
+	for ((hdr) = rx_consumer_next(c); (hdr);				\
+	     (hdr) = rx_consumer_next(c))
+
+static inline int user_may_pull_from_rx_block(struct block_desc *pbd)
+{
+	return ((pbd->h1.block_status & TP_STATUS_USER) == TP_STATUS_USER);
+}
+
+static inline void kernel_may_pull_from_rx_block(struct block_desc *pbd)
+{
+	pbd->h1.block_status = TP_STATUS_KERNEL;
+}
+
 #endif /* RX_RING_H */
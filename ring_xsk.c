@@ -0,0 +1,409 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifdef __WITH_XDP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_arp.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include "ring_xsk.h"
+#include "xmalloc.h"
+#include "built_in.h"
+#include "die.h"
+
+#ifndef AF_XDP
+# define AF_XDP			44
+#endif
+#ifndef SOL_XDP
+# define SOL_XDP		283
+#endif
+
+/* Frames are a page each, with our frame_map ahead of the packet */
+#define XSK_FRAME_SIZE		4096
+#define XSK_FRAME_HEADROOM	TPACKET_ALIGN(sizeof(struct frame_map))
+/* Fewer frames than that would leave no room to batch */
+#define XSK_FRAMES_MIN		(2 * XSK_RX_BATCH)
+/* Nothing is sent, the completion ring only has to exist */
+#define XSK_COMP_SIZE		XSK_RX_BATCH
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * Sends packets of queue i to the socket at i in the map, and passes
+ * them on to the stack if there is none. It amounts to
+ *   return bpf_redirect_map(&map, ctx->rx_queue_index, XDP_PASS);
+ */
+void xsk_redirect_create(struct xsk_redirect *r, unsigned int queues)
+{
+	union bpf_attr attr;
+	static const char license[] = "GPL";
+	struct bpf_insn prog[] = {
+		{ .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2,
+		  .src_reg = BPF_REG_1,
+		  .off = offsetof(struct xdp_md, rx_queue_index) },
+		{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1,
+		  .src_reg = BPF_PSEUDO_MAP_FD },
+		{ .code = 0 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3,
+		  .imm = XDP_PASS },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+
+	fmemset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = queues;
+
+	r->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (r->map_fd < 0)
+		panic("Cannot create XDP socket map: %s!\n", strerror(errno));
+
+	prog[1].imm = r->map_fd;
+
+	fmemset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (unsigned long) prog;
+	attr.insn_cnt = array_size(prog);
+	attr.license = (unsigned long) license;
+
+	r->prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (r->prog_fd < 0)
+		panic("Cannot load XDP program: %s!\n", strerror(errno));
+
+	r->link_fd = -1;
+}
+
+void xsk_redirect_add(struct xsk_redirect *r, struct xsk *xsk)
+{
+	union bpf_attr attr;
+	uint32_t key = xsk->queue, fd = xsk->sock;
+
+	fmemset(&attr, 0, sizeof(attr));
+	attr.map_fd = r->map_fd;
+	attr.key = (unsigned long) &key;
+	attr.value = (unsigned long) &fd;
+
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+		panic("Cannot add AF_XDP socket of queue %u: %s!\n", key,
+		      strerror(errno));
+}
+
+/* Generic mode works on any device, the link detaches when we exit */
+void xsk_redirect_attach(struct xsk_redirect *r, int ifindex)
+{
+	union bpf_attr attr;
+
+	fmemset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = r->prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+
+	r->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	if (r->link_fd < 0)
+		panic("Cannot attach XDP program: %s!\n", strerror(errno));
+}
+
+void xsk_redirect_destroy(struct xsk_redirect *r)
+{
+	if (r->link_fd >= 0)
+		close(r->link_fd);
+
+	close(r->prog_fd);
+	close(r->map_fd);
+}
+
+static void xsk_queue_map(struct xsk *xsk, struct xsk_queue *q,
+			  struct xdp_ring_offset *off, unsigned int nr,
+			  size_t entry, off_t pgoff)
+{
+	q->map_len = off->desc + nr * entry;
+	q->map = mmap(NULL, q->map_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, xsk->sock, pgoff);
+	if (q->map == MAP_FAILED)
+		panic("Cannot mmap AF_XDP ring!\n");
+
+	q->producer = q->map + off->producer;
+	q->consumer = q->map + off->consumer;
+	q->descs = q->map + off->desc;
+	q->mask = nr - 1;
+}
+
+static unsigned int xsk_frames(unsigned int size)
+{
+	unsigned int frames = max(size / XSK_FRAME_SIZE, XSK_FRAMES_MIN);
+
+	/* Rings take powers of two, the fill ring holds all frames */
+	while (frames & (frames - 1))
+		frames &= frames - 1;
+
+	return frames;
+}
+
+void create_xsk_ring(struct ring *ring, int ifindex, unsigned int queue,
+		     unsigned int size, unsigned int snaplen, int verbose)
+{
+	int ret;
+	unsigned int i, comp = XSK_COMP_SIZE;
+	uint64_t *fill;
+	struct xsk *xsk = xzmalloc(sizeof(*xsk));
+	struct xdp_umem_reg reg;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	socklen_t len = sizeof(off);
+
+	xsk->ifindex = ifindex;
+	xsk->queue = queue;
+	mutexlock_init(&xsk->stats_lock);
+	xsk->frames = xsk_frames(size);
+	xsk->frame_size = XSK_FRAME_SIZE;
+	xsk->umem_len = (size_t) xsk->frames * xsk->frame_size;
+	/* Copy mode puts XDP_PACKET_HEADROOM ahead of each packet */
+	xsk->snaplen = xsk->frame_size - XSK_FRAME_HEADROOM - 256;
+	if (snaplen)
+		xsk->snaplen = min(xsk->snaplen, snaplen);
+
+	xsk->umem = mmap(NULL, xsk->umem_len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (xsk->umem == MAP_FAILED)
+		panic("Cannot allocate AF_XDP umem!\n");
+
+	xsk->sock = socket(AF_XDP, SOCK_RAW, 0);
+	if (xsk->sock < 0)
+		panic("Cannot create AF_XDP socket: %s!\n", strerror(errno));
+
+	fmemset(&reg, 0, sizeof(reg));
+	reg.addr = (unsigned long) xsk->umem;
+	reg.len = xsk->umem_len;
+	reg.chunk_size = xsk->frame_size;
+	reg.headroom = XSK_FRAME_HEADROOM;
+
+	ret = setsockopt(xsk->sock, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg));
+	if (ret < 0)
+		panic("Cannot register AF_XDP umem: %s!\n", strerror(errno));
+
+	if (setsockopt(xsk->sock, SOL_XDP, XDP_UMEM_FILL_RING, &xsk->frames,
+		       sizeof(xsk->frames)) < 0 ||
+	    setsockopt(xsk->sock, SOL_XDP, XDP_UMEM_COMPLETION_RING, &comp,
+		       sizeof(comp)) < 0 ||
+	    setsockopt(xsk->sock, SOL_XDP, XDP_RX_RING, &xsk->frames,
+		       sizeof(xsk->frames)) < 0)
+		panic("Cannot size AF_XDP rings: %s!\n", strerror(errno));
+
+	if (getsockopt(xsk->sock, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0)
+		panic("Cannot get AF_XDP ring offsets!\n");
+
+	xsk_queue_map(xsk, &xsk->fill, &off.fr, xsk->frames, sizeof(uint64_t),
+		      XDP_UMEM_PGOFF_FILL_RING);
+	xsk_queue_map(xsk, &xsk->comp, &off.cr, comp, sizeof(uint64_t),
+		      XDP_UMEM_PGOFF_COMPLETION_RING);
+	xsk_queue_map(xsk, &xsk->rx, &off.rx, xsk->frames,
+		      sizeof(struct xdp_desc), XDP_PGOFF_RX_RING);
+
+	/* One more than frames, to tell all frames held from none */
+	xsk->nr = xsk->frames + 1;
+	xsk->order = xzmalloc(xsk->nr * sizeof(*xsk->order));
+
+	fill = xsk->fill.descs;
+	for (i = 0; i < xsk->frames; ++i)
+		fill[i] = (uint64_t) i * xsk->frame_size;
+	__atomic_store_n(xsk->fill.producer, xsk->frames, __ATOMIC_RELEASE);
+
+	fmemset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = queue;
+	sxdp.sxdp_flags = XDP_COPY;
+
+	if (bind(xsk->sock, (struct sockaddr *) &sxdp, sizeof(sxdp)) < 0)
+		panic("Cannot bind AF_XDP socket to queue %u: %s!\n", queue,
+		      strerror(errno));
+
+	fmemset(ring, 0, sizeof(*ring));
+	ring->xsk = xsk;
+	ring->mm_space = xsk->umem;
+	ring->mm_len = xsk->umem_len;
+	ring->snaplen = xsk->snaplen;
+	ring->layout.tp_frame_size = xsk->frame_size;
+	ring->layout.tp_frame_nr = xsk->frames;
+
+	if (verbose)
+		printf("XDP: %.2Lf MiB, %u Frames, each %u Byte allocated, "
+		       "snaplen %u\n", (long double) xsk->umem_len / (1 << 20),
+		       xsk->frames, xsk->frame_size, xsk->snaplen);
+}
+
+void destroy_xsk_ring(struct ring *ring)
+{
+	struct xsk *xsk = ring->xsk;
+
+	close(xsk->sock);
+
+	munmap(xsk->rx.map, xsk->rx.map_len);
+	munmap(xsk->comp.map, xsk->comp.map_len);
+	munmap(xsk->fill.map, xsk->fill.map_len);
+	munmap(xsk->umem, xsk->umem_len);
+
+	mutexlock_destroy(&xsk->stats_lock);
+	xfree(xsk->order);
+	xfree(xsk);
+
+	ring->xsk = NULL;
+}
+
+/* The kernel only hands us the packet, the rest is made up here */
+static void xsk_fill_frame_map(struct xsk *xsk, struct frame_map *hdr,
+			       uint64_t base, struct xdp_desc *desc,
+			       struct timespec *ts)
+{
+	uint8_t *packet = xsk->umem + desc->addr;
+	struct sockaddr_ll *sll = &hdr->s_ll;
+
+	hdr->tp_h.tp_len = desc->len;
+	hdr->tp_h.tp_snaplen = min(desc->len, xsk->snaplen);
+	hdr->tp_h.tp_mac = desc->addr - base;
+	hdr->tp_h.tp_net = hdr->tp_h.tp_mac + ETH_HLEN;
+	hdr->tp_h.tp_sec = ts->tv_sec;
+	hdr->tp_h.tp_nsec = ts->tv_nsec;
+	hdr->tp_h.tp_vlan_tci = 0;
+	hdr->tp_h.tp_vlan_tpid = 0;
+
+	sll->sll_family = AF_PACKET;
+	sll->sll_ifindex = xsk->ifindex;
+	sll->sll_hatype = ARPHRD_ETHER;
+	sll->sll_halen = ETH_ALEN;
+	sll->sll_protocol = 0;
+	sll->sll_pkttype = PACKET_HOST;
+
+	if (desc->len >= ETH_HLEN) {
+		fmemcpy(&sll->sll_protocol, packet + 2 * ETH_ALEN,
+			sizeof(sll->sll_protocol));
+		fmemcpy(sll->sll_addr, packet + ETH_ALEN, ETH_ALEN);
+
+		if (packet[0] & 1)
+			sll->sll_pkttype = memcmp(packet, "\xff\xff\xff\xff\xff\xff",
+						  ETH_ALEN) ? PACKET_MULTICAST :
+							      PACKET_BROADCAST;
+	}
+
+	hdr->tp_h.tp_status = TP_STATUS_USER;
+}
+
+/*
+ * Takes a batch of packets off the RX ring and appends their frames to
+ * the order. They all get the time they were taken, AF_XDP has none.
+ */
+unsigned int xsk_receive(struct xsk *xsk)
+{
+	unsigned int i, nr;
+	uint32_t cons = *xsk->rx.consumer;
+	uint32_t prod = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE);
+	struct xdp_desc *descs = xsk->rx.descs, *desc;
+	struct timespec ts;
+	uint64_t base;
+
+	nr = min(prod - cons, (uint32_t) XSK_RX_BATCH);
+	if (nr == 0)
+		return 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	for (i = 0; i < nr; ++i) {
+		desc = &descs[(cons + i) & xsk->rx.mask];
+		base = desc->addr & ~((uint64_t) xsk->frame_size - 1);
+
+		xsk_fill_frame_map(xsk, (void *) (xsk->umem + base), base,
+				   desc, &ts);
+
+		xsk->order[xsk->avail] = base;
+		xsk->avail = xsk->avail + 1 == xsk->nr ? 0 : xsk->avail + 1;
+	}
+
+	__atomic_store_n(xsk->rx.consumer, cons + nr, __ATOMIC_RELEASE);
+	__atomic_store_n(&xsk->packets, xsk->packets + nr, __ATOMIC_RELAXED);
+
+	return nr;
+}
+
+/* Frames up to tail that were given back go on the fill ring, in order */
+void xsk_reclaim(struct xsk *xsk, unsigned int tail)
+{
+	unsigned int nr = 0;
+	uint32_t prod = *xsk->fill.producer;
+	uint64_t *fill = xsk->fill.descs;
+	struct frame_map *hdr;
+
+	while (xsk->reclaim != tail) {
+		hdr = xsk_frame(xsk, xsk->reclaim);
+		if (__atomic_load_n(&hdr->tp_h.tp_status, __ATOMIC_ACQUIRE) !=
+		    TP_STATUS_KERNEL)
+			break;
+
+		fill[(prod + nr++) & xsk->fill.mask] = xsk->order[xsk->reclaim];
+		xsk->reclaim = xsk->reclaim + 1 == xsk->nr ? 0 :
+			       xsk->reclaim + 1;
+	}
+
+	if (nr)
+		__atomic_store_n(xsk->fill.producer, prod + nr,
+				 __ATOMIC_RELEASE);
+}
+
+/* Packets on the RX ring, and those taken off it from next on */
+unsigned int xsk_used(struct xsk *xsk, unsigned int next)
+{
+	uint32_t prod = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE);
+	uint32_t cons = __atomic_load_n(xsk->rx.consumer, __ATOMIC_ACQUIRE);
+	unsigned int avail = __atomic_load_n(&xsk->avail, __ATOMIC_RELAXED);
+
+	return prod - cons + (avail + xsk->nr - next) % xsk->nr;
+}
+
+/* Like PACKET_STATISTICS, counts since the last call, drops included */
+void xsk_stats(struct xsk *xsk, struct tpacket_stats *kstats)
+{
+	struct xdp_statistics stats;
+	socklen_t len = sizeof(stats);
+	unsigned long packets, drops;
+
+	fmemset(kstats, 0, sizeof(*kstats));
+
+	mutexlock_lock(&xsk->stats_lock);
+
+	if (getsockopt(xsk->sock, SOL_XDP, XDP_STATISTICS, &stats, &len) < 0)
+		goto out;
+
+	packets = __atomic_load_n(&xsk->packets, __ATOMIC_RELAXED);
+	drops = stats.rx_dropped + stats.rx_ring_full;
+
+	kstats->tp_drops = drops - xsk->last_drops;
+	kstats->tp_packets = packets - xsk->last_packets + kstats->tp_drops;
+
+	xsk->last_packets = packets;
+	xsk->last_drops = drops;
+out:
+	mutexlock_unlock(&xsk->stats_lock);
+}
+
+#endif /* __WITH_XDP */
@@ -0,0 +1,134 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef XSK_RING_H
+#define XSK_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/if_packet.h>
+
+#include "ring.h"
+#include "locking.h"
+#include "built_in.h"
+#include "die.h"
+
+/*
+ * An AF_XDP socket bound to one queue of a device. An XDP program in
+ * generic mode redirects packets of that queue into it, which the kernel
+ * copies into frames of our umem and reports on the RX ring. Frames start
+ * with a frame_map that is filled in on receive, so that the consumer of
+ * ring_rx.h hands them out just like TPACKET_V2 frames. Frames come back
+ * once their status is TP_STATUS_KERNEL again, in the order they came in.
+ */
+
+/* Frames are read off the RX ring this many at a time */
+#define XSK_RX_BATCH		64
+
+struct xsk_queue {
+	uint32_t *producer, *consumer;
+	void *descs;
+	uint32_t mask;
+	void *map;
+	size_t map_len;
+};
+
+struct xsk {
+	int sock, ifindex;
+	unsigned int queue, frames, frame_size;
+	uint8_t *umem;
+	size_t umem_len;
+	struct xsk_queue fill, comp, rx;
+	/* Frame offsets in the order they came in, see rx_consumer */
+	uint64_t *order;
+	unsigned int nr, avail, reclaim;
+	uint32_t snaplen;
+	unsigned long packets;
+	/* Counters at the last xsk_stats(), which several threads call */
+	struct mutexlock stats_lock;
+	unsigned long last_packets, last_drops;
+};
+
+/* The XDP program and socket map shared by the sockets of a device */
+struct xsk_redirect {
+	int map_fd, prog_fd, link_fd;
+};
+
+#ifdef __WITH_XDP
+extern void xsk_redirect_create(struct xsk_redirect *r, unsigned int queues);
+extern void xsk_redirect_add(struct xsk_redirect *r, struct xsk *xsk);
+extern void xsk_redirect_attach(struct xsk_redirect *r, int ifindex);
+extern void xsk_redirect_destroy(struct xsk_redirect *r);
+extern void create_xsk_ring(struct ring *ring, int ifindex, unsigned int queue,
+			    unsigned int size, unsigned int snaplen,
+			    int verbose);
+extern void destroy_xsk_ring(struct ring *ring);
+extern unsigned int xsk_receive(struct xsk *xsk);
+extern void xsk_reclaim(struct xsk *xsk, unsigned int tail);
+extern unsigned int xsk_used(struct xsk *xsk, unsigned int next);
+extern void xsk_stats(struct xsk *xsk, struct tpacket_stats *kstats);
+#else
+static inline void xsk_redirect_create(struct xsk_redirect *r,
+				       unsigned int queues)
+{
+	panic("No AF_XDP support compiled in!\n");
+}
+
+static inline void xsk_redirect_add(struct xsk_redirect *r, struct xsk *xsk)
+{
+	bug();
+}
+
+static inline void xsk_redirect_attach(struct xsk_redirect *r, int ifindex)
+{
+	bug();
+}
+
+static inline void xsk_redirect_destroy(struct xsk_redirect *r)
+{
+	bug();
+}
+
+static inline void create_xsk_ring(struct ring *ring, int ifindex,
+				   unsigned int queue, unsigned int size,
+				   unsigned int snaplen, int verbose)
+{
+	bug();
+}
+
+static inline void destroy_xsk_ring(struct ring *ring)
+{
+	bug();
+}
+
+static inline unsigned int xsk_receive(struct xsk *xsk)
+{
+	bug();
+	return 0;
+}
+
+static inline void xsk_reclaim(struct xsk *xsk, unsigned int tail)
+{
+	bug();
+}
+
+static inline unsigned int xsk_used(struct xsk *xsk, unsigned int next)
+{
+	bug();
+	return 0;
+}
+
+static inline void xsk_stats(struct xsk *xsk, struct tpacket_stats *kstats)
+{
+	bug();
+}
+#endif /* __WITH_XDP */
+
+static inline struct frame_map *xsk_frame(struct xsk *xsk, unsigned int i)
+{
+	return (struct frame_map *) (xsk->umem + xsk->order[i]);
+}
+
+#endif /* XSK_RING_H */
@@ -0,0 +1,153 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <linux/if_packet.h>
+
+#include "shm_ring.h"
+#include "locking.h"
+#include "built_in.h"
+#include "xmalloc.h"
+#include "xio.h"
+#include "die.h"
+
+struct shm_ring {
+	struct shm_ring_page *page;
+	uint8_t *data;
+	uint64_t size, head, tail;
+	unsigned long packets, overwritten;
+	/* Workers publish into the same ring */
+	struct spinlock lock;
+};
+
+struct shm_ring *shm_ring_create(const char *path, size_t size)
+{
+	int fd;
+	struct shm_ring *ring;
+
+	bug_on(size & (size - 1));
+
+	fd = open_or_die_m(path, O_RDWR | O_CREAT | O_TRUNC, DEFFILEMODE);
+	if (ftruncate(fd, SHM_RING_DATA + size) < 0)
+		panic("Cannot size shared memory ring %s!\n", path);
+
+	ring = xzmalloc(sizeof(*ring));
+	ring->page = mmap(NULL, SHM_RING_DATA + size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, fd, 0);
+	if (ring->page == MAP_FAILED)
+		panic("Cannot mmap shared memory ring %s!\n", path);
+
+	close(fd);
+
+	ring->data = (uint8_t *) ring->page + SHM_RING_DATA;
+	ring->size = size;
+	if (spinlock_init(&ring->lock))
+		panic("Cannot init shared memory ring lock!\n");
+
+	ring->page->version = SHM_RING_VERSION;
+	ring->page->pid = getpid();
+	ring->page->size = size;
+	/* Consumers only trust the page once the magic is in */
+	__atomic_store_n(&ring->page->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+	return ring;
+}
+
+/* The file stays behind, consumers can tell by pid that nothing follows */
+void shm_ring_destroy(struct shm_ring *ring)
+{
+	munmap(ring->page, SHM_RING_DATA + ring->size);
+	spinlock_destroy(&ring->lock);
+	xfree(ring);
+}
+
+/* Moves the tail past the oldest records until end fits into the ring */
+static void shm_ring_make_room(struct shm_ring *ring, uint64_t end)
+{
+	uint64_t off, room;
+	struct shm_ring_rec *rec;
+
+	while (end - ring->tail > ring->size) {
+		off = ring->tail & (ring->size - 1);
+		room = ring->size - off;
+
+		if (room < sizeof(*rec)) {
+			ring->tail += room;
+			continue;
+		}
+
+		rec = (struct shm_ring_rec *) (ring->data + off);
+		if (!(rec->flags & SHM_RING_REC_PAD))
+			ring->overwritten++;
+		ring->tail += rec->len;
+	}
+}
+
+void shm_ring_publish(struct shm_ring *ring, const struct tpacket2_hdr *hdr,
+		      const struct sockaddr_ll *sll, const uint8_t *packet)
+{
+	uint32_t len = shm_ring_rec_len(hdr->tp_snaplen);
+	uint64_t off, room, tail;
+	struct shm_ring_rec *rec;
+
+	spinlock_lock(&ring->lock);
+
+	off = ring->head & (ring->size - 1);
+	room = ring->size - off;
+	/* Records do not wrap, the rest of the ring is skipped instead */
+	if (room >= len)
+		room = 0;
+
+	tail = ring->tail;
+	shm_ring_make_room(ring, ring->head + room + len);
+	if (ring->tail != tail) {
+		__atomic_store_n(&ring->page->tail, ring->tail, __ATOMIC_RELAXED);
+		/* ... before any of the records behind it are overwritten */
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+
+	if (room >= sizeof(*rec)) {
+		rec = (struct shm_ring_rec *) (ring->data + off);
+		fmemset(rec, 0, sizeof(*rec));
+		rec->len = room;
+		rec->flags = SHM_RING_REC_PAD;
+	}
+
+	ring->head += room;
+	rec = (struct shm_ring_rec *) (ring->data + (ring->head & (ring->size - 1)));
+
+	rec->len = len;
+	rec->caplen = hdr->tp_snaplen;
+	rec->wirelen = hdr->tp_len;
+	rec->ifindex = sll->sll_ifindex;
+	rec->seq = ++ring->packets;
+	rec->sec = hdr->tp_sec;
+	rec->nsec = hdr->tp_nsec;
+	rec->protocol = sll->sll_protocol;
+	rec->pkttype = sll->sll_pkttype;
+	rec->flags = 0;
+	rec->__pad = 0;
+	fmemcpy(rec->data, packet, hdr->tp_snaplen);
+
+	ring->head += len;
+	__atomic_store_n(&ring->page->packets, ring->packets, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->page->head, ring->head, __ATOMIC_RELEASE);
+
+	spinlock_unlock(&ring->lock);
+}
+
+void shm_ring_stats(struct shm_ring *ring, unsigned long *packets,
+		    unsigned long *overwritten)
+{
+	*packets = ring->packets;
+	*overwritten = ring->overwritten;
+}
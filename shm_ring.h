@@ -0,0 +1,194 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+ * A shared memory ring is a file that a capture maps shared and appends
+ * the packets it reads to, so that any number of local processes can look
+ * at them without a socket of their own. The producer never waits for
+ * anyone: once the ring is full, it overwrites the oldest records, and
+ * consumers that fell that far behind skip ahead and count the packets
+ * they missed. Consumers map the file read-only and each keep their own
+ * position, see shm_ring_attach() and shm_ring_next(). Fields are in host
+ * byte order. This header can be used on its own by consumers.
+ */
+
+#define SHM_RING_MAGIC		0x4e535252	/* "NSRR" */
+#define SHM_RING_VERSION	1
+/* Records start after the page header, which has a page of its own */
+#define SHM_RING_DATA		4096
+#define SHM_RING_ALIGN		8
+
+/* Fills the end of the ring when the next record does not fit */
+#define SHM_RING_REC_PAD	(1 << 0)
+
+struct shm_ring_rec {
+	/* Bytes from this record to the next one */
+	uint32_t len;
+	uint32_t caplen, wirelen, ifindex;
+	/* Number of the record, counting from 1 */
+	uint64_t seq;
+	uint32_t sec, nsec;
+	/* As in struct sockaddr_ll, protocol in network byte order */
+	uint16_t protocol;
+	uint8_t pkttype, flags;
+	uint32_t __pad;
+	uint8_t data[0];
+};
+
+struct shm_ring_page {
+	uint32_t magic;
+	uint16_t version, __pad;
+	uint32_t pid;
+	/* Bytes of records, a power of two */
+	uint64_t size;
+	/* Positions only ever grow, offsets are position & (size - 1) */
+	uint64_t head __attribute__((aligned(64)));
+	/* Records from tail up to head are intact */
+	uint64_t tail;
+	uint64_t packets;
+};
+
+struct shm_ring_reader {
+	const struct shm_ring_page *page;
+	const uint8_t *data;
+	size_t map_len;
+	uint64_t pos, seq;
+	/* Packets read, and those overwritten before they could be */
+	uint64_t packets, drops;
+};
+
+static inline uint32_t shm_ring_rec_len(uint32_t caplen)
+{
+	return (sizeof(struct shm_ring_rec) + caplen + SHM_RING_ALIGN - 1) &
+	       ~(SHM_RING_ALIGN - 1);
+}
+
+/* Starts reading at the packet published next. Returns 0 or -errno */
+static inline int shm_ring_attach(struct shm_ring_reader *rd, const char *path)
+{
+	int fd, ret = 0;
+	struct stat st;
+	void *map;
+
+	memset(rd, 0, sizeof(*rd));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0 || st.st_size < SHM_RING_DATA) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		goto out;
+	}
+
+	rd->page = map;
+	rd->data = (const uint8_t *) map + SHM_RING_DATA;
+	rd->map_len = st.st_size;
+
+	if (__atomic_load_n(&rd->page->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC ||
+	    rd->page->version != SHM_RING_VERSION ||
+	    SHM_RING_DATA + rd->page->size != (uint64_t) st.st_size) {
+		munmap(map, st.st_size);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	rd->pos = __atomic_load_n(&rd->page->head, __ATOMIC_ACQUIRE);
+out:
+	close(fd);
+	return ret;
+}
+
+static inline void shm_ring_detach(struct shm_ring_reader *rd)
+{
+	munmap((void *) rd->page, rd->map_len);
+}
+
+/*
+ * Copies the next packet into buf, up to len bytes of it, and its record
+ * header into rec. Returns 1, or 0 if there is no new packet yet. A record
+ * is only good if it was not overwritten while it was copied, which the
+ * tail tells afterwards, as the producer moves it on before overwriting.
+ */
+static inline int shm_ring_next(struct shm_ring_reader *rd,
+				struct shm_ring_rec *rec, uint8_t *buf,
+				size_t len)
+{
+	const struct shm_ring_page *page = rd->page;
+	const struct shm_ring_rec *r;
+	uint64_t head, tail, off, room, n;
+
+	while (1) {
+		head = __atomic_load_n(&page->head, __ATOMIC_ACQUIRE);
+		if (rd->pos == head)
+			return 0;
+
+		tail = __atomic_load_n(&page->tail, __ATOMIC_ACQUIRE);
+		if (rd->pos < tail)
+			rd->pos = tail;
+
+		off = rd->pos & (page->size - 1);
+		room = page->size - off;
+		/* Records never start where their header does not fit */
+		if (room < sizeof(*r)) {
+			rd->pos += room;
+			continue;
+		}
+
+		r = (const struct shm_ring_rec *) (rd->data + off);
+		memcpy(rec, r, sizeof(*rec));
+		if (!(rec->flags & SHM_RING_REC_PAD)) {
+			n = len < rec->caplen ? len : rec->caplen;
+			room -= sizeof(*r);
+			memcpy(buf, r->data, n < room ? n : room);
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->tail, __ATOMIC_RELAXED) > rd->pos)
+			continue;
+
+		rd->pos += rec->len;
+		if (rec->flags & SHM_RING_REC_PAD)
+			continue;
+
+		if (rd->seq && rec->seq > rd->seq)
+			rd->drops += rec->seq - rd->seq;
+		rd->seq = rec->seq + 1;
+		rd->packets++;
+
+		return 1;
+	}
+}
+
+struct shm_ring;
+struct tpacket2_hdr;
+struct sockaddr_ll;
+
+extern struct shm_ring *shm_ring_create(const char *path, size_t size);
+extern void shm_ring_destroy(struct shm_ring *ring);
+extern void shm_ring_publish(struct shm_ring *ring,
+			     const struct tpacket2_hdr *hdr,
+			     const struct sockaddr_ll *sll,
+			     const uint8_t *packet);
+extern void shm_ring_stats(struct shm_ring *ring, unsigned long *packets,
+			   unsigned long *overwritten);
+
+#endif /* SHM_RING_H */
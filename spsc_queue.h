@@ -0,0 +1,96 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdbool.h>
+
+#include "built_in.h"
+#include "xmalloc.h"
+
+/*
+ * Lock-free single producer, single consumer queue. The producer only
+ * ever writes head, the consumer only ever writes tail. The consumer
+ * peeks at an element and pops it once it is done with it, so elements
+ * may reference memory that the producer must not reuse until then.
+ */
+
+struct spsc_elem {
+	void *ptr;
+	unsigned long val;
+};
+
+struct spsc_queue {
+	struct spsc_elem *elems;
+	unsigned int size;
+	unsigned int head __cacheline_aligned;
+	unsigned int tail __cacheline_aligned;
+};
+
+static inline void spsc_queue_init(struct spsc_queue *q, unsigned int capacity)
+{
+	/* One element is kept free to tell a full from an empty queue */
+	q->size = capacity + 1;
+	q->elems = xzmalloc_aligned(q->size * sizeof(*q->elems),
+				    CO_CACHE_LINE_SIZE);
+	q->head = q->tail = 0;
+}
+
+static inline void spsc_queue_destroy(struct spsc_queue *q)
+{
+	xfree(q->elems);
+}
+
+static inline unsigned int spsc_queue_next(struct spsc_queue *q,
+					   unsigned int idx)
+{
+	return ++idx == q->size ? 0 : idx;
+}
+
+static inline unsigned int spsc_queue_used(struct spsc_queue *q)
+{
+	unsigned int head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	unsigned int tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+	return head >= tail ? head - tail : q->size - tail + head;
+}
+
+static inline bool spsc_queue_full(struct spsc_queue *q)
+{
+	return spsc_queue_next(q, q->head) ==
+	       __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline bool spsc_queue_push(struct spsc_queue *q, void *ptr,
+				   unsigned long val)
+{
+	unsigned int next = spsc_queue_next(q, q->head);
+
+	if (unlikely(next == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)))
+		return false;
+
+	q->elems[q->head].ptr = ptr;
+	q->elems[q->head].val = val;
+
+	__atomic_store_n(&q->head, next, __ATOMIC_RELEASE);
+	return true;
+}
+
+static inline struct spsc_elem *spsc_queue_peek(struct spsc_queue *q)
+{
+	if (q->tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &q->elems[q->tail];
+}
+
+static inline void spsc_queue_pop(struct spsc_queue *q)
+{
+	__atomic_store_n(&q->tail, spsc_queue_next(q, q->tail),
+			 __ATOMIC_RELEASE);
+}
+
+#endif /* SPSC_QUEUE_H */
@@ -0,0 +1,49 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "telemetry.h"
+#include "xio.h"
+#include "xutils.h"
+#include "die.h"
+
+struct telemetry_page *telemetry_create(const char *path, unsigned int workers)
+{
+	int fd;
+	size_t size = telemetry_page_size(workers);
+	struct telemetry_page *page;
+
+	fd = open_or_die_m(path, O_RDWR | O_CREAT | O_TRUNC, DEFFILEMODE);
+	if (ftruncate(fd, size) < 0)
+		panic("Cannot size telemetry page %s!\n", path);
+
+	page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED)
+		panic("Cannot mmap telemetry page %s!\n", path);
+
+	close(fd);
+
+	page->version = TELEMETRY_VERSION;
+	page->workers = workers;
+	page->pid = getpid();
+	/* Pollers only trust the page once the magic is in */
+	__atomic_store_n(&page->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+
+	return page;
+}
+
+/* The page stays behind with the last sample, pollers can tell by pid */
+void telemetry_destroy(struct telemetry_page *page)
+{
+	munmap(page, telemetry_page_size(page->workers));
+}
@@ -0,0 +1,98 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A telemetry page is a file that a capture maps shared and refreshes
+ * once a second, one slot per worker. Pollers map it read-only and take
+ * a copy with telemetry_snapshot(), which retries while an update is in
+ * progress, so neither side ever waits for the other. Fields are in host
+ * byte order. This header can be used on its own by pollers.
+ */
+
+#define TELEMETRY_MAGIC		0x4e53544d	/* "NSTM" */
+#define TELEMETRY_VERSION	1
+/* Bucket 0 counts ages below 1us, bucket i those below 2^i us */
+#define TELEMETRY_AGE_BUCKETS	24
+
+struct telemetry_worker {
+	/* Since the start of the capture */
+	uint64_t packets, bytes, drops, freezes;
+	/* Over the last interval */
+	uint64_t pps, bps, drops_ps;
+	/* Ring slots filled, but not yet processed or written */
+	uint32_t ring_slots, ring_used;
+	/* Slots queued to a writer thread, and the age of its last one */
+	uint32_t writer_queued, writer_lag_us;
+	/* Age of sampled packets when they were processed, last interval */
+	uint64_t age[TELEMETRY_AGE_BUCKETS];
+};
+
+struct telemetry_page {
+	uint32_t magic;
+	uint16_t version, workers;
+	/* Odd while an update is in progress */
+	uint32_t seq;
+	uint32_t pid;
+	uint64_t time_ns, interval_ns;
+	struct telemetry_worker worker[0];
+};
+
+static inline size_t telemetry_page_size(unsigned int workers)
+{
+	return sizeof(struct telemetry_page) +
+	       workers * sizeof(struct telemetry_worker);
+}
+
+static inline void telemetry_update_begin(struct telemetry_page *page)
+{
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void telemetry_update_end(struct telemetry_page *page)
+{
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Copies a consistent state of the page into buf of len bytes */
+static inline void telemetry_snapshot(const struct telemetry_page *page,
+				      void *buf, size_t len)
+{
+	uint32_t seq;
+
+	do {
+		while ((seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		memcpy(buf, page, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq);
+}
+
+extern struct telemetry_page *telemetry_create(const char *path,
+					       unsigned int workers);
+extern void telemetry_destroy(struct telemetry_page *page);
+
+/* Bucket of an age in ns */
+static inline unsigned int telemetry_age_bucket(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	unsigned int bucket;
+
+	if (us == 0)
+		return 0;
+
+	bucket = 64 - __builtin_clzll(us);
+
+	return bucket < TELEMETRY_AGE_BUCKETS ? bucket :
+	       TELEMETRY_AGE_BUCKETS - 1;
+}
+
+#endif /* TELEMETRY_H */
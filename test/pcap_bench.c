@@ -0,0 +1,121 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ *
+ * Write throughput of the pcap file backends, driven through the same
+ * pcap_file_ops calls as a dump: file header, prepare_access, write_pcap
+ * per record, then fsync and prepare_close. Build and run it with
+ * pcap_bench.sh from this directory.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+
+#include "pcap.h"
+#include "xmalloc.h"
+#include "die.h"
+
+/* The stream backend looks at it */
+volatile sig_atomic_t sigint = 0;
+
+static const enum pcap_ops_groups groups[] = {
+	PCAP_OPS_RW,
+	PCAP_OPS_SG,
+	PCAP_OPS_MM,
+#ifdef __WITH_IO_URING
+	PCAP_OPS_URING,
+#endif
+	PCAP_OPS_DIRECT,
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(const struct pcap_file_ops *ops, const char *file,
+		    unsigned long num, size_t len, const uint8_t *packet)
+{
+	int fd, ret;
+	unsigned long i;
+	ssize_t written;
+	double start;
+	pcap_pkthdr_t phdr;
+
+	fd = open(file, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+	if (fd < 0)
+		panic("Cannot open %s!\n", file);
+
+	ops->push_fhdr_pcap(fd, ORIGINAL_TCPDUMP_MAGIC, LINKTYPE_EN10MB);
+	if (ops->prepare_access_pcap) {
+		ret = ops->prepare_access_pcap(fd, PCAP_MODE_WR, false);
+		if (ret)
+			panic("Cannot prepare %s!\n", file);
+	}
+
+	fmemset(&phdr, 0, sizeof(phdr));
+
+	start = now();
+
+	for (i = 0; i < num; ++i) {
+		phdr.ppo.ts.tv_sec = i / 1000000;
+		phdr.ppo.ts.tv_usec = i % 1000000;
+		phdr.ppo.caplen = phdr.ppo.len = len;
+
+		written = ops->write_pcap(fd, &phdr, DEFAULT, packet, len);
+		if (written != (ssize_t) (sizeof(phdr.ppo) + len))
+			panic("Short write to %s!\n", file);
+	}
+
+	if (ops->fsync_pcap)
+		ops->fsync_pcap(fd);
+	if (ops->prepare_close_pcap)
+		ops->prepare_close_pcap(fd, PCAP_MODE_WR);
+
+	fdatasync(fd);
+	close(fd);
+
+	return (now() - start) * 1e9 / num;
+}
+
+int main(int argc, char **argv)
+{
+	const char *file = argc > 1 ? argv[1] : "pcap_bench.pcap";
+	unsigned long num = argc > 2 ? strtoul(argv[2], NULL, 0) : 1000000;
+	static const size_t lens[] = { 64, 1500 };
+	uint8_t *packet;
+	unsigned int i, j;
+
+	packet = xzmalloc(lens[1]);
+
+	printf("%-8s", "ns/pkt");
+	for (j = 0; j < array_size(lens); ++j)
+		printf("%10zuB", lens[j]);
+	printf("\n");
+
+	for (i = 0; i < array_size(groups); ++i) {
+		printf("%-8s", pcap_ops_group_to_str[groups[i]]);
+		for (j = 0; j < array_size(lens); ++j) {
+			printf("%11.1f", bench(pcap_ops[groups[i]], file, num,
+					       lens[j], packet));
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+
+	unlink(file);
+	xfree(packet);
+
+	return 0;
+}
@@ -0,0 +1,28 @@
+#!/usr/bin/env bash
+
+# Builds pcap_bench from the pcap backends of the source tree and runs it.
+# Usage: pcap_bench.sh [file on the file system to test] [records per run]
+# The file is written over and removed again, one run per backend and size.
+
+set -eu
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+bin=$(mktemp /tmp/pcap_bench.XXXXXX)
+trap 'rm -f "$bin"' EXIT
+
+cflags='-std=gnu99 -O2 -D_REENTRANT -D_FILE_OFFSET_BITS=64 -D_LARGEFILE_SOURCE -D_LARGEFILE64_SOURCE'
+libs='-lpthread'
+
+if [ -e /usr/include/linux/io_uring.h ] ; then
+	cflags="$cflags -D__WITH_IO_URING"
+fi
+if [ -e /usr/include/zlib.h ] ; then
+	cflags="$cflags -D__WITH_ZLIB"
+	libs="$libs -lz"
+fi
+
+gcc $cflags -I"$top" -o "$bin" "$top/test/pcap_bench.c" \
+	"$top"/pcap_{rw,sg,mm,uring,dio,pipe,stream,zlib}.c \
+	"$top"/{xio,xutils,xmalloc}.c $libs
+
+"$bin" "$@"
@@ -0,0 +1,130 @@
+#!/usr/bin/env bash
+
+# Note: build and _install_ the toolkit first! Needs root.
+#
+# An agent on lo streams UDP test traffic to a collector on 127.0.0.1,
+# plain and with -Z, and the collected pcap has to be the same as a direct
+# capture of that traffic. Then a collector has to get over an agent that
+# sends a broken pcap header and still take the next one. Set KEEP to
+# keep the pcaps and logs in the temporary directory.
+
+set -u
+
+netsniff_ng=${NETSNIFF_NG:-netsniff-ng}
+port=${PORT:-5077}
+udp_port=$((port + 1))
+count=1000
+failed=0
+dir=$(mktemp -d)
+
+trap 'kill $(jobs -p) 2> /dev/null; [ -n "${KEEP:-}" ] || rm -rf "$dir"' EXIT
+
+# Only the test traffic, not the stream to the collector on the same lo
+cat > "$dir/udp.bpf" << EOF
+{ 0x28, 0, 0, 0x0000000c },
+{ 0x15, 0, 5, 0x00000800 },
+{ 0x30, 0, 0, 0x00000017 },
+{ 0x15, 0, 3, 0x00000011 },
+{ 0x28, 0, 0, 0x00000024 },
+{ 0x15, 0, 1, $(printf '0x%08x' $udp_port) },
+{ 0x6, 0, 0, 0xffffffff },
+{ 0x6, 0, 0, 0x00000000 },
+EOF
+
+send_traffic()
+{
+	local i
+
+	for i in $(seq $count) ; do
+		printf 'netsniff-ng stream test %05d' $i > /dev/udp/127.0.0.1/$udp_port
+	done 2> /dev/null
+}
+
+start_agent()
+{
+	$netsniff_ng -i lo -f "$dir/udp.bpf" --stream 127.0.0.1:$port "$@" \
+		-s > "$dir/agent.log" 2>&1 &
+	agent=$!
+}
+
+fail()
+{
+	echo "FAIL: $1"
+	let failed=failed+1
+}
+
+for opts in '' '-Z' ; do
+	rm -f "$dir/collected.pcap" "$dir/direct.pcap"
+
+	$netsniff_ng --collect 127.0.0.1:$port -o "$dir/collected.pcap" -s \
+		> "$dir/collect.log" 2>&1 &
+	collector=$!
+	sleep 1
+
+	$netsniff_ng -i lo -f "$dir/udp.bpf" -o "$dir/direct.pcap" -s \
+		> "$dir/direct.log" 2>&1 &
+	direct=$!
+	start_agent $opts
+	sleep 1
+
+	send_traffic
+	sleep 1
+
+	kill -INT $agent $direct
+	wait $agent $direct
+	# Done once its agent hung up
+	wait $collector
+
+	# Each socket stamps packets itself, so compare all but the times
+	for pcap in direct collected ; do
+		$netsniff_ng -i "$dir/$pcap.pcap" -o "$dir/$pcap.txf" -s \
+			> /dev/null 2>&1
+	done
+
+	packets=$(grep -c '^{' "$dir/collected.txf")
+	if [ "$packets" -lt $count ] ||
+	   ! cmp -s -n 24 "$dir/direct.pcap" "$dir/collected.pcap" ||
+	   ! cmp -s "$dir/direct.txf" "$dir/collected.txf" ; then
+		fail "collected pcap differs from direct capture (${opts:-plain})"
+	else
+		echo "ok: collected $packets packets as captured (${opts:-plain})"
+	fi
+done
+
+mkdir "$dir/agents"
+$netsniff_ng --collect 127.0.0.1:$port -o "$dir/agents" -s \
+	> "$dir/collect.log" 2>&1 &
+collector=$!
+sleep 1
+
+# Stream header of a file header message, then a file header with bad magic
+exec 3<> /dev/tcp/127.0.0.1/$port
+printf '\x4e\x53\x53\x54\x01\x01\x00\x00\x00\x00\x00\x18\x00\x00\x00\x18' >&3
+printf '\xef\xbe\xad\xde\x02\x00\x04\x00\x00\x00\x00\x00\x00\x00\x00\x00' >&3
+printf '\xff\xff\x00\x00\x01\x00\x00\x00' >&3
+exec 3>&-
+sleep 1
+
+start_agent
+sleep 1
+send_traffic
+sleep 1
+kill -INT $agent
+wait $agent
+sleep 1
+
+if ! kill -0 $collector 2> /dev/null ; then
+	fail "collector died on a broken pcap header"
+else
+	kill -INT $collector
+	wait $collector
+
+	files=$(ls "$dir/agents" | wc -l)
+	if [ "$files" -ne 1 ] || [ $(cat "$dir"/agents/* | wc -c) -le 24 ] ; then
+		fail "collector did not take the agent after a broken one"
+	else
+		echo "ok: collector survived a broken pcap header"
+	fi
+fi
+
+exit $failed
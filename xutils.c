@@ -32,6 +32,7 @@
 #include <sys/resource.h>
 #include <sys/epoll.h>
 #include <sys/syscall.h>
+#include <dirent.h>
 #include <asm/unistd.h>
 #include <linux/if.h>
 #include <linux/socket.h>
@@ -39,10 +40,12 @@
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
 #include <linux/sockios.h>
+#include <linux/mempolicy.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
 
 #include "die.h"
+#include "xmalloc.h"
 #include "xutils.h"
 #include "ring.h"
 #include "built_in.h"
@@ -651,6 +654,136 @@ int device_irq_number(const char *ifname)
 	return irq;
 }
 
+int device_numa_node(const char *ifname)
+{
+	int node = -1;
+	char buff[64];
+	char sysname[512];
+	FILE *fp;
+
+	slprintf(sysname, sizeof(sysname), "/sys/class/net/%s/device/numa_node",
+		 ifname);
+
+	/* Virtual devices have none, single node boxes report -1 */
+	fp = fopen(sysname, "r");
+	if (!fp)
+		return -1;
+
+	if (fgets(buff, sizeof(buff), fp) != NULL)
+		node = atoi(buff);
+
+	fclose(fp);
+
+	return node;
+}
+
+/* Number of RX queues of a device, at least one */
+unsigned int device_rx_queues(const char *ifname)
+{
+	unsigned int nr = 0;
+	char sysname[512];
+	struct dirent *ent;
+	DIR *dir;
+
+	slprintf(sysname, sizeof(sysname), "/sys/class/net/%s/queues", ifname);
+
+	dir = opendir(sysname);
+	if (!dir)
+		return 1;
+
+	while ((ent = readdir(dir)) != NULL) {
+		if (!strncmp(ent->d_name, "rx-", strlen("rx-")))
+			nr++;
+	}
+
+	closedir(dir);
+
+	return max(nr, 1U);
+}
+
+/* CPUs of a NUMA node into cpus, returns how many there are */
+static int numa_node_cpus(int node, cpu_set_t *cpus)
+{
+	int num = 0;
+	unsigned long from, to;
+	char buff[4096], *ptr;
+	char sysname[512];
+	FILE *fp;
+
+	CPU_ZERO(cpus);
+
+	slprintf(sysname, sizeof(sysname),
+		 "/sys/devices/system/node/node%d/cpulist", node);
+
+	fp = fopen(sysname, "r");
+	if (!fp)
+		return 0;
+
+	memset(buff, 0, sizeof(buff));
+	if (fgets(buff, sizeof(buff), fp) == NULL)
+		buff[0] = 0;
+
+	fclose(fp);
+
+	/* Such as 0-7,16-23 */
+	for (ptr = buff; isdigit(*ptr); ) {
+		from = to = strtoul(ptr, &ptr, 10);
+		if (*ptr == '-')
+			to = strtoul(ptr + 1, &ptr, 10);
+		for (; from <= to && from < CPU_SETSIZE; ++from, ++num)
+			CPU_SET(from, cpus);
+		if (*ptr == ',')
+			ptr++;
+	}
+
+	return num;
+}
+
+/* The n-th CPU of a NUMA node, wrapping around, -1 if it has none */
+int numa_node_cpu(int node, unsigned int n)
+{
+	int cpu;
+	cpu_set_t cpus;
+	int num = numa_node_cpus(node, &cpus);
+
+	if (num == 0)
+		return -1;
+
+	n %= num;
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		if (CPU_ISSET(cpu, &cpus) && n-- == 0)
+			break;
+
+	return cpu;
+}
+
+/* Runs the calling thread and its future threads on the CPUs of node */
+int numa_node_affinity(int node)
+{
+	cpu_set_t cpus;
+	int num = numa_node_cpus(node, &cpus);
+
+	if (num == 0 || sched_setaffinity(0, sizeof(cpus), &cpus))
+		return 0;
+
+	return num;
+}
+
+/* Pages the calling thread and its future threads fault in go to node */
+int numa_prefer_node(int node)
+{
+	unsigned long mask[16];
+
+	if (node < 0 || node >= (int) (sizeof(mask) * 8))
+		return -EINVAL;
+
+	memset(mask, 0, sizeof(mask));
+	mask[node / (sizeof(mask[0]) * 8)] |= 1UL << (node % (sizeof(mask[0]) * 8));
+
+	return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+		       sizeof(mask) * 8 + 1);
+}
+
 int device_set_irq_affinity_list(int irq, unsigned long from, unsigned long to)
 {
 	int ret, fd;
@@ -672,51 +805,322 @@ int device_set_irq_affinity_list(int irq, unsigned long from, unsigned long to)
 int device_bind_irq_to_cpu(int irq, int cpu)
 {
 	int ret;
-	char buff[256];
-	char file[256];
-	FILE *fp;
 
 	/* Note: first CPU begins with CPU 0 */
 	if (irq < 0 || cpu < 0)
 		return -EINVAL;
 
-	memset(file, 0, sizeof(file));
-	memset(buff, 0, sizeof(buff));
+	/* smp_affinity is a mask, the list takes CPU numbers as they are */
+	ret = device_set_irq_affinity_list(irq, cpu, cpu);
+
+	return (ret > 0 ? 0 : ret);
+}
+
+static int irq_cmp(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+struct irq_queue {
+	int queue, irq;
+};
+
+static int irq_queue_cmp(const void *a, const void *b)
+{
+	const struct irq_queue *x = a, *y = b;
+
+	if (x->queue != y->queue)
+		return x->queue - y->queue;
+
+	return x->irq - y->irq;
+}
+
+/*
+ * Finds the action of an interrupts line that names ifname, drivers put
+ * it anywhere in there (i40e-eth0-TxRx-0, mlx5_comp0@pci:0000:03:00.0).
+ * Returns its start and length, or NULL.
+ */
+static const char *irq_line_action(const char *line, const char *ifname,
+				   size_t *len)
+{
+	size_t ilen = strlen(ifname);
+	const char *ptr = line, *start;
+
+	while ((ptr = strstr(ptr, ifname)) != NULL) {
+		if ((ptr == line || !isalnum(ptr[-1])) && !isalnum(ptr[ilen])) {
+			for (start = ptr; start > line; start--) {
+				if (isspace(start[-1]) || start[-1] == ',')
+					break;
+			}
+
+			*len = (ptr - start) + strcspn(ptr, " ,\n");
+			return start;
+		}
+		ptr += ilen;
+	}
+
+	return NULL;
+}
+
+/*
+ * Queue served by a vector, from the tag in its action name, or -1 for
+ * vectors not bound to a receive queue (misc, async, tx-only, config).
+ */
+static int irq_action_queue(const char *action, size_t len)
+{
+	static const char * const tags[] = { "rx-", "comp", "input." };
+	char name[256];
+	const char *ptr;
+	unsigned int i;
+
+	len = min(len, sizeof(name) - 1);
+	memcpy(name, action, len);
+	name[len] = 0;
+
+	/* rx- also covers TxRx- */
+	for (i = 0; i < array_size(tags); ++i) {
+		ptr = strcasestr(name, tags[i]);
+		if (ptr && isdigit(ptr[strlen(tags[i])]))
+			return atoi(ptr + strlen(tags[i]));
+	}
 
-	/* smp_affinity starts counting with CPU 1, 2, ... */
-	cpu = cpu + 1;
-	sprintf(file, "/proc/irq/%d/smp_affinity", irq);
+	return -1;
+}
+
+static int irq_vectors_push(int **irqs, int nr, int *size, int irq)
+{
+	if (nr == *size) {
+		*size <<= 1;
+		*irqs = xrealloc(*irqs, *size, sizeof(**irqs));
+	}
+
+	(*irqs)[nr] = irq;
+
+	return nr + 1;
+}
+
+/*
+ * Vectors whose action is named after name. If some of them are tagged
+ * with a queue, only those are taken, in queue order, else all of them
+ * in ascending order.
+ */
+static int irq_vectors_named(const char *name, int **irqs, int *size)
+{
+	int nr = 0, irq, i, vsize = 64, queues = 0;
+	struct irq_queue *vec;
+	const char *action;
+	char buff[1024];
+	size_t len;
+	FILE *fp;
 
-	fp = fopen(file, "w");
+	fp = fopen("/proc/interrupts", "r");
 	if (!fp)
-		return -ENOENT;
+		return 0;
+
+	vec = xmalloc(vsize * sizeof(*vec));
+
+	while (fgets(buff, sizeof(buff), fp) != NULL) {
+		if (sscanf(buff, " %d:", &irq) != 1)
+			continue;
+
+		action = irq_line_action(strchr(buff, ':') + 1, name, &len);
+		if (!action)
+			continue;
 
-	sprintf(buff, "%d", cpu);
-	ret = fwrite(buff, sizeof(buff), 1, fp);
+		if (nr == vsize) {
+			vsize <<= 1;
+			vec = xrealloc(vec, vsize, sizeof(*vec));
+		}
+
+		vec[nr].irq = irq;
+		vec[nr].queue = irq_action_queue(action, len);
+		if (vec[nr].queue >= 0)
+			queues++;
+		nr++;
+	}
 
 	fclose(fp);
-	return (ret > 0 ? 0 : ret);
+
+	for (i = 0; i < nr; ++i) {
+		if (queues == 0)
+			vec[i].queue = 0;
+		else if (vec[i].queue < 0)
+			vec[i].queue = INT_MAX;
+	}
+
+	qsort(vec, nr, sizeof(*vec), irq_queue_cmp);
+
+	if (queues > 0)
+		nr = queues;
+	for (i = 0; i < nr; ++i)
+		irq_vectors_push(irqs, i, size, vec[i].irq);
+
+	xfree(vec);
+
+	return nr;
 }
 
-void sock_print_net_stats(int sock, unsigned long skipped)
+/*
+ * Interrupt vectors of a device, multi-queue NICs have one per queue.
+ * Actions named after the interface in /proc/interrupts come first, then
+ * those named after its bus device (as virtio and mlx5 do), both in queue
+ * order if the names carry one. Only then the MSI vectors of the PCI
+ * device in ascending order, which may include misc vectors and so are
+ * not in step with the queues, then its legacy interrupt.
+ */
+int device_irq_vectors(const char *ifname, int **irqs)
 {
-	int ret;
-	struct tpacket_stats kstats;
+	int nr, size = 64, irq;
+	char sysname[512], link[512];
+	struct dirent *ent;
+	ssize_t len;
+	DIR *dir;
 
-	socklen_t slen = sizeof(kstats);
+	*irqs = xmalloc(size * sizeof(**irqs));
 
-	memset(&kstats, 0, sizeof(kstats));
-	ret = getsockopt(sock, SOL_PACKET, PACKET_STATISTICS, &kstats, &slen);
-	if (ret > -1) {
-		uint64_t packets = kstats.tp_packets;
-		uint64_t drops = kstats.tp_drops;
+	nr = irq_vectors_named(ifname, irqs, &size);
+	if (nr > 0)
+		return nr;
 
-		printf("\r%12ld  packets incoming\n", packets);
-		printf("\r%12ld  packets passed filter\n", packets - drops - skipped);
-		printf("\r%12ld  packets failed filter (out of space)\n", drops + skipped);
-		if (kstats.tp_packets > 0)
-			printf("\r%12.4lf%\% packet droprate\n", (1.0 * drops / packets) * 100.0);
+	slprintf(sysname, sizeof(sysname), "/sys/class/net/%s/device", ifname);
+
+	len = readlink(sysname, link, sizeof(link) - 1);
+	if (len > 0) {
+		link[len] = 0;
+		nr = irq_vectors_named(basename(link), irqs, &size);
+		if (nr > 0)
+			return nr;
 	}
+
+	slprintf(sysname, sizeof(sysname), "/sys/class/net/%s/device/msi_irqs",
+		 ifname);
+
+	dir = opendir(sysname);
+	if (dir) {
+		while ((ent = readdir(dir)) != NULL) {
+			if (isdigit(ent->d_name[0]))
+				nr = irq_vectors_push(irqs, nr, &size,
+						      atoi(ent->d_name));
+		}
+
+		closedir(dir);
+	}
+
+	if (nr == 0 && strncmp("lo", ifname, strlen("lo"))) {
+		irq = device_irq_number(ifname);
+		if (irq > 0)
+			nr = irq_vectors_push(irqs, nr, &size, irq);
+	}
+
+	qsort(*irqs, nr, sizeof(**irqs), irq_cmp);
+
+	return nr;
+}
+
+/*
+ * Binds vector i of a device to cpus[i % ncpus], so that with one vector
+ * per queue, queue i is served on that CPU. Former affinities are kept in
+ * aff, along with open files, so that they can be restored even after
+ * privileges are dropped. Returns the number of vectors bound.
+ */
+int device_spread_irqs(const char *ifname, const int *cpus,
+		       unsigned int ncpus, struct irq_affinity *aff)
+{
+	int *irqs, nr, i, fd, ret, bound = 0;
+	char file[256], list[64];
+
+	memset(aff, 0, sizeof(*aff));
+
+	if (ncpus == 0)
+		return 0;
+
+	nr = device_irq_vectors(ifname, &irqs);
+
+	aff->vec = xzmalloc(max(nr, 1) * sizeof(*aff->vec));
+
+	for (i = 0; i < nr; ++i) {
+		struct irq_vector *vec = &aff->vec[aff->nr];
+
+		slprintf(file, sizeof(file), "/proc/irq/%d/smp_affinity_list",
+			 irqs[i]);
+
+		fd = open(file, O_RDWR);
+		if (fd < 0)
+			continue;
+
+		memset(vec->saved, 0, sizeof(vec->saved));
+		ret = read(fd, vec->saved, sizeof(vec->saved) - 1);
+		if (ret <= 0) {
+			close(fd);
+			continue;
+		}
+
+		vec->irq = irqs[i];
+		vec->cpu = cpus[i % ncpus];
+		vec->fd = fd;
+		aff->nr++;
+
+		/* Managed vectors refuse to move, they are left untouched */
+		slprintf(list, sizeof(list), "%d\n", vec->cpu);
+		if (lseek(fd, 0, SEEK_SET) == 0 &&
+		    write(fd, list, strlen(list)) > 0)
+			bound++;
+		else
+			vec->cpu = -1;
+	}
+
+	xfree(irqs);
+
+	return bound;
+}
+
+void device_restore_irqs(struct irq_affinity *aff)
+{
+	unsigned int i;
+
+	for (i = 0; i < aff->nr; ++i) {
+		struct irq_vector *vec = &aff->vec[i];
+
+		/* Proc files cannot pwrite, seek back instead */
+		if (vec->cpu >= 0 && (lseek(vec->fd, 0, SEEK_SET) != 0 ||
+		    write(vec->fd, vec->saved, strlen(vec->saved)) < 0))
+			printf("Cannot restore affinity of IRQ %d!\n",
+			       vec->irq);
+		close(vec->fd);
+	}
+
+	if (aff->vec)
+		xfree(aff->vec);
+
+	memset(aff, 0, sizeof(*aff));
+}
+
+int sock_get_net_stats(int sock, struct tpacket_stats *kstats)
+{
+	socklen_t slen = sizeof(*kstats);
+
+	memset(kstats, 0, sizeof(*kstats));
+	return getsockopt(sock, SOL_PACKET, PACKET_STATISTICS, kstats, &slen);
+}
+
+void print_net_stats(struct tpacket_stats *kstats, unsigned long skipped)
+{
+	uint64_t packets = kstats->tp_packets;
+	uint64_t drops = kstats->tp_drops;
+
+	printf("\r%12ld  packets incoming\n", packets);
+	printf("\r%12ld  packets passed filter\n", packets - drops - skipped);
+	printf("\r%12ld  packets failed filter (out of space)\n", drops + skipped);
+	if (kstats->tp_packets > 0)
+		printf("\r%12.4lf%\% packet droprate\n", (1.0 * drops / packets) * 100.0);
+}
+
+void sock_print_net_stats(int sock, unsigned long skipped)
+{
+	struct tpacket_stats kstats;
+
+	if (sock_get_net_stats(sock, &kstats) > -1)
+		print_net_stats(&kstats, skipped);
 }
 
 void register_signal(int signal, void (*handler)(int))
@@ -812,8 +1216,8 @@ void cpu_affinity(int cpu)
 	CPU_ZERO(&cpu_bitmask);
 	CPU_SET(cpu, &cpu_bitmask);
 
-	ret = sched_setaffinity(getpid(), sizeof(cpu_bitmask),
-				&cpu_bitmask);
+	/* 0 is the calling thread, so workers can pin themselves */
+	ret = sched_setaffinity(0, sizeof(cpu_bitmask), &cpu_bitmask);
 	if (ret)
 		panic("Can't set this cpu affinity!\n");
 }
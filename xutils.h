@@ -16,6 +16,7 @@
 #include <unistd.h>
 #include <linux/ethtool.h>
 #include <linux/if.h>
+#include <linux/if_packet.h>
 #include <linux/wireless.h>
 #include <poll.h>
 #include <sys/poll.h>
@@ -26,6 +27,17 @@
 
 #include "built_in.h"
 
+struct irq_vector {
+	int irq, cpu, fd;
+	char saved[256];
+};
+
+/* Interrupt vectors of a device bound to CPUs, see device_spread_irqs() */
+struct irq_affinity {
+	unsigned int nr;
+	struct irq_vector *vec;
+};
+
 extern int af_socket(int af);
 extern int pf_socket(void);
 extern int wireless_sigqual(const char *ifname, struct iw_statistics *stats);
@@ -38,8 +50,19 @@ extern int ethtool_link(const char *ifname);
 extern int device_mtu(const char *ifname);
 extern int device_address(const char *ifname, int af, struct sockaddr_storage *ss);
 extern int device_irq_number(const char *ifname);
+extern int device_numa_node(const char *ifname);
+extern int numa_node_cpu(int node, unsigned int n);
+extern int numa_node_affinity(int node);
+extern int numa_prefer_node(int node);
 extern int device_set_irq_affinity_list(int irq, unsigned long from, unsigned long to);
 extern int device_bind_irq_to_cpu(int irq, int cpu);
+extern int device_irq_vectors(const char *ifname, int **irqs);
+extern unsigned int device_rx_queues(const char *ifname);
+extern int device_spread_irqs(const char *ifname, const int *cpus,
+			      unsigned int ncpus, struct irq_affinity *aff);
+extern void device_restore_irqs(struct irq_affinity *aff);
+extern int sock_get_net_stats(int sock, struct tpacket_stats *kstats);
+extern void print_net_stats(struct tpacket_stats *kstats, unsigned long skipped);
 extern void sock_print_net_stats(int sock, unsigned long skipped);
 extern int device_ifindex(const char *ifname);
 extern short device_get_flags(const char *ifname);